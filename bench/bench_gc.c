@@ -0,0 +1,955 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../src/gc.c"
+
+/*
+ * Benchmarks for the garbage collector internals.
+ *
+ * Like the tests, the benchmarks include gc.c directly in order to time
+ * the individual phases of a collection.
+ *
+ * Usage: bench_gc [-f text|csv|json] [-o FILE] [GROUP...]
+ *
+ * Every benchmark prints a summary line. With `-f csv` or `-f json`, its
+ * results are also written as one record per metric, to FILE or to stdout
+ * (the summary lines then go to stderr). The GROUP arguments select
+ * benchmarks by the first word of their summary, e.g. `mark` or `map`.
+ */
+
+static uint64_t bench_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+typedef enum BenchFormat {
+    BENCH_TEXT,
+    BENCH_CSV,
+    BENCH_JSON
+} BenchFormat;
+
+static BenchFormat bench_format = BENCH_TEXT;
+static FILE* bench_text;       // summary lines
+static FILE* bench_records;    // machine-readable results
+static size_t bench_nrecords;
+
+#define bench_printf(...) fprintf(bench_text, __VA_ARGS__)
+
+/*
+ * Record a result of `benchmark`. The parameters are formatted from `fmt`
+ * as space-separated `key=value` pairs.
+ */
+static void bench_result(const char* benchmark, const char* metric, double value,
+                         const char* unit, const char* fmt, ...)
+{
+    if (bench_format == BENCH_TEXT) {
+        return;
+    }
+    char params[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(params, sizeof(params), fmt, args);
+    va_end(args);
+    if (bench_format == BENCH_CSV) {
+        if (bench_nrecords == 0) {
+            fprintf(bench_records, "benchmark,params,metric,value,unit\n");
+        }
+        fprintf(bench_records, "%s,%s,%s,%.6g,%s\n", benchmark, params, metric, value, unit);
+    } else {
+        fprintf(bench_records, "%s\n  {\"benchmark\": \"%s\", \"params\": \"%s\", "
+                "\"metric\": \"%s\", \"value\": %.6g, \"unit\": \"%s\"}",
+                bench_nrecords == 0 ? "[" : ",", benchmark, params, metric, value, unit);
+    }
+    bench_nrecords++;
+    fflush(bench_records);
+}
+
+typedef struct BenchNode {
+    struct BenchNode* next;
+    struct BenchNode* other;
+    size_t payload[6];
+} BenchNode;
+
+/*
+ * Build a linked list of `n` nodes with random cross references and return
+ * its head. The list is rooted through `gc_make_static()`.
+ */
+static BenchNode* bench_build_graph(GarbageCollector* gc, size_t n)
+{
+    BenchNode** nodes = malloc(n * sizeof(BenchNode*));
+    for (size_t i = 0; i < n; ++i) {
+        nodes[i] = gc_calloc(gc, 1, sizeof(BenchNode));
+        for (size_t j = 0; j < 6; ++j) {
+            nodes[i]->payload[j] = (size_t) rand();
+        }
+    }
+    for (size_t i = 0; i < n; ++i) {
+        nodes[i]->next = i + 1 < n ? nodes[i + 1] : NULL;
+        nodes[i]->other = nodes[(size_t) rand() % n];
+    }
+    BenchNode* head = nodes[0];
+    free(nodes);
+    return gc_make_static(gc, head);
+}
+
+static void bench_mark(size_t n, size_t reps, AllocationMapSizing sizing)
+{
+    GarbageCollector gc_;
+    GarbageCollectorConfig config;
+    gc_config_default(&config);
+    config.sizing = sizing;
+    void* bos = __builtin_frame_address(0);
+    gc_start_config(&gc_, bos, &config);
+    gc_pause(&gc_);
+    bench_build_graph(&gc_, n);
+    uint64_t total = 0;
+    for (size_t r = 0; r < reps; ++r) {
+        uint64_t start = bench_now_ns();
+        gc_mark(&gc_);
+        total += bench_now_ns() - start;
+        gc_sweep(&gc_);
+    }
+    bench_printf("mark (step=%d, %s): %zu objects, %.3f ms/cycle\n",
+           (int) GC_SCAN_STEP, sizing == GC_SIZING_POW2 ? "pow2" : "prime",
+           n, (double) total / reps / 1e6);
+    bench_result("mark", "time", (double) total / reps / 1e6, "ms", "objects=%zu sizing=%s",
+                 n, sizing == GC_SIZING_POW2 ? "pow2" : "prime");
+    gc_stop(&gc_);
+}
+
+typedef enum BenchShape {
+    BENCH_LIST,    // a linked list in allocation order
+    BENCH_TREE,    // a binary tree in breadth-first allocation order
+    BENCH_RANDOM   // a list in random order with random cross references
+} BenchShape;
+
+static const char* bench_shape_names[] = { "list", "tree", "random" };
+
+/*
+ * Build a heap of `n` nodes of the given shape and return its root, which
+ * is rooted through `gc_make_static()`.
+ */
+static BenchNode* bench_build_shape(GarbageCollector* gc, size_t n, BenchShape shape)
+{
+    BenchNode** nodes = malloc(n * sizeof(BenchNode*));
+    for (size_t i = 0; i < n; ++i) {
+        nodes[i] = gc_calloc(gc, 1, sizeof(BenchNode));
+    }
+    if (shape == BENCH_RANDOM) {
+        /* Shuffle all but the root, the list then jumps around the heap */
+        for (size_t i = n - 1; i > 1; --i) {
+            size_t j = 1 + (size_t) rand() % i;
+            BenchNode* tmp = nodes[i];
+            nodes[i] = nodes[j];
+            nodes[j] = tmp;
+        }
+    }
+    for (size_t i = 0; i < n; ++i) {
+        if (shape == BENCH_TREE) {
+            nodes[i]->next = 2 * i + 1 < n ? nodes[2 * i + 1] : NULL;
+            nodes[i]->other = 2 * i + 2 < n ? nodes[2 * i + 2] : NULL;
+        } else {
+            nodes[i]->next = i + 1 < n ? nodes[i + 1] : NULL;
+            nodes[i]->other = shape == BENCH_RANDOM ? nodes[(size_t) rand() % n] : NULL;
+        }
+    }
+    BenchNode* root = nodes[0];
+    free(nodes);
+    return gc_make_static(gc, root);
+}
+
+static void bench_mark_shape(size_t n, size_t reps, BenchShape shape)
+{
+    GarbageCollector gc_;
+    gc_start(&gc_, __builtin_frame_address(0));
+    gc_pause(&gc_);
+    bench_build_shape(&gc_, n, shape);
+    uint64_t total = 0;
+    for (size_t r = 0; r < reps; ++r) {
+        uint64_t start = bench_now_ns();
+        gc_mark(&gc_);
+        total += bench_now_ns() - start;
+        gc_sweep(&gc_);
+    }
+    bench_printf("mark (%s): %zu objects, %.3f ms/cycle\n",
+                 bench_shape_names[shape], n, (double) total / reps / 1e6);
+    bench_result("mark_shape", "time", (double) total / reps / 1e6, "ms",
+                 "objects=%zu shape=%s", n, bench_shape_names[shape]);
+    gc_stop(&gc_);
+}
+
+/*
+ * Mark a graph of `n` objects with and without interior pointer support.
+ * In the latter case, every other `other` reference points into the middle
+ * of its target.
+ */
+static void bench_mark_parallel(size_t n, size_t reps, size_t threads)
+{
+    GarbageCollector gc_;
+    GarbageCollectorConfig config;
+    gc_config_default(&config);
+    config.mark_threads = threads;
+    void* bos = __builtin_frame_address(0);
+    gc_start_config(&gc_, bos, &config);
+    gc_pause(&gc_);
+    bench_build_graph(&gc_, n);
+    uint64_t total = 0;
+    for (size_t r = 0; r < reps; ++r) {
+        uint64_t start = bench_now_ns();
+        gc_mark(&gc_);
+        total += bench_now_ns() - start;
+        gc_sweep(&gc_);
+    }
+    bench_printf("mark (threads=%zu): %zu objects, %.3f ms/cycle\n",
+           threads, n, (double) total / reps / 1e6);
+    bench_result("mark_parallel", "time", (double) total / reps / 1e6, "ms",
+                 "objects=%zu threads=%zu", n, threads);
+    gc_stop(&gc_);
+}
+
+static void bench_mark_interior(size_t n, size_t reps, bool interior)
+{
+    GarbageCollector gc_;
+    GarbageCollectorConfig config;
+    gc_config_default(&config);
+    config.interior_pointers = interior;
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    gc_pause(&gc_);
+    BenchNode* head = bench_build_graph(&gc_, n);
+    for (BenchNode* node = head; interior && node; node = node->next) {
+        if ((uintptr_t) node & 16) {
+            node->other = (BenchNode*) &node->other->payload[2];
+        }
+    }
+    uint64_t total = 0;
+    for (size_t r = 0; r < reps; ++r) {
+        uint64_t start = bench_now_ns();
+        gc_mark(&gc_);
+        total += bench_now_ns() - start;
+        gc_sweep(&gc_);
+    }
+    bench_printf("mark (interior %s): %zu objects, %.3f ms/cycle\n",
+           interior ? "on" : "off", n, (double) total / reps / 1e6);
+    bench_result("mark_interior", "time", (double) total / reps / 1e6, "ms",
+                 "objects=%zu interior=%d", n, (int) interior);
+    gc_stop(&gc_);
+}
+
+/*
+ * Mark a heap of `n` rooted buffers of `size` bytes that hold integer and
+ * floating point data rather than pointers.
+ */
+static void bench_mark_data(size_t n, size_t size, size_t reps)
+{
+    GarbageCollector gc_;
+    void* bos = __builtin_frame_address(0);
+    gc_start(&gc_, bos);
+    gc_pause(&gc_);
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t* words = gc_malloc_static(&gc_, size, NULL);
+        for (size_t j = 0; j < size / sizeof(uint64_t); ++j) {
+            double d = (double) rand() / RAND_MAX;
+            if (j % 2) {
+                memcpy(&words[j], &d, sizeof(double));
+            } else {
+                words[j] = (uint64_t) rand() % 1024;
+            }
+        }
+    }
+    uint64_t total = 0;
+    for (size_t r = 0; r < reps; ++r) {
+        uint64_t start = bench_now_ns();
+        gc_mark(&gc_);
+        total += bench_now_ns() - start;
+        gc_sweep(&gc_);
+    }
+    bench_printf("mark data (step=%d): %zu x %zu bytes, %.3f ms/cycle\n",
+           (int) GC_SCAN_STEP, n, size, (double) total / reps / 1e6);
+    bench_result("mark_data", "time", (double) total / reps / 1e6, "ms",
+                 "objects=%zu size=%zu", n, size);
+    gc_stop(&gc_);
+}
+
+/*
+ * Sweep a heap of `n` objects of which a share of `garbage` is unreachable.
+ * The map is kept at a load factor close to the maximum to create long
+ * probe sequences.
+ */
+static void bench_sweep(size_t n, double garbage, size_t reps)
+{
+    uint64_t total = 0;
+    for (size_t r = 0; r < reps; ++r) {
+        GarbageCollector gc_;
+        GarbageCollectorConfig config;
+        gc_config_default(&config);
+        config.upsize_load_factor = 0.89;
+        config.downsize_load_factor = 1e-9;
+        gc_start_config(&gc_, __builtin_frame_address(0), &config);
+        gc_pause(&gc_);
+        for (size_t i = 0; i < n; ++i) {
+            gc_malloc(&gc_, 16);
+        }
+        AllocationMap* am = gc_.allocs;
+        for (size_t i = 0; i < am->capacity; ++i) {
+            if (am->allocs[i].ptr && (double) rand() / RAND_MAX >= garbage) {
+                gc_allocation_map_mark(am, &am->allocs[i]);
+            }
+        }
+        uint64_t start = bench_now_ns();
+        gc_sweep(&gc_);
+        total += bench_now_ns() - start;
+        gc_stop(&gc_);
+    }
+    bench_printf("sweep: %zu objects, %.0f%% garbage, %.3f ms/cycle\n",
+           n, garbage * 100, (double) total / reps / 1e6);
+    bench_result("sweep", "time", (double) total / reps / 1e6, "ms",
+                 "objects=%zu garbage=%.2f", n, garbage);
+}
+
+/*
+ * Allocate `n` short-lived objects of 16 to 128 bytes with the collector
+ * running, i.e. including all collections triggered by the allocations.
+ */
+static void bench_slow_dtor(void* ptr)
+{
+    /* stands in for a destructor that does real work, e.g. closes a handle */
+    volatile size_t sum = 0;
+    for (size_t i = 0; i < 256; ++i) {
+        sum += ((unsigned char*) ptr)[i % 32] + i;
+    }
+}
+
+static void bench_sweep_finalizers(size_t n, double garbage, size_t reps,
+                                   bool deferred, size_t threads)
+{
+    uint64_t pause = 0;
+    uint64_t finalize = 0;
+    for (size_t r = 0; r < reps; ++r) {
+        GarbageCollector gc_;
+        GarbageCollectorConfig config;
+        gc_config_default(&config);
+        config.upsize_load_factor = 0.89;
+        config.downsize_load_factor = 1e-9;
+        config.deferred_finalizers = deferred;
+        config.mark_threads = threads;
+        gc_start_config(&gc_, __builtin_frame_address(0), &config);
+        gc_pause(&gc_);
+        for (size_t i = 0; i < n; ++i) {
+            gc_calloc_ext(&gc_, 1, 32, i % 2 ? bench_slow_dtor : NULL);
+        }
+        AllocationMap* am = gc_.allocs;
+        for (size_t i = 0; i < am->capacity; ++i) {
+            if (am->allocs[i].ptr && (double) rand() / RAND_MAX >= garbage) {
+                gc_allocation_map_mark(am, &am->allocs[i]);
+            }
+        }
+        uint64_t start = bench_now_ns();
+        gc_sweep(&gc_);
+        uint64_t end = bench_now_ns();
+        gc_run_finalizers(&gc_);
+        pause += end - start;
+        finalize += bench_now_ns() - end;
+        gc_stop(&gc_);
+    }
+    bench_printf("sweep (%s, threads=%zu): %zu objects, %.0f%% garbage, "
+           "%.3f ms pause + %.3f ms finalizers\n",
+           deferred ? "deferred" : "inline", threads, n, garbage * 100,
+           (double) pause / reps / 1e6, (double) finalize / reps / 1e6);
+    bench_result("sweep_finalizers", "pause", (double) pause / reps / 1e6, "ms",
+                 "objects=%zu garbage=%.2f deferred=%d threads=%zu", n, garbage,
+                 (int) deferred, threads);
+    bench_result("sweep_finalizers", "finalizers", (double) finalize / reps / 1e6, "ms",
+                 "objects=%zu garbage=%.2f deferred=%d threads=%zu", n, garbage,
+                 (int) deferred, threads);
+}
+
+static void bench_lazy_sweep(size_t n, size_t reps, bool lazy)
+{
+    uint64_t pause = 0;
+    uint64_t mutator = 0;
+    for (size_t r = 0; r < reps; ++r) {
+        GarbageCollector gc_;
+        GarbageCollectorConfig config;
+        gc_config_default(&config);
+        config.size_classes = true;
+        config.lazy_sweep = lazy;
+        /* no further collections while the mutator allocates */
+        config.sweep_factor = 1e9;
+        gc_start_config(&gc_, __builtin_frame_address(0), &config);
+        gc_pause(&gc_);
+        bench_build_graph(&gc_, n);
+        for (size_t i = 0; i < n; ++i) {
+            gc_malloc(&gc_, i % 2 ? 32 : 300);
+        }
+        uint64_t start = bench_now_ns();
+        gc_run(&gc_);
+        pause += bench_now_ns() - start;
+        /* the mutator allocates as much again, finishing a lazy sweep */
+        gc_resume(&gc_);
+        start = bench_now_ns();
+        for (size_t i = 0; i < n; ++i) {
+            gc_malloc(&gc_, i % 2 ? 32 : 300);
+        }
+        mutator += bench_now_ns() - start;
+        gc_stop(&gc_);
+    }
+    bench_printf("collect (%s sweep): %zu live + %zu dead objects, "
+           "%.3f ms pause, %.3f ms for %zu allocations\n",
+           lazy ? "lazy" : "eager", n, n, (double) pause / reps / 1e6,
+           (double) mutator / reps / 1e6, n);
+    bench_result("lazy_sweep", "pause", (double) pause / reps / 1e6, "ms",
+                 "objects=%zu lazy=%d", n, (int) lazy);
+    bench_result("lazy_sweep", "mutator", (double) mutator / reps / 1e6, "ms",
+                 "objects=%zu lazy=%d", n, (int) lazy);
+}
+
+static void bench_incremental(size_t n, size_t reps, bool incremental, bool concurrent)
+{
+    uint64_t max_pause = 0;
+    uint64_t mutator = 0;
+    for (size_t r = 0; r < reps; ++r) {
+        GarbageCollector gc_;
+        GarbageCollectorConfig config;
+        gc_config_default(&config);
+        config.incremental_marking = incremental;
+        config.concurrent_marking = concurrent;
+        config.lazy_sweep = incremental || concurrent;
+        gc_start_config(&gc_, __builtin_frame_address(0), &config);
+        gc_pause(&gc_);
+        bench_build_graph(&gc_, n);
+        gc_resume(&gc_);
+        /* the mutator allocates garbage until collections kick in, the
+         * longest single allocation is the worst-case pause */
+        uint64_t start = bench_now_ns();
+        for (size_t i = 0; i < 2 * n; ++i) {
+            uint64_t t0 = bench_now_ns();
+            gc_malloc(&gc_, 64);
+            uint64_t dt = bench_now_ns() - t0;
+            max_pause = dt > max_pause ? dt : max_pause;
+        }
+        mutator += bench_now_ns() - start;
+        gc_stop(&gc_);
+    }
+    bench_printf("allocate (%s mark): %zu live objects, %.3f ms max pause, "
+           "%.3f ms for %zu allocations\n",
+           concurrent ? "concurrent" : incremental ? "incremental" : "stop-the-world", n,
+           (double) max_pause / 1e6, (double) mutator / reps / 1e6, 2 * n);
+    const char* mode = concurrent ? "concurrent" : incremental ? "incremental" : "stw";
+    bench_result("incremental", "max_pause", (double) max_pause / 1e6, "ms",
+                 "objects=%zu mode=%s", n, mode);
+    bench_result("incremental", "mutator", (double) mutator / reps / 1e6, "ms",
+                 "objects=%zu mode=%s", n, mode);
+}
+
+static void bench_generational(size_t n, size_t allocs, bool generational)
+{
+    GarbageCollector gc_;
+    GarbageCollectorConfig config;
+    gc_config_default(&config);
+    config.generational = generational;
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    gc_pause(&gc_);
+    bench_build_graph(&gc_, n);
+    /* the last few objects stay reachable through an old window */
+    size_t window = 64;
+    void** recent = gc_calloc(&gc_, window, sizeof(void*));
+    gc_make_static(&gc_, recent);
+    gc_run(&gc_);
+    gc_resume(&gc_);
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < allocs; ++i) {
+        recent[i % window] = gc_malloc(&gc_, 64);
+        gc_write_barrier(&gc_, recent);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    gc_stop(&gc_);
+    bench_printf("allocate (%s): %zu old objects, %.3f ms for %zu short-lived allocations\n",
+           generational ? "generational" : "non-generational", n,
+           (double) elapsed / 1e6, allocs);
+    bench_result("generational", "time", (double) elapsed / 1e6, "ms",
+                 "objects=%zu allocs=%zu generational=%d", n, allocs, (int) generational);
+}
+
+#ifndef GC_NO_THREADS
+typedef struct {
+    GarbageCollector* gc;
+    size_t allocs;
+} BenchMutator;
+
+static void* bench_mutate(void* arg)
+{
+    BenchMutator* m = arg;
+    gc_register_thread(m->gc, __builtin_frame_address(0));
+    for (size_t i = 0; i < m->allocs; ++i) {
+        gc_malloc(m->gc, 64);
+    }
+    gc_unregister_thread(m->gc);
+    return NULL;
+}
+
+/*
+ * Time `nthreads` mutator threads that share `allocs` short-lived small
+ * allocations over a heap of `n` old objects, with or without thread caches.
+ * With `nthreads == 0` the calling thread allocates alone on a
+ * single-threaded collector.
+ */
+static void bench_threads(size_t n, size_t allocs, size_t nthreads, bool caches)
+{
+    GarbageCollector gc_;
+    GarbageCollectorConfig config;
+    gc_config_default(&config);
+    config.size_classes = true;
+    config.multi_threaded = nthreads > 0;
+    config.thread_caches = caches;
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    gc_pause(&gc_);
+    bench_build_graph(&gc_, n);
+    gc_run(&gc_);
+    gc_resume(&gc_);
+    uint64_t start = bench_now_ns();
+    if (nthreads == 0) {
+        for (size_t i = 0; i < allocs; ++i) {
+            gc_malloc(&gc_, 64);
+        }
+    } else {
+        pthread_t threads[nthreads];
+        BenchMutator m = { .gc = &gc_, .allocs = allocs / nthreads };
+        for (size_t i = 0; i < nthreads; ++i) {
+            pthread_create(&threads[i], NULL, bench_mutate, &m);
+        }
+        for (size_t i = 0; i < nthreads; ++i) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    gc_stop(&gc_);
+    if (nthreads == 0) {
+        bench_printf("allocate (single-threaded): ");
+    } else {
+        bench_printf("allocate (%zu mutator thread%s, %s): ", nthreads, nthreads > 1 ? "s" : "",
+               caches ? "thread caches" : "locked");
+    }
+    bench_printf("%zu old objects, %.2f ns/alloc, %.2f Mallocs/s\n", n, (double) elapsed / allocs,
+           (double) allocs * 1e3 / elapsed);
+    bench_result("threads", "alloc", (double) elapsed / allocs, "ns",
+                 "objects=%zu threads=%zu caches=%d", n, nthreads, (int) caches);
+}
+#endif
+
+/*
+ * Allocate `allocs` objects over a heap of `n` old objects, then report the
+ * collector statistics and the time it takes to read them.
+ */
+static void bench_stats(size_t n, size_t allocs, size_t reads)
+{
+    GarbageCollector gc_;
+    GarbageCollectorConfig config;
+    gc_config_default(&config);
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    gc_pause(&gc_);
+    bench_build_graph(&gc_, n);
+    gc_resume(&gc_);
+    for (size_t i = 0; i < allocs; ++i) {
+        gc_malloc(&gc_, 16 + (size_t) rand() % 241);
+    }
+    GarbageCollectorStats stats;
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < reads; ++i) {
+        gc_stats(&gc_, &stats);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    bench_printf("stats: %zu collections, %.3f ms marking (last %.3f), %.3f ms sweeping "
+           "(last %.3f), %zu objects freed, %zu live, peak %zu KiB\n",
+           stats.collections, (double) stats.mark_ns / 1e6, (double) stats.last_mark_ns / 1e6,
+           (double) stats.sweep_ns / 1e6, (double) stats.last_sweep_ns / 1e6,
+           stats.freed_objects, stats.live_objects, stats.peak_bytes / 1024);
+    bench_printf("stats: map %zu/%zu (load %.2f, longest probe %zu), %.2f ns/gc_stats()\n",
+           stats.map_size, stats.map_capacity, stats.map_load_factor, stats.map_max_probe,
+           (double) elapsed / reads);
+    bench_result("stats", "read", (double) elapsed / reads, "ns", "objects=%zu allocs=%zu",
+                 n, allocs);
+    gc_stop(&gc_);
+}
+
+static void bench_count_event(GarbageCollector* gc, const GarbageCollectorEvent* event, void* data)
+{
+    (void) gc;
+    (void) event;
+    (*(size_t*) data)++;
+}
+
+static void bench_hooks(size_t n, size_t allocs, bool hooks)
+{
+    GarbageCollector gc_;
+    GarbageCollectorConfig config;
+    gc_config_default(&config);
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    size_t events = 0;
+    for (int type = 0; hooks && type < GC_EVENT_COUNT; ++type) {
+        gc_register_hook(&gc_, (GarbageCollectorEventType) type, bench_count_event, &events);
+    }
+    gc_pause(&gc_);
+    bench_build_graph(&gc_, n);
+    gc_resume(&gc_);
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < allocs; ++i) {
+        gc_malloc(&gc_, 16 + (size_t) rand() % 241);
+    }
+    uint64_t total = bench_now_ns() - start;
+    GarbageCollectorStats stats;
+    gc_stats(&gc_, &stats);
+    bench_printf("hooks (%s): %zu allocs, %zu collections, %zu events, %.2f ns/alloc\n",
+           hooks ? "all events" : "none", allocs, stats.collections, events,
+           (double) total / allocs);
+    bench_result("hooks", "alloc", (double) total / allocs, "ns", "objects=%zu hooks=%d",
+                 n, (int) hooks);
+    gc_stop(&gc_);
+}
+
+#ifndef GC_NO_THREADS
+typedef struct BenchTrace {
+    size_t messages;
+    FILE* out;  // fprintf() to this stream instead of tracing, if set
+} BenchTrace;
+
+static void* bench_trace_thread(void* arg)
+{
+    BenchTrace* t = (BenchTrace*) arg;
+    for (size_t i = 0; i < t->messages; ++i) {
+        if (t->out) {
+            fprintf(t->out, "[bench] Checking allocation (ptr=%p) @%zu\n", (void*) t, i);
+        } else {
+            log_trace("[bench] Checking allocation (ptr=%p) @%zu", (void*) t, i);
+        }
+    }
+    return NULL;
+}
+
+static void bench_trace(size_t messages, size_t nthreads, bool ring)
+{
+    BenchTrace t = { messages, ring ? NULL : fopen("/dev/null", "w") };
+    if (t.out) {
+        /* Like stderr */
+        setvbuf(t.out, NULL, _IONBF, 0);
+    }
+    pthread_t threads[nthreads];
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < nthreads; ++i) {
+        pthread_create(&threads[i], NULL, bench_trace_thread, &t);
+    }
+    for (size_t i = 0; i < nthreads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    uint64_t total = bench_now_ns() - start;
+    bench_printf("trace (%s): %zu threads, %zu messages each, %.2f ns/message\n",
+           ring ? "ring buffer" : "unbuffered fprintf", nthreads, messages,
+           (double) total / (messages * nthreads));
+    bench_result("trace", "message", (double) total / (messages * nthreads), "ns",
+                 "threads=%zu sink=%s", nthreads, ring ? "ring" : "fprintf");
+    if (t.out) {
+        fclose(t.out);
+    }
+}
+#endif
+
+static void bench_alloc(size_t n, bool size_classes)
+{
+    GarbageCollector gc_;
+    GarbageCollectorConfig config;
+    gc_config_default(&config);
+    config.size_classes = size_classes;
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < n; ++i) {
+        gc_malloc(&gc_, 16 + (size_t) rand() % 113);
+    }
+    uint64_t total = bench_now_ns() - start;
+    bench_printf("alloc (%s): %zu objects of 16-128 bytes, %.2f ns/alloc\n",
+           size_classes ? "size classes" : "malloc", n, (double) total / n);
+    bench_result("alloc", "alloc", (double) total / n, "ns",
+                 "objects=%zu size=16-128 size_classes=%d", n, (int) size_classes);
+    gc_stop(&gc_);
+}
+
+/*
+ * Allocate `n` short-lived objects of `size` bytes with the collector
+ * running, i.e. including all collections triggered by the allocations.
+ */
+static void bench_alloc_size(size_t n, size_t size, bool size_classes)
+{
+    GarbageCollector gc_;
+    GarbageCollectorConfig config;
+    gc_config_default(&config);
+    config.size_classes = size_classes;
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < n; ++i) {
+        gc_malloc(&gc_, size);
+    }
+    uint64_t total = bench_now_ns() - start;
+    bench_printf("alloc (%s): %zu objects of %zu bytes, %.2f ns/alloc\n",
+                 size_classes ? "size classes" : "malloc", n, size, (double) total / n);
+    bench_result("alloc", "alloc", (double) total / n, "ns",
+                 "objects=%zu size=%zu size_classes=%d", n, size, (int) size_classes);
+    gc_stop(&gc_);
+}
+
+typedef enum BenchRealloc {
+    BENCH_REALLOC_APPEND,  // grow a buffer by 16 bytes at a time
+    BENCH_REALLOC_DOUBLE,  // grow buffers by doubling, up to 64 KiB
+    BENCH_REALLOC_RESIZE   // resize small objects to random sizes up to 256 bytes
+} BenchRealloc;
+
+static const char* bench_realloc_names[] = { "append", "double", "resize" };
+
+/*
+ * Time `n` calls of `gc_realloc()` in one of the patterns above, with the
+ * collector running.
+ */
+static void bench_realloc(size_t n, BenchRealloc pattern, bool size_classes)
+{
+    GarbageCollector gc_;
+    GarbageCollectorConfig config;
+    gc_config_default(&config);
+    config.size_classes = size_classes;
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    size_t window = 256;
+    void** objects = gc_calloc(&gc_, window, sizeof(void*));
+    gc_make_static(&gc_, objects);
+    void* buf = NULL;
+    size_t size = 0;
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < n; ++i) {
+        if (pattern == BENCH_REALLOC_APPEND) {
+            /* Start over once the buffer has reached 64 KiB */
+            size = size < (1 << 16) ? size + 16 : 16;
+            buf = gc_realloc(&gc_, size == 16 ? NULL : buf, size);
+        } else if (pattern == BENCH_REALLOC_DOUBLE) {
+            size = size && size < (1 << 16) ? 2 * size : 16;
+            buf = gc_realloc(&gc_, size == 16 ? NULL : buf, size);
+        } else {
+            size_t j = (size_t) rand() % window;
+            objects[j] = gc_realloc(&gc_, objects[j], 16 + (size_t) rand() % 241);
+        }
+    }
+    uint64_t total = bench_now_ns() - start;
+    bench_printf("realloc (%s, %s): %zu calls, %.2f ns/realloc\n", bench_realloc_names[pattern],
+                 size_classes ? "size classes" : "malloc", n, (double) total / n);
+    bench_result("realloc", "realloc", (double) total / n, "ns", "calls=%zu pattern=%s "
+                 "size_classes=%d", n, bench_realloc_names[pattern], (int) size_classes);
+    gc_stop(&gc_);
+}
+
+/*
+ * Time allocation map inserts of `n` managed pointers (including resizes),
+ * lookups, both for hits and for misses that pass the address filter, and
+ * removals (including shrinking).
+ */
+static void bench_map(size_t n, size_t reps, AllocationMapSizing sizing)
+{
+    AllocationMap* am = gc_allocation_map_new(1024, 1024, 0.5, 0.2, 0.8, sizing);
+    void** ptrs = malloc(n * sizeof(void*));
+    for (size_t i = 0; i < n; ++i) {
+        ptrs[i] = malloc(32);
+    }
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < n; ++i) {
+        gc_allocation_map_put(am, ptrs[i], 32, NULL);
+    }
+    uint64_t puts = bench_now_ns() - start;
+    /* Look up in random order, like pointers discovered during marking */
+    for (size_t i = n - 1; i > 0; --i) {
+        size_t j = (size_t) rand() % (i + 1);
+        void* tmp = ptrs[i];
+        ptrs[i] = ptrs[j];
+        ptrs[j] = tmp;
+    }
+    size_t found = 0;
+    start = bench_now_ns();
+    for (size_t r = 0; r < reps; ++r) {
+        for (size_t i = 0; i < n; ++i) {
+            found += gc_allocation_map_get(am, ptrs[i]) != NULL;
+        }
+    }
+    uint64_t hits = bench_now_ns() - start;
+    start = bench_now_ns();
+    for (size_t r = 0; r < reps; ++r) {
+        for (size_t i = 0; i < n; ++i) {
+            found += gc_allocation_map_get(am, (char*) ptrs[i] + 8) != NULL;
+        }
+    }
+    uint64_t misses = bench_now_ns() - start;
+    start = bench_now_ns();
+    for (size_t i = 0; i < n; ++i) {
+        gc_allocation_map_remove(am, ptrs[i], true);
+    }
+    uint64_t removes = bench_now_ns() - start;
+    const char* name = sizing == GC_SIZING_POW2 ? "pow2" : "prime";
+    bench_printf("map (%s): %zu entries, %.2f ns/put, %.2f ns/hit, %.2f ns/miss, "
+                 "%.2f ns/remove (%zu found)\n", name, n, (double) puts / n,
+                 (double) hits / (n * reps), (double) misses / (n * reps),
+                 (double) removes / n, found);
+    bench_result("map", "put", (double) puts / n, "ns", "entries=%zu sizing=%s", n, name);
+    bench_result("map", "hit", (double) hits / (n * reps), "ns", "entries=%zu sizing=%s", n, name);
+    bench_result("map", "miss", (double) misses / (n * reps), "ns", "entries=%zu sizing=%s",
+                 n, name);
+    bench_result("map", "remove", (double) removes / n, "ns", "entries=%zu sizing=%s", n, name);
+    for (size_t i = 0; i < n; ++i) {
+        free(ptrs[i]);
+    }
+    free(ptrs);
+    gc_allocation_map_delete(am);
+}
+
+static int bench_ngroups;
+static char** bench_groups;
+
+/*
+ * Check if the benchmarks of `group` were selected on the command line.
+ */
+static bool bench_selected(const char* group)
+{
+    for (int i = 0; i < bench_ngroups; ++i) {
+        if (strcmp(bench_groups[i], group) == 0) {
+            return true;
+        }
+    }
+    return bench_ngroups == 0;
+}
+
+int main(int argc, char** argv)
+{
+    const char* output = NULL;
+    bench_groups = malloc(argc * sizeof(char*));
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            const char* format = argv[++i];
+            bench_format = strcmp(format, "csv") == 0 ? BENCH_CSV
+                           : strcmp(format, "json") == 0 ? BENCH_JSON : BENCH_TEXT;
+            if (bench_format == BENCH_TEXT && strcmp(format, "text") != 0) {
+                fprintf(stderr, "Unknown format %s\n", format);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "Usage: %s [-f text|csv|json] [-o FILE] [GROUP...]\n", argv[0]);
+            return 1;
+        } else {
+            bench_groups[bench_ngroups++] = argv[i];
+        }
+    }
+    bench_text = stdout;
+    bench_records = stdout;
+    if (bench_format != BENCH_TEXT && output) {
+        bench_records = fopen(output, "w");
+        if (!bench_records) {
+            perror(output);
+            return 1;
+        }
+    } else if (bench_format != BENCH_TEXT) {
+        bench_text = stderr;
+    }
+
+    srand(42);
+    if (bench_selected("mark")) {
+        bench_mark(1 << 14, 10, GC_SIZING_PRIME);
+        bench_mark(1 << 14, 10, GC_SIZING_POW2);
+        bench_mark(1 << 17, 10, GC_SIZING_PRIME);
+        bench_mark(1 << 17, 10, GC_SIZING_POW2);
+        bench_mark(1 << 20, 5, GC_SIZING_PRIME);
+        bench_mark(1 << 20, 5, GC_SIZING_POW2);
+        for (size_t n = 1 << 14; n <= 1 << 20; n <<= 3) {
+            bench_mark_shape(n, 5, BENCH_LIST);
+            bench_mark_shape(n, 5, BENCH_TREE);
+            bench_mark_shape(n, 5, BENCH_RANDOM);
+        }
+        for (size_t threads = 1; threads <= 8; threads *= 2) {
+            bench_mark_parallel(1 << 20, 5, threads);
+        }
+        bench_mark_interior(1 << 17, 10, false);
+        bench_mark_interior(1 << 17, 10, true);
+        bench_mark_data(1 << 12, 4096, 10);
+        bench_mark_data(1 << 15, 1024, 10);
+    }
+    if (bench_selected("sweep")) {
+        bench_sweep(1 << 16, 0.5, 10);
+        bench_sweep(1 << 20, 0.01, 3);
+        bench_sweep(1 << 20, 0.1, 3);
+        bench_sweep(1 << 20, 0.5, 3);
+        bench_sweep(1 << 20, 0.9, 3);
+        bench_sweep(1 << 20, 0.99, 3);
+        bench_sweep_finalizers(1 << 20, 0.9, 3, false, 1);
+        bench_sweep_finalizers(1 << 20, 0.9, 3, true, 1);
+        bench_sweep_finalizers(1 << 20, 0.9, 3, true, 4);
+    }
+    if (bench_selected("collect")) {
+        bench_lazy_sweep(1 << 19, 3, false);
+        bench_lazy_sweep(1 << 19, 3, true);
+    }
+    if (bench_selected("allocate")) {
+        bench_incremental(1 << 18, 3, false, false);
+        bench_incremental(1 << 18, 3, true, false);
+#ifndef GC_NO_THREADS
+        bench_incremental(1 << 18, 3, false, true);
+#endif
+        bench_generational(1 << 18, 1 << 21, false);
+        bench_generational(1 << 18, 1 << 21, true);
+#ifndef GC_NO_THREADS
+        bench_threads(1 << 10, 1 << 22, 0, false);
+        for (size_t nthreads = 1; nthreads <= 8; nthreads *= 2) {
+            bench_threads(1 << 10, 1 << 22, nthreads, false);
+            bench_threads(1 << 10, 1 << 22, nthreads, true);
+        }
+#endif
+    }
+    if (bench_selected("stats")) {
+        bench_stats(1 << 16, 1 << 21, 1 << 16);
+    }
+    if (bench_selected("hooks")) {
+        bench_hooks(1 << 16, 1 << 21, false);
+        bench_hooks(1 << 16, 1 << 21, true);
+    }
+#ifndef GC_NO_THREADS
+    if (bench_selected("trace")) {
+        for (size_t nthreads = 1; nthreads <= 4; nthreads *= 4) {
+            bench_trace(1 << 20, nthreads, false);
+            bench_trace(1 << 20, nthreads, true);
+        }
+    }
+#endif
+    if (bench_selected("alloc")) {
+        bench_alloc(1 << 22, false);
+        bench_alloc(1 << 22, true);
+        for (size_t size = 16; size <= 16384; size *= 4) {
+            size_t n = size <= 256 ? 1 << 21 : 1 << 18;
+            bench_alloc_size(n, size, false);
+            bench_alloc_size(n, size, true);
+        }
+    }
+    if (bench_selected("realloc")) {
+        for (int pattern = BENCH_REALLOC_APPEND; pattern <= BENCH_REALLOC_RESIZE; ++pattern) {
+            bench_realloc(1 << 20, (BenchRealloc) pattern, false);
+            bench_realloc(1 << 20, (BenchRealloc) pattern, true);
+        }
+    }
+    if (bench_selected("map")) {
+        bench_map(1 << 16, 20, GC_SIZING_PRIME);
+        bench_map(1 << 16, 20, GC_SIZING_POW2);
+        bench_map(1 << 20, 5, GC_SIZING_PRIME);
+        bench_map(1 << 20, 5, GC_SIZING_POW2);
+    }
+
+    if (bench_format == BENCH_JSON) {
+        fprintf(bench_records, bench_nrecords ? "\n]\n" : "[]\n");
+    }
+    if (bench_records != stdout) {
+        fclose(bench_records);
+    }
+    free(bench_groups);
+    return 0;
+}
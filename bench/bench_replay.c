@@ -0,0 +1,455 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "../src/gc.c"
+
+/*
+ * Replay of allocation traces.
+ *
+ * Executes a trace recorded with `gc_record()` (see the README) against the
+ * collector and reports the throughput, the distribution of the time the
+ * individual operations took, which includes the collection pauses they
+ * triggered, and the peak resident set size.
+ *
+ * Usage: bench_replay [-s] [-l] [-i] [-g] [-t THREADS] [-F FACTOR] TRACE
+ *
+ *   -s          allocate small objects from size classes
+ *   -l          sweep lazily
+ *   -i          mark incrementally
+ *   -g          collect generationally
+ *   -t THREADS  mark with THREADS threads
+ *   -F FACTOR   set the sweep factor
+ *
+ * The stack of the recording program is not part of the trace. Instead, an
+ * object is kept alive through a rooted table until the event that records
+ * its death (or free), so the collector sees the same live heap, up to the
+ * timing of its own collections. The trace is replayed on a single thread.
+ */
+
+#define REPLAY_NONE UINT32_MAX
+
+typedef struct ReplayEvent {
+    char op;            // 'm', 'c', 'r', 'f', 'R', 's' or 'd', see the README
+    bool dtor;          // the allocation has a destructor
+    uint32_t slot;      // the object (the new one for 'r')
+    uint32_t other;     // the old object of 'r', the stored object of 's'
+    size_t size;        // the size of 'm', 'c' and 'r', the offset of 's'
+    size_t count;       // the count of 'c'
+} ReplayEvent;
+
+typedef struct ReplayTrace {
+    ReplayEvent* events;
+    size_t nevents;
+    size_t capacity;
+    size_t nslots;      // the peak number of live objects
+    size_t skipped;     // events about objects allocated before recording
+} ReplayTrace;
+
+/*
+ * While loading, recorded addresses are mapped to dense slots, with a hash
+ * table (linear probing, deletion by backward shift) from addresses to
+ * slots and a stack of free slots.
+ */
+typedef struct ReplayAddress {
+    uintptr_t addr;
+    uint32_t slot;
+} ReplayAddress;
+
+typedef struct ReplayLoader {
+    ReplayAddress* table;
+    size_t capacity;
+    size_t size;
+    uint32_t* free_slots;
+    size_t nfree;
+    size_t free_capacity;
+    size_t* sizes;      // the size of the object in each slot
+    size_t sizes_capacity;
+} ReplayLoader;
+
+static size_t replay_home(ReplayLoader* ld, uintptr_t addr)
+{
+    return (size_t) ((addr >> 4) * GC_FIBONACCI_MULTIPLIER) & (ld->capacity - 1);
+}
+
+static ReplayAddress* replay_find(ReplayLoader* ld, uintptr_t addr)
+{
+    if (!ld->size) {
+        return NULL;
+    }
+    for (size_t i = replay_home(ld, addr); ld->table[i].addr; i = (i + 1) & (ld->capacity - 1)) {
+        if (ld->table[i].addr == addr) {
+            return &ld->table[i];
+        }
+    }
+    return NULL;
+}
+
+static void replay_insert(ReplayLoader* ld, uintptr_t addr, uint32_t slot)
+{
+    if (2 * (ld->size + 1) > ld->capacity) {
+        ReplayAddress* old = ld->table;
+        size_t old_capacity = ld->capacity;
+        ld->capacity = old_capacity ? 2 * old_capacity : 1024;
+        ld->table = (ReplayAddress*) calloc(ld->capacity, sizeof(ReplayAddress));
+        ld->size = 0;
+        for (size_t i = 0; i < old_capacity; ++i) {
+            if (old[i].addr) {
+                replay_insert(ld, old[i].addr, old[i].slot);
+            }
+        }
+        free(old);
+    }
+    size_t i = replay_home(ld, addr);
+    while (ld->table[i].addr) {
+        i = (i + 1) & (ld->capacity - 1);
+    }
+    ld->table[i].addr = addr;
+    ld->table[i].slot = slot;
+    ld->size++;
+}
+
+static void replay_remove(ReplayLoader* ld, ReplayAddress* entry)
+{
+    size_t mask = ld->capacity - 1;
+    size_t hole = (size_t) (entry - ld->table);
+    for (size_t i = (hole + 1) & mask; ld->table[i].addr; i = (i + 1) & mask) {
+        /* Move the entry into the hole unless its home lies between them */
+        size_t home = replay_home(ld, ld->table[i].addr);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            ld->table[hole] = ld->table[i];
+            hole = i;
+        }
+    }
+    ld->table[hole].addr = 0;
+    ld->size--;
+}
+
+static uint32_t replay_slot(ReplayLoader* ld, uintptr_t addr)
+{
+    ReplayAddress* entry = addr ? replay_find(ld, addr) : NULL;
+    return entry ? entry->slot : REPLAY_NONE;
+}
+
+static ReplayEvent* replay_push(ReplayTrace* trace, char op)
+{
+    if (trace->nevents == trace->capacity) {
+        trace->capacity = trace->capacity ? 2 * trace->capacity : 4096;
+        trace->events = (ReplayEvent*) realloc(trace->events,
+                                               trace->capacity * sizeof(ReplayEvent));
+    }
+    ReplayEvent* ev = &trace->events[trace->nevents++];
+    memset(ev, 0, sizeof(ReplayEvent));
+    ev->op = op;
+    ev->slot = REPLAY_NONE;
+    ev->other = REPLAY_NONE;
+    return ev;
+}
+
+/*
+ * Release the slot of an object that died or was freed.
+ */
+static uint32_t replay_release(ReplayLoader* ld, uintptr_t addr)
+{
+    ReplayAddress* entry = addr ? replay_find(ld, addr) : NULL;
+    if (!entry) {
+        return REPLAY_NONE;
+    }
+    uint32_t slot = entry->slot;
+    replay_remove(ld, entry);
+    if (ld->nfree == ld->free_capacity) {
+        ld->free_capacity = ld->free_capacity ? 2 * ld->free_capacity : 1024;
+        ld->free_slots = (uint32_t*) realloc(ld->free_slots, ld->free_capacity * sizeof(uint32_t));
+    }
+    ld->free_slots[ld->nfree++] = slot;
+    return slot;
+}
+
+/*
+ * Assign a slot to a new object. An object that is still live at the same
+ * address missed its death (it may have died before recording started),
+ * it is dropped first.
+ */
+static uint32_t replay_acquire(ReplayLoader* ld, ReplayTrace* trace, uintptr_t addr, size_t size)
+{
+    uint32_t dead = replay_release(ld, addr);
+    if (dead != REPLAY_NONE) {
+        replay_push(trace, 'd')->slot = dead;
+    }
+    uint32_t slot = ld->nfree ? ld->free_slots[--ld->nfree] : (uint32_t) trace->nslots++;
+    if (slot >= ld->sizes_capacity) {
+        ld->sizes_capacity = ld->sizes_capacity ? 2 * ld->sizes_capacity : 1024;
+        ld->sizes = (size_t*) realloc(ld->sizes, ld->sizes_capacity * sizeof(size_t));
+    }
+    ld->sizes[slot] = size;
+    replay_insert(ld, addr, slot);
+    return slot;
+}
+
+/*
+ * Read a trace and translate its addresses to slots.
+ */
+static bool replay_load(FILE* in, ReplayTrace* trace)
+{
+    ReplayLoader ld = {0};
+    char line[256];
+    size_t lineno = 0;
+    bool ok = true;
+    memset(trace, 0, sizeof(ReplayTrace));
+    while (ok && fgets(line, sizeof(line), in)) {
+        lineno++;
+        uintptr_t a = 0, b = 0, dtor = 0;
+        size_t n = 0, size = 0;
+        ReplayEvent* ev;
+        switch (line[0]) {
+        case '#':
+        case '\n':
+            break;
+        case 'm':
+            ok = sscanf(line, "m %" SCNxPTR " %zu %" SCNxPTR, &a, &size, &dtor) == 3;
+            if (ok) {
+                uint32_t slot = replay_acquire(&ld, trace, a, size);
+                ev = replay_push(trace, 'm');
+                ev->slot = slot;
+                ev->size = size;
+                ev->dtor = dtor != 0;
+            }
+            break;
+        case 'c':
+            ok = sscanf(line, "c %" SCNxPTR " %zu %zu %" SCNxPTR, &a, &n, &size, &dtor) == 4;
+            if (ok) {
+                uint32_t slot = replay_acquire(&ld, trace, a, n * size);
+                ev = replay_push(trace, 'c');
+                ev->slot = slot;
+                ev->count = n;
+                ev->size = size;
+                ev->dtor = dtor != 0;
+            }
+            break;
+        case 'r':
+            ok = sscanf(line, "r %" SCNxPTR " %" SCNxPTR " %zu", &a, &b, &size) == 3;
+            if (ok) {
+                uint32_t old = replay_release(&ld, a);
+                if (a && old == REPLAY_NONE) {
+                    trace->skipped++;
+                    break;
+                }
+                uint32_t slot = replay_acquire(&ld, trace, b, size);
+                ev = replay_push(trace, 'r');
+                ev->slot = slot;
+                ev->other = old;
+                ev->size = size;
+            }
+            break;
+        case 'f':
+        case 'd':
+            ok = sscanf(line + 1, " %" SCNxPTR, &a) == 1;
+            if (ok) {
+                uint32_t slot = replay_release(&ld, a);
+                if (slot == REPLAY_NONE) {
+                    trace->skipped++;
+                    break;
+                }
+                replay_push(trace, line[0])->slot = slot;
+            }
+            break;
+        case 'R':
+            ok = sscanf(line, "R %" SCNxPTR, &a) == 1;
+            if (ok) {
+                uint32_t slot = replay_slot(&ld, a);
+                if (slot == REPLAY_NONE) {
+                    trace->skipped++;
+                    break;
+                }
+                replay_push(trace, 'R')->slot = slot;
+            }
+            break;
+        case 's':
+            ok = sscanf(line, "s %" SCNxPTR " %zu %" SCNxPTR, &a, &n, &b) == 3;
+            if (ok) {
+                uint32_t slot = replay_slot(&ld, a);
+                /* The replayed object may be smaller than the recorded one */
+                if (slot == REPLAY_NONE || n + sizeof(void*) > ld.sizes[slot]) {
+                    trace->skipped++;
+                    break;
+                }
+                ev = replay_push(trace, 's');
+                ev->slot = slot;
+                ev->size = n;
+                ev->other = replay_slot(&ld, b);
+            }
+            break;
+        default:
+            ok = false;
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "bench_replay: invalid event on line %zu: %s", lineno, line);
+    }
+    free(ld.table);
+    free(ld.free_slots);
+    free(ld.sizes);
+    return ok;
+}
+
+static void replay_dtor(void* ptr)
+{
+    (void) ptr;
+}
+
+static int replay_compare(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * The peak resident set size of the process in KiB.
+ */
+static long replay_peak_rss()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/*
+ * Replay all events, keeping live objects in `live`, and time each of them.
+ */
+static uint64_t replay_run(GarbageCollector* gc, ReplayTrace* trace, void** live, uint64_t* ns)
+{
+    uint64_t start = gc_now_ns();
+    for (size_t i = 0; i < trace->nevents; ++i) {
+        ReplayEvent* ev = &trace->events[i];
+        void (*dtor)(void*) = ev->dtor ? replay_dtor : NULL;
+        uint64_t t = gc_now_ns();
+        switch (ev->op) {
+        case 'm':
+            live[ev->slot] = gc_malloc_ext(gc, ev->size, dtor);
+            break;
+        case 'c':
+            live[ev->slot] = gc_calloc_ext(gc, ev->count, ev->size, dtor);
+            break;
+        case 'r': {
+            void* p = ev->other == REPLAY_NONE ? NULL : live[ev->other];
+            if (ev->other != REPLAY_NONE) {
+                live[ev->other] = NULL;
+            }
+            live[ev->slot] = gc_realloc(gc, p, ev->size);
+            break;
+        }
+        case 'f':
+            gc_free(gc, live[ev->slot]);
+            live[ev->slot] = NULL;
+            break;
+        case 'd':
+            live[ev->slot] = NULL;
+            break;
+        case 'R':
+            gc_make_static(gc, live[ev->slot]);
+            break;
+        case 's':
+            if (live[ev->slot]) {
+                void* value = ev->other == REPLAY_NONE ? NULL : live[ev->other];
+                memcpy((char*) live[ev->slot] + ev->size, &value, sizeof(void*));
+                gc_write_barrier(gc, live[ev->slot]);
+            }
+            break;
+        }
+        ns[i] = gc_now_ns() - t;
+    }
+    return gc_now_ns() - start;
+}
+
+static void replay_usage()
+{
+    fprintf(stderr, "usage: bench_replay [-s] [-l] [-i] [-g] [-t THREADS] [-F FACTOR] "
+            "[-G PERCENT] [-M BYTES] TRACE\n");
+}
+
+int main(int argc, char* argv[])
+{
+    GarbageCollectorConfig config;
+    gc_config_default(&config);
+    const char* path = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-s") == 0) {
+            config.size_classes = true;
+        } else if (strcmp(argv[i], "-l") == 0) {
+            config.lazy_sweep = true;
+        } else if (strcmp(argv[i], "-i") == 0) {
+            config.incremental_marking = true;
+        } else if (strcmp(argv[i], "-g") == 0) {
+            config.generational = true;
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            config.mark_threads = (size_t) atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-F") == 0 && i + 1 < argc) {
+            config.sweep_factor = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-G") == 0 && i + 1 < argc) {
+            config.heap_growth = (size_t) atol(argv[++i]);
+        } else if (strcmp(argv[i], "-M") == 0 && i + 1 < argc) {
+            config.memory_limit = (size_t) atol(argv[++i]);
+        } else if (argv[i][0] != '-' && !path) {
+            path = argv[i];
+        } else {
+            replay_usage();
+            return 1;
+        }
+    }
+    if (!path) {
+        replay_usage();
+        return 1;
+    }
+    FILE* in = fopen(path, "r");
+    if (!in) {
+        perror(path);
+        return 1;
+    }
+    ReplayTrace trace;
+    bool loaded = replay_load(in, &trace);
+    fclose(in);
+    if (!loaded) {
+        free(trace.events);
+        return 1;
+    }
+    uint64_t* ns = (uint64_t*) malloc((trace.nevents ? trace.nevents : 1) * sizeof(uint64_t));
+    long rss_before = replay_peak_rss();
+
+    GarbageCollector gc_;
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    void** live = (void**) gc_calloc(&gc_, trace.nslots ? trace.nslots : 1, sizeof(void*));
+    gc_make_static(&gc_, live);
+    uint64_t total = replay_run(&gc_, &trace, live, ns);
+    GarbageCollectorStats stats;
+    gc_stats(&gc_, &stats);
+    long rss_after = replay_peak_rss();
+
+    qsort(ns, trace.nevents, sizeof(uint64_t), replay_compare);
+    double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    printf("replay: %zu events (%zu skipped), %zu objects peak\n",
+           trace.nevents, trace.skipped, trace.nslots);
+    printf("throughput: %.3f ms, %.0f events/s\n", (double) total / 1e6,
+           total ? (double) trace.nevents * 1e9 / (double) total : 0.0);
+    printf("latency:");
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i) {
+        size_t k = (size_t) (percentiles[i] * (double) trace.nevents);
+        printf(" p%g=%" PRIu64 "ns", percentiles[i] * 100,
+               trace.nevents ? ns[k < trace.nevents ? k : trace.nevents - 1] : 0);
+    }
+    printf(" max=%" PRIu64 "ns\n", trace.nevents ? ns[trace.nevents - 1] : 0);
+    printf("collections: %zu full, %zu minor, %.3f ms marking, %.3f ms sweeping\n",
+           stats.collections, stats.minor_collections,
+           (double) stats.mark_ns / 1e6, (double) stats.sweep_ns / 1e6);
+    printf("heap: %zu bytes peak, %zu bytes freed, %zu bytes live\n",
+           stats.peak_bytes, stats.freed_bytes, stats.live_bytes);
+    printf("rss: %ld KiB peak after loading, %ld KiB peak after replay\n",
+           rss_before, rss_after);
+
+    gc_stop(&gc_);
+    free(ns);
+    free(trace.events);
+    return 0;
+}
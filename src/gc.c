@@ -2,17 +2,59 @@
 #include "log.h"
 
 #include <errno.h>
+#include <inttypes.h>
 #include <setjmp.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+/*
+ * Parallel marking (see `mark_threads` in `GarbageCollectorConfig`) and
+ * multi-threaded mutators use POSIX threads. Define GC_NO_THREADS to build
+ * without them, in which case marking is always serial and only a single
+ * thread may use a garbage collector.
+ */
+#if defined(_MSC_VER) && !defined(GC_NO_THREADS)
+#define GC_NO_THREADS
+#endif
+
+#ifndef GC_NO_THREADS
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#endif
+
+/*
+ * The allocation profiler (see `sample_interval` in GarbageCollectorConfig)
+ * records backtraces where `backtrace()` is available, else only counts.
+ */
+#if defined(__GLIBC__) || defined(__APPLE__)
+#include <execinfo.h>
+#define GC_HAVE_BACKTRACE
+#endif
 //#include "primes.h"
 
 /*
- * Set log level for this compilation unit. If set to LOGLEVEL_DEBUG,
- * the garbage collector will be very chatty.
+ * Built with -DGC_RECORD, the collector can write a trace of all
+ * allocations, frees, roots, stores and deaths to a file, see `gc_record()`.
+ * Otherwise the recording code is compiled out.
+ */
+#ifdef GC_RECORD
+#define GC_RECORD_EVENT(out, ...) \
+    do { if (out) fprintf((out), __VA_ARGS__); } while (0)
+#define GC_RECORD_ENABLED 1
+#else
+#define GC_RECORD_EVENT(out, ...) do { } while (0)
+#define GC_RECORD_ENABLED 0
+#endif
+#define GC_RECORD_ADDR(p) ((uintptr_t) (p))
+
+/*
+ * The log level defaults to LOGLEVEL_INFO, see log.h. If built with
+ * -DLOGLEVEL=LOGLEVEL_DEBUG, the garbage collector will be very chatty. The
+ * messages of the mark loop, the sweep and the allocation map are traces
+ * instead, which are only compiled in with -DLOGTRACE=... .
  */
-#undef LOGLEVEL
-#define LOGLEVEL LOGLEVEL_INFO
 
 /*
  * The size of a pointer.
@@ -20,14 +62,38 @@
 #define PTRSIZE sizeof(char*)
 
 /*
- * Allocations can temporarily be tagged as "marked" an part of the
- * mark-and-sweep implementation or can be tagged as "roots" which are
- * not automatically garbage collected. The latter allows the implementation
- * of global variables.
+ * Conservative scanning steps through memory in increments of GC_SCAN_STEP
+ * bytes. On platforms whose ABI aligns pointer-typed struct members and
+ * stack slots (x86-64, aarch64), only aligned words are considered, starting
+ * at the first aligned address of a range. Define GC_SCAN_UNALIGNED to scan
+ * at every byte offset instead, e.g. if managed memory holds packed structs
+ * with misaligned pointers.
+ */
+#if !defined(GC_SCAN_UNALIGNED) && !defined(GC_SCAN_ALIGNED) && \
+    (defined(__x86_64__) || defined(_M_X64) || defined(__aarch64__) || defined(_M_ARM64))
+#define GC_SCAN_ALIGNED
+#endif
+
+#ifdef GC_SCAN_ALIGNED
+#define GC_SCAN_STEP PTRSIZE
+#else
+#define GC_SCAN_STEP 1
+#endif
+
+/*
+ * Allocations can be tagged as "roots" which are not automatically garbage
+ * collected. This allows the implementation of global variables. During a
+ * sweep, freed allocations are tagged as "dead" until they are removed from
+ * the allocation map in bulk. Marks are not stored in the tag but in a
+ * separate bitmap of the allocation map. In generational mode, allocations
+ * are "young" until they are promoted, and old allocations that may hold
+ * pointers to young ones are "remembered".
  */
 #define GC_TAG_NONE 0x0
 #define GC_TAG_ROOT 0x1
-#define GC_TAG_MARK 0x2
+#define GC_TAG_REMEMBERED 0x2
+#define GC_TAG_DEAD 0x4
+#define GC_TAG_YOUNG 0x8
 
 /*
  * Support for windows c compiler is added by adding this macro.
@@ -70,61 +136,134 @@ static size_t next_prime(size_t n)
     return n;
 }
 
+static size_t next_pow2(size_t n)
+{
+    size_t p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+/*
+ * Monotonic time in nanoseconds, for the statistics.
+ */
+static uint64_t gc_now_ns()
+{
+    struct timespec ts;
+#if defined(_MSC_VER)
+    timespec_get(&ts, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/*
+ * Bit operations on the mark bitmaps of the allocation map and the
+ * small-object pages.
+ */
+#if defined(_MSC_VER)
+#include <intrin.h>
+static unsigned int gc_ctz64(uint64_t x)
+{
+    unsigned long index;
+    _BitScanForward64(&index, x);
+    return (unsigned int) index;
+}
+#else
+#define gc_ctz64(x) ((unsigned int) __builtin_ctzll(x))
+#endif
+
+static bool gc_bit_test(const uint64_t* bits, size_t i)
+{
+    return (bits[i / 64] >> (i % 64)) & 1;
+}
+
+static void gc_bit_set(uint64_t* bits, size_t i)
+{
+    bits[i / 64] |= (uint64_t) 1 << (i % 64);
+}
+
+static void gc_bit_clear(uint64_t* bits, size_t i)
+{
+    bits[i / 64] &= ~((uint64_t) 1 << (i % 64));
+}
+
+/*
+ * Set a bit and return its previous value. Parallel mark workers race to
+ * mark the same objects and pass `atomic` so that exactly one of them wins.
+ */
+static bool gc_bit_test_and_set(uint64_t* bits, size_t i, bool atomic)
+{
+    uint64_t mask = (uint64_t) 1 << (i % 64);
+#ifndef GC_NO_THREADS
+    if (atomic) {
+        if (__atomic_load_n(&bits[i / 64], __ATOMIC_RELAXED) & mask) {
+            return true;
+        }
+        return __atomic_fetch_or(&bits[i / 64], mask, __ATOMIC_RELAXED) & mask;
+    }
+#else
+    (void) atomic;
+#endif
+    bool set = bits[i / 64] & mask;
+    bits[i / 64] |= mask;
+    return set;
+}
+
 /**
  * The allocation object.
  *
  * The allocation object holds all metadata for a memory location
- * in one place.
+ * in one place. Allocation objects are stored inline in the slots of the
+ * allocation map; a slot with a `NULL` pointer is empty.
  */
 typedef struct Allocation {
     void* ptr;                // mem pointer
     size_t size;              // allocated size in bytes
-    char tag;                 // the tag for mark-and-sweep
     void (*dtor)(void*);      // destructor
-    struct Allocation* next;  // separate chaining
+    char tag;                 // root, dead and generation tags, see GC_TAG_*
+    uint32_t dist;            // probe distance from the home slot
 } Allocation;
 
-/**
- * Create a new allocation object.
- *
- * Creates a new allocation object using the system `malloc`.
- *
- * @param[in] ptr The pointer to the memory to manage.
- * @param[in] size The size of the memory range pointed to by `ptr`.
- * @param[in] dtor A pointer to a destructor function that should be called
- *                 before freeing the memory pointed to by `ptr`.
- * @returns Pointer to the new allocation instance.
+/*
+ * Open addressing requires at least one empty slot. Independent of the
+ * configured upsize factor, the allocation map grows once its load factor
+ * would exceed GC_MAX_LOAD_FACTOR.
  */
-static Allocation* gc_allocation_new(void* ptr, size_t size, void (*dtor)(void*))
-{
-    Allocation* a = (Allocation*) malloc(sizeof(Allocation));
-    a->ptr = ptr;
-    a->size = size;
-    a->tag = GC_TAG_NONE;
-    a->dtor = dtor;
-    a->next = NULL;
-    return a;
-}
+#define GC_MAX_LOAD_FACTOR 0.9
 
-/**
- * Delete an allocation object.
- *
- * Deletes the allocation object pointed to by `a`, but does *not*
- * free the memory pointed to by `a->ptr`.
- *
- * @param a The allocation object to delete.
+/*
+ * The page filter is a bitmap with one bit per page number (modulo the
+ * bitmap size) that is set if a managed allocation may start in that page.
  */
-static void gc_allocation_delete(Allocation* a)
-{
-    free(a);
-}
+#define GC_PAGE_SHIFT 12
+#define GC_PAGE_FILTER_WORDS 1024
+#define GC_PAGE_FILTER_BITS (GC_PAGE_FILTER_WORDS * 64)
 
 /**
  * The allocation hash map.
  *
  * The core data structure is a hash map that holds the allocation
  * objects and allows O(1) retrieval given the memory location. Collision
- * resolution is implemented using separate chaining.
+ * resolution is implemented using open addressing with linear probing and
+ * Robin Hood insertion: an entry that is further away from its home slot
+ * takes the place of an entry that is closer to its own. This bounds the
+ * variance of probe lengths and allows lookups for unknown pointers to stop
+ * early. Removal shifts the subsequent entries of a cluster back by one
+ * slot, so no tombstones are required.
+ *
+ * In addition, the map keeps a cheap pre-filter of the managed address
+ * space: the smallest and largest managed pointer and a coarse bitmap of
+ * occupied pages. Both are supersets (they are only tightened when the map
+ * is rebuilt during a sweep) and allow the mark phase to reject most
+ * non-pointer words without computing a hash.
+ *
+ * The mark bits of the entries are kept in a side table with one bit per
+ * slot rather than in the allocation objects, next to a bitmap of occupied
+ * slots. Marking does not write to the slots, clearing all marks is a
+ * `memset()` and the sweep finds unmarked entries 64 slots at a time without
+ * reading the slots of live entries. Whenever an entry moves to another
+ * slot, its mark bit moves along.
  */
 typedef struct AllocationMap {
     size_t capacity;
@@ -134,9 +273,78 @@ typedef struct AllocationMap {
     double sweep_factor;
     size_t sweep_limit;
     size_t size;
-    Allocation** allocs;
+    size_t bytes;             // sum of the sizes of all entries
+    uint32_t max_dist;        // longest probe distance since the last rehash or compaction
+    AllocationMapSizing sizing;
+    unsigned int hash_shift;
+    uintptr_t min_ptr;
+    uintptr_t max_ptr;
+    uint64_t page_filter[GC_PAGE_FILTER_WORDS];
+    Allocation* allocs;
+    uint64_t* used_bits;
+    uint64_t* mark_bits;
+    size_t version;           // incremented whenever entries are added, moved or removed
+    bool sweeping;            // a sweep runs destructors, see gc_allocation_map_remove()
+    size_t removed;           // entries tagged dead by removals while sweeping
+    /* called after a resize with the old capacity and the time it took */
+    void (*resized)(void* data, size_t old_capacity, uint64_t ns);
+    void* resized_data;
+#ifdef GC_RECORD
+    FILE* record;             // trace output for deaths, see gc_record()
+#endif
 } AllocationMap;
 
+/*
+ * The number of words of the slot bitmaps of a map with `capacity` slots.
+ */
+#define GC_MARK_WORDS(capacity) (((capacity) + 63) / 64)
+
+/**
+ * Reset the address range and page filter of an `AllocationMap`.
+ *
+ * @param am The allocation map.
+ */
+static void gc_allocation_map_filter_reset(AllocationMap* am)
+{
+    am->min_ptr = UINTPTR_MAX;
+    am->max_ptr = 0;
+    memset(am->page_filter, 0, sizeof(am->page_filter));
+}
+
+/**
+ * Add a managed pointer to the address range and page filter.
+ *
+ * @param am The allocation map.
+ * @param ptr The managed pointer.
+ */
+static void gc_allocation_map_filter_add(AllocationMap* am, void* ptr)
+{
+    uintptr_t p = (uintptr_t) ptr;
+    if (p < am->min_ptr) am->min_ptr = p;
+    if (p > am->max_ptr) am->max_ptr = p;
+    size_t page = (p >> GC_PAGE_SHIFT) % GC_PAGE_FILTER_BITS;
+    am->page_filter[page / 64] |= (uint64_t) 1 << (page % 64);
+}
+
+/**
+ * Check if a pointer can possibly be managed by an `AllocationMap`.
+ *
+ * False positives are possible, false negatives are not.
+ *
+ * @param am The allocation map.
+ * @param ptr The candidate pointer.
+ * @returns `false` if `ptr` is definitely not a key in `am`.
+ */
+static bool gc_allocation_map_filter_test(AllocationMap* am, void* ptr)
+{
+    uintptr_t p = (uintptr_t) ptr;
+    if (p < am->min_ptr || p > am->max_ptr) {
+        return false;
+    }
+    size_t page = (p >> GC_PAGE_SHIFT) % GC_PAGE_FILTER_BITS;
+    return (am->page_filter[page / 64] >> (page % 64)) & 1;
+}
+
 /**
  * Determine the current load factor of an `AllocationMap`.
  *
@@ -151,50 +359,152 @@ static double gc_allocation_map_load_factor(AllocationMap* am)
     return (double) am->size / (double) am->capacity;
 }
 
+/**
+ * Round a capacity according to the sizing policy of an `AllocationMap`.
+ *
+ * @param am The allocation map.
+ * @param capacity The requested capacity.
+ * @returns The next prime or power of two that is `>= capacity`.
+ */
+static size_t gc_allocation_map_round(AllocationMap* am, size_t capacity)
+{
+    return am->sizing == GC_SIZING_POW2 ? next_pow2(capacity) : next_prime(capacity);
+}
+
+/**
+ * Set the capacity of an `AllocationMap` and derive the hashing parameters.
+ *
+ * @param am The allocation map.
+ * @param capacity The new capacity, rounded by `gc_allocation_map_round()`.
+ */
+static void gc_allocation_map_set_capacity(AllocationMap* am, size_t capacity)
+{
+    am->capacity = capacity;
+    am->hash_shift = 64;
+    while (capacity > 1) {
+        am->hash_shift--;
+        capacity >>= 1;
+    }
+}
+
 static AllocationMap* gc_allocation_map_new(size_t min_capacity,
         size_t capacity,
         double sweep_factor,
         double downsize_factor,
-        double upsize_factor)
+        double upsize_factor,
+        AllocationMapSizing sizing)
 {
     AllocationMap* am = (AllocationMap*) malloc(sizeof(AllocationMap));
-    am->min_capacity = next_prime(min_capacity);
-    am->capacity = next_prime(capacity);
-    if (am->capacity < am->min_capacity) am->capacity = am->min_capacity;
+    am->sizing = sizing;
+    am->min_capacity = gc_allocation_map_round(am, min_capacity);
+    capacity = gc_allocation_map_round(am, capacity);
+    if (capacity < am->min_capacity) capacity = am->min_capacity;
+    gc_allocation_map_set_capacity(am, capacity);
     am->sweep_factor = sweep_factor;
     am->sweep_limit = (int) (sweep_factor * am->capacity);
     am->downsize_factor = downsize_factor;
     am->upsize_factor = upsize_factor;
-    am->allocs = (Allocation**) calloc(am->capacity, sizeof(Allocation*));
+    am->allocs = (Allocation*) calloc(am->capacity, sizeof(Allocation));
+    am->used_bits = (uint64_t*) calloc(GC_MARK_WORDS(am->capacity), sizeof(uint64_t));
+    am->mark_bits = (uint64_t*) calloc(GC_MARK_WORDS(am->capacity), sizeof(uint64_t));
     am->size = 0;
+    am->bytes = 0;
+    am->max_dist = 0;
+    am->version = 0;
+    am->sweeping = false;
+    am->removed = 0;
+    am->resized = NULL;
+    am->resized_data = NULL;
+#ifdef GC_RECORD
+    am->record = NULL;
+#endif
+    gc_allocation_map_filter_reset(am);
     LOG_DEBUG("Created allocation map (cap=%ld, siz=%ld)", am->capacity, am->size);
     return am;
 }
 
 static void gc_allocation_map_delete(AllocationMap* am)
 {
-    // Iterate over the map
     LOG_DEBUG("Deleting allocation map (cap=%ld, siz=%ld)",
               am->capacity, am->size);
-    Allocation *alloc, *tmp;
-    for (size_t i = 0; i < am->capacity; ++i) {
-        if ((alloc = am->allocs[i])) {
-            // Make sure to follow the chain inside a bucket
-            while (alloc) {
-                tmp = alloc;
-                alloc = alloc->next;
-                // free the management structure
-                gc_allocation_delete(tmp);
-            }
-        }
-    }
     free(am->allocs);
+    free(am->used_bits);
+    free(am->mark_bits);
     free(am);
 }
 
+/*
+ * 2^64 divided by the golden ratio, the multiplier for Fibonacci hashing.
+ */
+#define GC_FIBONACCI_MULTIPLIER 11400714819323198485ull
+
 static size_t gc_hash(void *ptr)
 {
-    return ((uintptr_t)ptr) >> 3;
+    /* Scramble the address: with linear probing, the evenly spaced home
+     * slots of consecutive allocations would merge into huge clusters */
+    return (size_t) ((uint64_t) (((uintptr_t)ptr) >> 3) * GC_FIBONACCI_MULTIPLIER);
+}
+
+/**
+ * Determine the home slot of a pointer in an `AllocationMap`.
+ *
+ * With prime capacities, the home slot is the scrambled address modulo the
+ * capacity. With power-of-two capacities, the address is multiplied by
+ * 2^64/phi and the top bits of the product are used (Fibonacci hashing),
+ * which mixes the high address bits into the index and avoids the division.
+ *
+ * @param am The allocation map.
+ * @param ptr The pointer to hash.
+ * @returns The home slot index of `ptr`.
+ */
+static size_t gc_allocation_map_home(AllocationMap* am, void* ptr)
+{
+    if (am->sizing == GC_SIZING_POW2) {
+        if (am->hash_shift >= 64) return 0;
+        return (size_t) (((uint64_t) (uintptr_t) ptr * GC_FIBONACCI_MULTIPLIER) >> am->hash_shift);
+    }
+    return gc_hash(ptr) % am->capacity;
+}
+
+/**
+ * Insert an allocation object into the slots of an `AllocationMap`.
+ *
+ * Performs Robin Hood insertion starting at the home slot of `alloc.ptr`.
+ * The caller must ensure that `alloc.ptr` is not yet present and that
+ * there is at least one empty slot. Does not update the size of the map.
+ *
+ * @param am The allocation map.
+ * @param alloc The allocation object to insert, copied into the map.
+ * @returns The slot that holds the inserted allocation object.
+ */
+static Allocation* gc_allocation_map_insert(AllocationMap* am, Allocation alloc)
+{
+    Allocation* allocs = am->allocs;
+    Allocation* inserted = NULL;
+    size_t index = gc_allocation_map_home(am, alloc.ptr);
+    bool marked = false;
+    alloc.dist = 0;
+    am->version++;
+    while (allocs[index].ptr) {
+        if (allocs[index].dist < alloc.dist) {
+            /* Take the slot from the entry that is closer to home */
+            Allocation tmp = allocs[index];
+            allocs[index] = alloc;
+            alloc = tmp;
+            bool tmp_marked = gc_bit_test(am->mark_bits, index);
+            if (marked) gc_bit_set(am->mark_bits, index);
+            else gc_bit_clear(am->mark_bits, index);
+            marked = tmp_marked;
+            if (!inserted) inserted = &allocs[index];
+        }
+        index = index + 1 < am->capacity ? index + 1 : 0;
+        alloc.dist++;
+    }
+    if (alloc.dist > am->max_dist) am->max_dist = alloc.dist;
+    allocs[index] = alloc;
+    gc_bit_set(am->used_bits, index);
+    if (marked) gc_bit_set(am->mark_bits, index);
+    return inserted ? inserted : &allocs[index];
 }
 
 static void gc_allocation_map_resize(AllocationMap* am, size_t new_capacity)
@@ -202,41 +512,56 @@ static void gc_allocation_map_resize(AllocationMap* am, size_t new_capacity)
     if (new_capacity <= am->min_capacity) {
         return;
     }
-    // Replaces the existing items array in the hash table
-    // with a resized one and pushes items into the new, correct buckets
-    LOG_DEBUG("Resizing allocation map (cap=%ld, siz=%ld) -> (cap=%ld)",
+    // Replaces the existing slot array in the hash table
+    // with a resized one and re-inserts all items
+    TRACE_MAP("Resizing allocation map (cap=%ld, siz=%ld) -> (cap=%ld)",
               am->capacity, am->size, new_capacity);
-    Allocation** resized_allocs = calloc(new_capacity, sizeof(Allocation*));
+    uint64_t start = am->resized ? gc_now_ns() : 0;
+    Allocation* old_allocs = am->allocs;
+    uint64_t* old_used_bits = am->used_bits;
+    uint64_t* old_mark_bits = am->mark_bits;
+    size_t old_capacity = am->capacity;
+    am->allocs = calloc(new_capacity, sizeof(Allocation));
+    am->used_bits = calloc(GC_MARK_WORDS(new_capacity), sizeof(uint64_t));
+    am->mark_bits = calloc(GC_MARK_WORDS(new_capacity), sizeof(uint64_t));
+    gc_allocation_map_set_capacity(am, new_capacity);
+    am->max_dist = 0;
 
-    for (size_t i = 0; i < am->capacity; ++i) {
-        Allocation* alloc = am->allocs[i];
-        while (alloc) {
-            Allocation* next_alloc = alloc->next;
-            size_t new_index = gc_hash(alloc->ptr) % new_capacity;
-            alloc->next = resized_allocs[new_index];
-            resized_allocs[new_index] = alloc;
-            alloc = next_alloc;
+    for (size_t i = 0; i < old_capacity; ++i) {
+        if (old_allocs[i].ptr) {
+            Allocation* alloc = gc_allocation_map_insert(am, old_allocs[i]);
+            if (gc_bit_test(old_mark_bits, i)) {
+                gc_bit_set(am->mark_bits, alloc - am->allocs);
+            }
         }
     }
-    free(am->allocs);
-    am->capacity = new_capacity;
-    am->allocs = resized_allocs;
+    free(old_allocs);
+    free(old_used_bits);
+    free(old_mark_bits);
     am->sweep_limit = am->size + am->sweep_factor * (am->capacity - am->size);
+    if (am->resized) {
+        am->resized(am->resized_data, old_capacity, gc_now_ns() - start);
+    }
 }
 
 static bool gc_allocation_map_resize_to_fit(AllocationMap* am)
 {
     double load_factor = gc_allocation_map_load_factor(am);
-    if (load_factor > am->upsize_factor) {
-        LOG_DEBUG("Load factor %0.3g > %0.3g. Triggering upsize.",
+    /* A sweep holds on to the slot arrays, it resizes once it is done.
+     * Only a full map must grow, or insertion would not terminate. */
+    if (am->sweeping && load_factor <= GC_MAX_LOAD_FACTOR) {
+        return false;
+    }
+    if (load_factor > am->upsize_factor || load_factor > GC_MAX_LOAD_FACTOR) {
+        TRACE_MAP("Load factor %0.3g > %0.3g. Triggering upsize.",
                   load_factor, am->upsize_factor);
-        gc_allocation_map_resize(am, next_prime(am->capacity * 2));
+        gc_allocation_map_resize(am, gc_allocation_map_round(am, am->capacity * 2));
         return true;
     }
     if (load_factor < am->downsize_factor) {
-        LOG_DEBUG("Load factor %0.3g < %0.3g. Triggering downsize.",
+        TRACE_MAP("Load factor %0.3g < %0.3g. Triggering downsize.",
                   load_factor, am->downsize_factor);
-        gc_allocation_map_resize(am, next_prime(am->capacity / 2));
+        gc_allocation_map_resize(am, gc_allocation_map_round(am, am->capacity / 2));
         return true;
     }
     return false;
@@ -244,15 +569,21 @@ static bool gc_allocation_map_resize_to_fit(AllocationMap* am)
 
 static Allocation* gc_allocation_map_get(AllocationMap* am, void* ptr)
 {
-    size_t index = gc_hash(ptr) % am->capacity;
-    Allocation* cur = am->allocs[index];
-    while(cur) {
+    if (!gc_allocation_map_filter_test(am, ptr)) {
+        return NULL;
+    }
+    size_t index = gc_allocation_map_home(am, ptr);
+    for (uint32_t dist = 0; ; ++dist) {
+        Allocation* cur = &am->allocs[index];
+        /* Robin Hood invariant: ptr would have displaced a closer entry */
+        if (!cur->ptr || cur->dist < dist) {
+            return NULL;
+        }
         if (cur->ptr == ptr) {
             return cur;
         }
-        cur = cur->next;
+        index = index + 1 < am->capacity ? index + 1 : 0;
     }
-    return NULL;
 }
 
 static Allocation* gc_allocation_map_put(AllocationMap* am,
@@ -260,373 +591,4776 @@ static Allocation* gc_allocation_map_put(AllocationMap* am,
         size_t size,
         void (*dtor)(void*))
 {
-    size_t index = gc_hash(ptr) % am->capacity;
-    LOG_DEBUG("PUT request for allocation ix=%ld", index);
-    Allocation* alloc = gc_allocation_new(ptr, size, dtor);
-    Allocation* cur = am->allocs[index];
-    Allocation* prev = NULL;
     /* Upsert if ptr is already known (e.g. dtor update). */
-    while(cur != NULL) {
-        if (cur->ptr == ptr) {
-            // found it
-            alloc->next = cur->next;
-            if (!prev) {
-                // position 0
-                am->allocs[index] = alloc;
-            } else {
-                // in the list
-                prev->next = alloc;
-            }
-            gc_allocation_delete(cur);
-            LOG_DEBUG("AllocationMap Upsert at ix=%ld", index);
-            return alloc;
-
-        }
-        prev = cur;
-        cur = cur->next;
+    Allocation* alloc = gc_allocation_map_get(am, ptr);
+    if (alloc) {
+        TRACE_MAP("AllocationMap Upsert at ix=%ld", (long) (alloc - am->allocs));
+        am->bytes += size - alloc->size;
+        alloc->size = size;
+        alloc->dtor = dtor;
+        alloc->tag = GC_TAG_NONE;
+        gc_bit_clear(am->mark_bits, alloc - am->allocs);
+        return alloc;
     }
-    /* Insert at the front of the separate chaining list */
-    cur = am->allocs[index];
-    alloc->next = cur;
-    am->allocs[index] = alloc;
+    Allocation entry = { .ptr = ptr, .size = size, .dtor = dtor, .tag = GC_TAG_NONE, .dist = 0 };
+    alloc = gc_allocation_map_insert(am, entry);
     am->size++;
-    LOG_DEBUG("AllocationMap insert at ix=%ld", index);
-    void* p = alloc->ptr;
+    am->bytes += size;
+    gc_allocation_map_filter_add(am, ptr);
+    TRACE_MAP("AllocationMap insert at ix=%ld", (long) (alloc - am->allocs));
     if (gc_allocation_map_resize_to_fit(am)) {
-        alloc = gc_allocation_map_get(am, p);
+        alloc = gc_allocation_map_get(am, ptr);
     }
     return alloc;
 }
 
+/**
+ * Remove the entry in a given slot from an `AllocationMap`.
+ *
+ * Shifts the following entries of the cluster back by one slot until an
+ * empty slot or an entry in its home slot is reached.
+ *
+ * @param am The allocation map.
+ * @param index The slot index of the entry to remove.
+ */
+static void gc_allocation_map_remove_at(AllocationMap* am, size_t index)
+{
+    am->version++;
+    am->bytes -= am->allocs[index].size;
+    size_t next = index + 1 < am->capacity ? index + 1 : 0;
+    while (am->allocs[next].ptr && am->allocs[next].dist > 0) {
+        am->allocs[index] = am->allocs[next];
+        am->allocs[index].dist--;
+        if (gc_bit_test(am->mark_bits, next)) gc_bit_set(am->mark_bits, index);
+        else gc_bit_clear(am->mark_bits, index);
+        index = next;
+        next = next + 1 < am->capacity ? next + 1 : 0;
+    }
+    memset(&am->allocs[index], 0, sizeof(Allocation));
+    gc_bit_clear(am->used_bits, index);
+    gc_bit_clear(am->mark_bits, index);
+    am->size--;
+}
 
+/**
+ * Remove an entry from an `AllocationMap`.
+ *
+ * While a sweep is running destructors, the entry is tagged as dead
+ * instead, like the garbage the sweep found, so that no entries move under
+ * the sweep. It is removed when the sweep compacts the map.
+ *
+ * @param am The allocation map.
+ * @param ptr The key of the entry, unknown keys are ignored.
+ * @param allow_resize `true` to shrink or grow the map to fit afterwards.
+ */
 static void gc_allocation_map_remove(AllocationMap* am,
                                      void* ptr,
                                      bool allow_resize)
 {
-    // ignores unknown keys
-    size_t index = gc_hash(ptr) % am->capacity;
-    Allocation* cur = am->allocs[index];
-    Allocation* prev = NULL;
-    Allocation* next;
-    while(cur != NULL) {
-        next = cur->next;
-        if (cur->ptr == ptr) {
-            // found it
-            if (!prev) {
-                // first item in list
-                am->allocs[index] = cur->next;
-            } else {
-                // not the first item in the list
-                prev->next = cur->next;
-            }
-            gc_allocation_delete(cur);
-            am->size--;
-        } else {
-            // move on
-            prev = cur;
+    Allocation* alloc = gc_allocation_map_get(am, ptr);
+    if (alloc && am->sweeping) {
+        if (!(alloc->tag & GC_TAG_DEAD)) {
+            alloc->tag = GC_TAG_DEAD;
+            am->removed++;
         }
-        cur = next;
+        return;
+    }
+    if (alloc) {
+        gc_allocation_map_remove_at(am, alloc - am->allocs);
     }
     if (allow_resize) {
         gc_allocation_map_resize_to_fit(am);
     }
 }
 
-
-static void* gc_mcalloc(size_t count, size_t size)
+/**
+ * Check if an entry of an `AllocationMap` is marked.
+ *
+ * @param am The allocation map.
+ * @param alloc The allocation object, stored in `am`.
+ * @returns `true` if the mark bit of the slot of `alloc` is set.
+ */
+static bool gc_allocation_map_marked(AllocationMap* am, Allocation* alloc)
 {
-    if (!count) return malloc(size);
-    return calloc(count, size);
+    return gc_bit_test(am->mark_bits, alloc - am->allocs);
 }
 
-static bool gc_needs_sweep(GarbageCollector* gc)
+/**
+ * Mark an entry of an `AllocationMap`.
+ *
+ * @param am The allocation map.
+ * @param alloc The allocation object, stored in `am`.
+ * @returns `true` if the entry was not marked before.
+ */
+static bool gc_allocation_map_mark(AllocationMap* am, Allocation* alloc)
 {
-    return gc->allocs->size > gc->allocs->sweep_limit;
+    return !gc_bit_test_and_set(am->mark_bits, alloc - am->allocs, false);
 }
 
-static void* gc_allocate(GarbageCollector* gc, size_t count, size_t size, void(*dtor)(void*))
+/**
+ * Clear the marks of all entries of an `AllocationMap`.
+ *
+ * @param am The allocation map.
+ */
+static void gc_allocation_map_unmark_all(AllocationMap* am)
 {
-    /* Allocation logic that generalizes over malloc/calloc. */
-
-    /* Check if we reached the high-water mark and need to clean up */
-    if (gc_needs_sweep(gc) && !gc->paused) {
-        size_t freed_mem = gc_run(gc);
-        LOG_DEBUG("Garbage collection cleaned up %lu bytes.", freed_mem);
-    }
-    /* With cleanup out of the way, attempt to allocate memory */
-    void* ptr = gc_mcalloc(count, size);
-    size_t alloc_size = count ? count * size : size;
-    /* If allocation fails, force an out-of-policy run to free some memory and try again. */
-    if (!ptr && !gc->paused && (errno == EAGAIN || errno == ENOMEM)) {
-        gc_run(gc);
-        ptr = gc_mcalloc(count, size);
-    }
-    /* Start managing the memory we received from the system */
-    if (ptr) {
-        LOG_DEBUG("Allocated %zu bytes at %p", alloc_size, (void*) ptr);
-        Allocation* alloc = gc_allocation_map_put(gc->allocs, ptr, alloc_size, dtor);
-        /* Deal with metadata allocation failure */
-        if (alloc) {
-            LOG_DEBUG("Managing %zu bytes at %p", alloc_size, (void*) alloc->ptr);
-            ptr = alloc->ptr;
-        } else {
-            /* We failed to allocate the metadata, fail cleanly. */
-            free(ptr);
-            ptr = NULL;
-        }
-    }
-    return ptr;
+    memset(am->mark_bits, 0, GC_MARK_WORDS(am->capacity) * sizeof(uint64_t));
 }
 
-static void gc_make_root(GarbageCollector* gc, void* ptr)
+/**
+ * Remove all entries tagged as dead from an `AllocationMap`.
+ *
+ * Compacts all clusters in a single pass instead of shifting the remainder
+ * of a cluster once per removed entry: every surviving entry moves back to
+ * the first free slot of its cluster, but never before its home slot. This
+ * preserves the Robin Hood ordering. The pass also rebuilds the address
+ * filter from the surviving entries. Does not resize the map.
+ *
+ * @param am The allocation map.
+ * @returns The number of removed entries.
+ */
+static size_t gc_allocation_map_compact(AllocationMap* am)
 {
-    Allocation* alloc = gc_allocation_map_get(gc->allocs, ptr);
-    if (alloc) {
-        alloc->tag |= GC_TAG_ROOT;
+    /* Starting right after an empty slot, no cluster wraps around the start */
+    size_t start = 0;
+    while (am->allocs[start].ptr) start++;
+    gc_allocation_map_filter_reset(am);
+    am->max_dist = 0;
+    size_t removed = 0;
+    /* Positions are relative to start; w is the next free slot of the cluster */
+    size_t w = 1;
+    for (size_t u = 1; u <= am->capacity; ++u) {
+        Allocation* cur = &am->allocs[(start + u) % am->capacity];
+        if (!cur->ptr) {
+            w = u + 1;
+            continue;
+        }
+        if (cur->tag & GC_TAG_DEAD) {
+            am->bytes -= cur->size;
+            memset(cur, 0, sizeof(Allocation));
+            gc_bit_clear(am->used_bits, (start + u) % am->capacity);
+            gc_bit_clear(am->mark_bits, (start + u) % am->capacity);
+            removed++;
+            continue;
+        }
+        size_t home = u - cur->dist;
+        size_t target = home > w ? home : w;
+        gc_allocation_map_filter_add(am, cur->ptr);
+        if (target != u) {
+            size_t src = (start + u) % am->capacity;
+            size_t dst = (start + target) % am->capacity;
+            if (gc_allocation_map_marked(am, cur)) {
+                gc_bit_set(am->mark_bits, dst);
+                gc_bit_clear(am->mark_bits, src);
+            }
+            am->allocs[dst] = *cur;
+            am->allocs[dst].dist = (uint32_t) (target - home);
+            memset(cur, 0, sizeof(Allocation));
+            gc_bit_set(am->used_bits, dst);
+            gc_bit_clear(am->used_bits, src);
+        }
+        if (target - home > am->max_dist) am->max_dist = (uint32_t) (target - home);
+        w = target + 1;
     }
+    am->size -= removed;
+    am->removed = 0;
+    am->version++;
+    return removed;
 }
 
-void* gc_malloc(GarbageCollector* gc, size_t size)
+/*
+ * Small-object pages are GC_SMALL_PAGE_SIZE bytes large and aligned to
+ * their size, so the page of any address is found by masking the low bits.
+ * Requests of up to GC_SMALL_MAX bytes are rounded up to one of the size
+ * classes in `gc_size_classes`.
+ */
+#define GC_SMALL_PAGE_SHIFT 16
+#define GC_SMALL_PAGE_SIZE ((size_t) 1 << GC_SMALL_PAGE_SHIFT)
+#define GC_SMALL_MAX 256
+#define GC_SMALL_MIN 16
+#define GC_SIZE_CLASS_COUNT 8
+#define GC_SMALL_BITMAP_WORDS (GC_SMALL_PAGE_SIZE / GC_SMALL_MIN / 64)
+
+/*
+ * Minimum number of small objects allocated between two collections that
+ * are triggered by the small-object heap.
+ */
+#define GC_SMALL_MIN_SWEEP_LIMIT 4096
+
+static const size_t gc_size_classes[GC_SIZE_CLASS_COUNT] = {
+    16, 32, 48, 64, 96, 128, 192, 256
+};
+
+/*
+ * Maps (size + 15) / 16 to the smallest size class that fits `size` bytes.
+ */
+static const unsigned char gc_size_class_index[GC_SMALL_MAX / 16 + 1] = {
+    0, 0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7
+};
+
+static unsigned int gc_size_class(size_t size)
 {
-    return gc_malloc_ext(gc, size, NULL);
+    return gc_size_class_index[(size + 15) / 16];
 }
 
-void* gc_malloc_static(GarbageCollector* gc, size_t size, void(*dtor)(void*))
+/**
+ * A page of equally sized slots for small objects.
+ *
+ * Allocation takes a slot from the free list or, if the free list is empty,
+ * bumps `bump` into the part of the page that has never been used. The
+ * metadata of a slot are three bits: allocated, marked and root, plus young
+ * and remembered in generational mode. Objects with a destructor are never
+ * stored in small-object pages.
+ */
+typedef struct SmallPage {
+    char* base;                  // page memory, aligned to GC_SMALL_PAGE_SIZE
+    size_t slot_size;            // size of each slot in bytes
+    size_t nslots;               // number of slots in the page
+    size_t bump;                 // slots >= bump have never been allocated
+    size_t used;                 // number of allocated slots
+    unsigned int size_class;     // index into gc_size_classes
+    void* free_list;             // freed slots, linked through their first word
+    struct SmallPage* next_avail; // next page of this class with free slots
+    bool unswept;                // marks of the last collection not applied yet
+    uint64_t alloc_bits[GC_SMALL_BITMAP_WORDS];
+    uint64_t mark_bits[GC_SMALL_BITMAP_WORDS];
+    uint64_t root_bits[GC_SMALL_BITMAP_WORDS];
+    uint64_t young_bits[GC_SMALL_BITMAP_WORDS];
+    uint64_t remembered_bits[GC_SMALL_BITMAP_WORDS];
+} SmallPage;
+
+/**
+ * The small-object heap.
+ *
+ * Holds all small-object pages, a hash index from page addresses to pages
+ * (open addressing with linear probing and Fibonacci hashing) and, per size
+ * class, a list of pages that have free slots.
+ */
+typedef struct SmallHeap {
+    SmallPage** pages;
+    size_t npages;
+    size_t pages_capacity;
+    SmallPage** index;
+    size_t index_capacity;
+    unsigned int index_shift;
+    uintptr_t min_page;
+    uintptr_t max_page;
+    SmallPage* avail[GC_SIZE_CLASS_COUNT];
+    SmallPage* unswept[GC_SIZE_CLASS_COUNT]; // pages awaiting a lazy sweep
+    size_t count;                // number of allocated small objects
+    size_t bytes;                // sum of the slot sizes of allocated objects
+    size_t sweep_limit;          // collect once count exceeds this limit
+    bool allocate_black;         // mark new objects (incremental marking)
+    bool allocate_young;         // new objects are young (generational mode)
+#ifdef GC_RECORD
+    FILE* record;                // trace output for deaths, see gc_record()
+#endif
+} SmallHeap;
+
+static void* gc_page_alloc()
 {
-    void* ptr = gc_malloc_ext(gc, size, dtor);
-    gc_make_root(gc, ptr);
-    return ptr;
+#if defined(_MSC_VER)
+    return _aligned_malloc(GC_SMALL_PAGE_SIZE, GC_SMALL_PAGE_SIZE);
+#else
+    return aligned_alloc(GC_SMALL_PAGE_SIZE, GC_SMALL_PAGE_SIZE);
+#endif
 }
 
-void* gc_make_static(GarbageCollector* gc, void* ptr)
+static void gc_page_free(void* base)
 {
-    gc_make_root(gc, ptr);
-    return ptr;
+#if defined(_MSC_VER)
+    _aligned_free(base);
+#else
+    free(base);
+#endif
 }
 
-void* gc_malloc_ext(GarbageCollector* gc, size_t size, void(*dtor)(void*))
+static SmallHeap* gc_small_heap_new()
 {
-    return gc_allocate(gc, 0, size, dtor);
+    SmallHeap* sh = (SmallHeap*) calloc(1, sizeof(SmallHeap));
+    sh->min_page = UINTPTR_MAX;
+    sh->sweep_limit = GC_SMALL_MIN_SWEEP_LIMIT;
+    return sh;
 }
 
-
-void* gc_calloc(GarbageCollector* gc, size_t count, size_t size)
+static void gc_small_heap_delete(SmallHeap* sh)
 {
-    return gc_calloc_ext(gc, count, size, NULL);
+    for (size_t i = 0; i < sh->npages; ++i) {
+        gc_page_free(sh->pages[i]->base);
+        free(sh->pages[i]);
+    }
+    free(sh->pages);
+    free(sh->index);
+    free(sh);
 }
 
-
-void* gc_calloc_ext(GarbageCollector* gc, size_t count, size_t size,
-                    void(*dtor)(void*))
+static size_t gc_small_heap_home(SmallHeap* sh, uintptr_t base)
 {
-    return gc_allocate(gc, count, size, dtor);
+    return (size_t) ((uint64_t) (base >> GC_SMALL_PAGE_SHIFT) * GC_FIBONACCI_MULTIPLIER
+                     >> sh->index_shift);
+}
+
+/**
+ * Rebuild the page index and the address range of a `SmallHeap`.
+ *
+ * The index is kept at a load factor of at most 0.5. It grows with the
+ * number of pages but never shrinks, so rebuilding it after pages were
+ * released does not allocate.
+ *
+ * @param sh The small-object heap.
+ * @returns `false` if the index could not be allocated.
+ */
+static bool gc_small_heap_reindex(SmallHeap* sh)
+{
+    size_t capacity = next_pow2(2 * sh->npages + 2);
+    if (capacity > sh->index_capacity) {
+        SmallPage** index = (SmallPage**) malloc(capacity * sizeof(SmallPage*));
+        if (!index) return false;
+        free(sh->index);
+        sh->index = index;
+        sh->index_capacity = capacity;
+        sh->index_shift = 64;
+        while (capacity > 1) {
+            sh->index_shift--;
+            capacity >>= 1;
+        }
+    }
+    memset(sh->index, 0, sh->index_capacity * sizeof(SmallPage*));
+    sh->min_page = UINTPTR_MAX;
+    sh->max_page = 0;
+    for (size_t i = 0; i < sh->npages; ++i) {
+        uintptr_t base = (uintptr_t) sh->pages[i]->base;
+        size_t j = gc_small_heap_home(sh, base);
+        while (sh->index[j]) j = (j + 1) & (sh->index_capacity - 1);
+        sh->index[j] = sh->pages[i];
+        if (base < sh->min_page) sh->min_page = base;
+        if (base > sh->max_page) sh->max_page = base;
+    }
+    return true;
+}
+
+/**
+ * Find the allocated small object that starts at or contains `ptr`.
+ *
+ * @param sh The small-object heap.
+ * @param ptr A candidate pointer, not necessarily pointing to managed memory.
+ * @param slot Receives the slot index of the object in its page.
+ * @param interior Also accept pointers into the middle of a slot.
+ * @returns The page that holds the object or `NULL` if `ptr` does not
+ *          point to an allocated small object.
+ */
+static SmallPage* gc_small_heap_lookup(SmallHeap* sh, void* ptr, size_t* slot, bool interior)
+{
+    uintptr_t base = (uintptr_t) ptr & ~(uintptr_t) (GC_SMALL_PAGE_SIZE - 1);
+    if (base < sh->min_page || base > sh->max_page) {
+        return NULL;
+    }
+    for (size_t j = gc_small_heap_home(sh, base); sh->index[j];
+            j = (j + 1) & (sh->index_capacity - 1)) {
+        SmallPage* page = sh->index[j];
+        if ((uintptr_t) page->base != base) continue;
+        size_t offset = (uintptr_t) ptr - base;
+        size_t i = offset / page->slot_size;
+        if ((!interior && i * page->slot_size != offset) || i >= page->bump ||
+                !gc_bit_test(page->alloc_bits, i)) {
+            return NULL;
+        }
+        *slot = i;
+        return page;
+    }
+    return NULL;
+}
+
+/**
+ * Find the allocated small object that starts at `ptr`.
+ *
+ * @see gc_small_heap_lookup()
+ */
+static SmallPage* gc_small_heap_find(SmallHeap* sh, void* ptr, size_t* slot)
+{
+    return gc_small_heap_lookup(sh, ptr, slot, false);
+}
+
+static SmallPage* gc_small_heap_add_page(SmallHeap* sh, unsigned int size_class)
+{
+    if (sh->npages == sh->pages_capacity) {
+        size_t capacity = sh->pages_capacity ? 2 * sh->pages_capacity : 16;
+        SmallPage** pages = (SmallPage**) realloc(sh->pages, capacity * sizeof(SmallPage*));
+        if (!pages) return NULL;
+        sh->pages = pages;
+        sh->pages_capacity = capacity;
+    }
+    SmallPage* page = (SmallPage*) calloc(1, sizeof(SmallPage));
+    if (!page) return NULL;
+    page->base = (char*) gc_page_alloc();
+    if (!page->base) {
+        free(page);
+        return NULL;
+    }
+    page->size_class = size_class;
+    page->slot_size = gc_size_classes[size_class];
+    page->nslots = GC_SMALL_PAGE_SIZE / page->slot_size;
+    sh->pages[sh->npages++] = page;
+    if (!gc_small_heap_reindex(sh)) {
+        sh->npages--;
+        gc_page_free(page->base);
+        free(page);
+        return NULL;
+    }
+    page->next_avail = sh->avail[size_class];
+    sh->avail[size_class] = page;
+    LOG_DEBUG("Added small-object page %p (slot size %zu)", (void*) page->base, page->slot_size);
+    return page;
+}
+
+static bool gc_small_page_full(SmallPage* page)
+{
+    return !page->free_list && page->bump == page->nslots;
+}
+
+/**
+ * Sweep a small-object page.
+ *
+ * All allocated but unmarked slots are freed and all marks are cleared,
+ * one bitmap word (64 slots) at a time.
+ *
+ * @param page The page to sweep.
+ * @returns The number of freed slots.
+ */
+static size_t gc_small_page_sweep(SmallPage* page)
+{
+    size_t freed = 0;
+    size_t words = (page->bump + 63) / 64;
+    for (size_t w = 0; w < words; ++w) {
+        uint64_t dead = page->alloc_bits[w] & ~page->mark_bits[w];
+        page->alloc_bits[w] = page->mark_bits[w];
+        page->root_bits[w] &= page->mark_bits[w];
+        page->young_bits[w] &= page->mark_bits[w];
+        page->remembered_bits[w] &= page->mark_bits[w];
+        page->mark_bits[w] = 0;
+        while (dead) {
+            char* ptr = page->base + (w * 64 + gc_ctz64(dead)) * page->slot_size;
+            *(void**) ptr = page->free_list;
+            page->free_list = ptr;
+            dead &= dead - 1;
+            freed++;
+        }
+    }
+    page->used -= freed;
+    return freed;
+}
+
+#ifdef GC_RECORD
+/**
+ * Record the deaths of the allocated but unmarked slots of a page, before
+ * it is swept.
+ *
+ * @param sh The small-object heap.
+ * @param page The page about to be swept.
+ */
+static void gc_small_page_record(SmallHeap* sh, SmallPage* page)
+{
+    if (!sh->record) {
+        return;
+    }
+    size_t words = (page->bump + 63) / 64;
+    for (size_t w = 0; w < words; ++w) {
+        uint64_t dead = page->alloc_bits[w] & ~page->mark_bits[w];
+        while (dead) {
+            char* ptr = page->base + (w * 64 + gc_ctz64(dead)) * page->slot_size;
+            fprintf(sh->record, "d %" PRIxPTR "\n", GC_RECORD_ADDR(ptr));
+            dead &= dead - 1;
+        }
+    }
+}
+#else
+#define gc_small_page_record(sh, page) ((void) 0)
+#endif
+
+/**
+ * Sweep a range of pages of a `SmallHeap`.
+ *
+ * Only touches the swept pages, so disjoint ranges can be swept in
+ * parallel. `gc_small_heap_sweep_done()` completes the sweep.
+ *
+ * @param sh The small-object heap.
+ * @param begin The index of the first page.
+ * @param end One past the index of the last page.
+ * @param freed Incremented by the number of freed objects.
+ * @returns The number of freed bytes.
+ */
+static size_t gc_small_heap_sweep_pages(SmallHeap* sh, size_t begin, size_t end, size_t* freed)
+{
+    size_t total = 0;
+    for (size_t i = begin; i < end; ++i) {
+        SmallPage* page = sh->pages[i];
+        gc_small_page_record(sh, page);
+        size_t n = gc_small_page_sweep(page);
+        total += n * page->slot_size;
+        *freed += n;
+    }
+    return total;
+}
+
+/**
+ * Release the empty pages and rebuild the lists of pages with free slots
+ * after all pages have been swept.
+ *
+ * @param sh The small-object heap.
+ */
+static void gc_small_heap_sweep_done(SmallHeap* sh)
+{
+    size_t kept = 0;
+    memset(sh->avail, 0, sizeof(sh->avail));
+    for (size_t i = 0; i < sh->npages; ++i) {
+        SmallPage* page = sh->pages[i];
+        if (page->used == 0) {
+            TRACE_SWEEP("Releasing small-object page %p", (void*) page->base);
+            gc_page_free(page->base);
+            free(page);
+            continue;
+        }
+        page->next_avail = NULL;
+        if (!gc_small_page_full(page)) {
+            page->next_avail = sh->avail[page->size_class];
+            sh->avail[page->size_class] = page;
+        }
+        sh->pages[kept++] = page;
+    }
+    if (kept != sh->npages) {
+        sh->npages = kept;
+        gc_small_heap_reindex(sh);
+    }
+    sh->sweep_limit = sh->count + (sh->count > GC_SMALL_MIN_SWEEP_LIMIT
+                                   ? sh->count : GC_SMALL_MIN_SWEEP_LIMIT);
+}
+
+/**
+ * Sweep all pages of a `SmallHeap`.
+ *
+ * Releases empty pages to the system and rebuilds the lists of pages with
+ * free slots.
+ *
+ * @param sh The small-object heap.
+ * @returns The number of freed bytes.
+ */
+static size_t gc_small_heap_sweep(SmallHeap* sh)
+{
+    size_t freed = 0;
+    size_t total = gc_small_heap_sweep_pages(sh, 0, sh->npages, &freed);
+    sh->count -= freed;
+    sh->bytes -= total;
+    gc_small_heap_sweep_done(sh);
+    return total;
+}
+
+/**
+ * Defer the sweep of all pages of a `SmallHeap`.
+ *
+ * Moves every page to the unswept list of its size class. Until a page is
+ * swept, nothing is allocated from it.
+ *
+ * @param sh The small-object heap.
+ */
+static void gc_small_heap_sweep_lazy(SmallHeap* sh)
+{
+    memset(sh->avail, 0, sizeof(sh->avail));
+    memset(sh->unswept, 0, sizeof(sh->unswept));
+    for (size_t i = 0; i < sh->npages; ++i) {
+        SmallPage* page = sh->pages[i];
+        page->unswept = true;
+        page->next_avail = sh->unswept[page->size_class];
+        sh->unswept[page->size_class] = page;
+    }
+}
+
+/**
+ * Sweep the next unswept page of a size class.
+ *
+ * @param sh The small-object heap.
+ * @param size_class The size class, `GC_SIZE_CLASS_COUNT` for any class.
+ * @param freed Incremented by the number of freed bytes.
+ * @returns `false` if there was no page left to sweep.
+ */
+static bool gc_small_heap_sweep_next(SmallHeap* sh, unsigned int size_class, size_t* freed)
+{
+    if (size_class == GC_SIZE_CLASS_COUNT) {
+        size_class = 0;
+        while (size_class < GC_SIZE_CLASS_COUNT && !sh->unswept[size_class]) size_class++;
+        if (size_class == GC_SIZE_CLASS_COUNT) return false;
+    }
+    SmallPage* page = sh->unswept[size_class];
+    if (!page) return false;
+    sh->unswept[size_class] = page->next_avail;
+    gc_small_page_record(sh, page);
+    size_t n = gc_small_page_sweep(page);
+    sh->count -= n;
+    sh->bytes -= n * page->slot_size;
+    *freed += n * page->slot_size;
+    page->unswept = false;
+    page->next_avail = NULL;
+    if (!gc_small_page_full(page)) {
+        page->next_avail = sh->avail[size_class];
+        sh->avail[size_class] = page;
+    }
+    return true;
+}
+
+/**
+ * Allocate a small object.
+ *
+ * While an incremental mark is in progress, the object is marked right away.
+ * In generational mode, it is young.
+ *
+ * @param sh The small-object heap.
+ * @param size The requested size, at most GC_SMALL_MAX bytes.
+ * @param zero Zero the whole slot if `true`.
+ * @returns The object or `NULL` if a new page was needed but could not be
+ *          allocated.
+ */
+static void* gc_small_heap_alloc(SmallHeap* sh, size_t size, bool zero)
+{
+    unsigned int size_class = gc_size_class(size);
+    /* Reuse the garbage of the last collection before adding pages */
+    size_t freed = 0;
+    while (!sh->avail[size_class] && gc_small_heap_sweep_next(sh, size_class, &freed));
+    SmallPage* page = sh->avail[size_class];
+    if (!page) {
+        page = gc_small_heap_add_page(sh, size_class);
+        if (!page) return NULL;
+    }
+    char* ptr;
+    size_t slot;
+    if (page->free_list) {
+        ptr = (char*) page->free_list;
+        page->free_list = *(void**) ptr;
+        *(void**) ptr = NULL;
+        slot = (size_t) (ptr - page->base) / page->slot_size;
+    } else {
+        slot = page->bump++;
+        ptr = page->base + slot * page->slot_size;
+    }
+    gc_bit_set(page->alloc_bits, slot);
+    if (sh->allocate_black) {
+        gc_bit_set(page->mark_bits, slot);
+    }
+    if (sh->allocate_young) {
+        gc_bit_set(page->young_bits, slot);
+    }
+    page->used++;
+    sh->count++;
+    sh->bytes += page->slot_size;
+    if (gc_small_page_full(page)) {
+        sh->avail[size_class] = page->next_avail;
+        page->next_avail = NULL;
+    }
+    if (zero) {
+        memset(ptr, 0, page->slot_size);
+    }
+    return ptr;
+}
+
+/**
+ * Return a slot to the free list of its page.
+ *
+ * @param sh The small-object heap.
+ * @param page The page that holds the object.
+ * @param slot The slot index of the object.
+ */
+static void gc_small_heap_free(SmallHeap* sh, SmallPage* page, size_t slot)
+{
+    if (!page->unswept && gc_small_page_full(page)) {
+        page->next_avail = sh->avail[page->size_class];
+        sh->avail[page->size_class] = page;
+    }
+    char* ptr = page->base + slot * page->slot_size;
+    *(void**) ptr = page->free_list;
+    page->free_list = ptr;
+    gc_bit_clear(page->alloc_bits, slot);
+    gc_bit_clear(page->root_bits, slot);
+    gc_bit_clear(page->young_bits, slot);
+    gc_bit_clear(page->remembered_bits, slot);
+    /* A later sweep must not bring the slot back to life */
+    gc_bit_clear(page->mark_bits, slot);
+    page->used--;
+    sh->count--;
+    sh->bytes -= page->slot_size;
+}
+
+/**
+ * The interior pointer index.
+ *
+ * An address-ordered array of the allocation map entries that resolves any
+ * address inside `[ptr, ptr + size)` of an entry to the entry by binary
+ * search. Entries of the map do not move while marking, so the index holds
+ * pointers to the map slots. It is rebuilt (in O(n log n)) before marking if
+ * the map changed since the last build.
+ */
+typedef struct InteriorIndex {
+    Allocation** items;
+    size_t size;
+    size_t capacity;
+    size_t version;           // map version the index was built for
+    uintptr_t lo;             // smallest start address
+    uintptr_t hi;             // largest end address
+} InteriorIndex;
+
+static InteriorIndex* gc_interior_index_new()
+{
+    InteriorIndex* idx = (InteriorIndex*) calloc(1, sizeof(InteriorIndex));
+    idx->version = SIZE_MAX;
+    idx->lo = UINTPTR_MAX;
+    return idx;
+}
+
+static void gc_interior_index_delete(InteriorIndex* idx)
+{
+    free(idx->items);
+    free(idx);
+}
+
+static int gc_interior_index_compare(const void* a, const void* b)
+{
+    uintptr_t pa = (uintptr_t) (*(Allocation* const*) a)->ptr;
+    uintptr_t pb = (uintptr_t) (*(Allocation* const*) b)->ptr;
+    return (pa > pb) - (pa < pb);
+}
+
+/**
+ * Rebuild the interior pointer index if the allocation map has changed.
+ *
+ * If the index cannot grow, it keeps its previous contents but is cleared,
+ * i.e. marking falls back to exact pointers until the next rebuild.
+ *
+ * @param idx The interior pointer index.
+ * @param am The allocation map.
+ */
+static void gc_interior_index_update(InteriorIndex* idx, AllocationMap* am)
+{
+    if (idx->version == am->version) {
+        return;
+    }
+    idx->version = am->version;
+    idx->size = 0;
+    idx->lo = UINTPTR_MAX;
+    idx->hi = 0;
+    if (am->size > idx->capacity) {
+        Allocation** items = (Allocation**) realloc(idx->items, am->size * sizeof(Allocation*));
+        if (!items) {
+            LOG_WARNING("Failed to grow the interior pointer index (siz=%zu)", am->size);
+            return;
+        }
+        idx->items = items;
+        idx->capacity = am->size;
+    }
+    for (size_t i = 0; i < am->capacity; ++i) {
+        if (am->allocs[i].ptr) {
+            idx->items[idx->size++] = &am->allocs[i];
+        }
+    }
+    if (idx->size == 0) {
+        return;
+    }
+    qsort(idx->items, idx->size, sizeof(Allocation*), gc_interior_index_compare);
+    Allocation* last = idx->items[idx->size - 1];
+    idx->lo = (uintptr_t) idx->items[0]->ptr;
+    idx->hi = (uintptr_t) last->ptr + (last->size ? last->size : 1);
+}
+
+/**
+ * Find the allocation map entry that contains an address.
+ *
+ * @param idx The interior pointer index, up to date with the map.
+ * @param ptr A candidate pointer, not necessarily pointing to managed memory.
+ * @returns The entry with `ptr` in `[entry->ptr, entry->ptr + entry->size)`
+ *          or `NULL`.
+ */
+static Allocation* gc_interior_index_find(InteriorIndex* idx, void* ptr)
+{
+    uintptr_t p = (uintptr_t) ptr;
+    if (p < idx->lo || p >= idx->hi) {
+        return NULL;
+    }
+    /* Find the last entry that starts at or before p */
+    size_t lo = 0;
+    size_t hi = idx->size;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((uintptr_t) idx->items[mid]->ptr <= p) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    Allocation* alloc = idx->items[lo];
+    uintptr_t start = (uintptr_t) alloc->ptr;
+    return p == start || p - start < alloc->size ? alloc : NULL;
+}
+
+/*
+ * Initial and maximum number of entries on the mark stack. Once the
+ * maximum is reached, marking falls back to rescanning the heap (see
+ * `gc_mark_drain()`).
+ */
+#define GC_MARK_STACK_INITIAL_CAPACITY 256
+#define GC_MARK_STACK_MAX_CAPACITY (1 << 20)
+
+/**
+ * A memory range that still needs to be scanned for pointers.
+ *
+ * Mark stack entries hold the range rather than the allocation object so
+ * that scanning does not need a second lookup in the allocation map.
+ */
+typedef struct MarkRange {
+    char* ptr;
+    size_t size;
+} MarkRange;
+
+/**
+ * The mark stack.
+ *
+ * Marking is driven by an explicit, growable stack of ranges instead of
+ * recursion, so the mark depth does not depend on the shape of the object
+ * graph. If the stack cannot grow any further, the `overflow` flag is set
+ * and the affected allocations are picked up again by rescanning the heap.
+ *
+ * While the world is stopped, the stack is `fixed`: a suspended thread may
+ * hold the allocator's lock, so a full stack overflows instead of growing.
+ * Its capacity is reserved before the world is stopped instead (see
+ * `gc_mark_prepare()`).
+ */
+typedef struct MarkStack {
+    size_t capacity;
+    size_t max_capacity;
+    size_t size;
+    bool overflow;
+    bool fixed;
+    MarkRange* items;
+} MarkStack;
+
+static MarkStack* gc_mark_stack_new(size_t capacity, size_t max_capacity)
+{
+    MarkStack* ms = (MarkStack*) malloc(sizeof(MarkStack));
+    ms->capacity = capacity < max_capacity ? capacity : max_capacity;
+    ms->max_capacity = max_capacity;
+    ms->size = 0;
+    ms->overflow = false;
+    ms->fixed = false;
+    ms->items = (MarkRange*) malloc(ms->capacity * sizeof(MarkRange));
+    return ms;
+}
+
+static void gc_mark_stack_delete(MarkStack* ms)
+{
+    free(ms->items);
+    free(ms);
+}
+
+/**
+ * Push a range onto the mark stack.
+ *
+ * Grows the stack if required. If the stack is at its maximum capacity, is
+ * fixed (or growing fails), the range is dropped and the overflow flag is
+ * set instead.
+ *
+ * @param ms The mark stack.
+ * @param ptr The start of the memory range to scan.
+ * @param size The size of the memory range in bytes.
+ * @returns `true` if the range was pushed, `false` on overflow.
+ */
+static bool gc_mark_stack_push(MarkStack* ms, void* ptr, size_t size)
+{
+    if (ms->size == ms->capacity) {
+        size_t new_capacity = ms->capacity * 2;
+        if (new_capacity > ms->max_capacity) new_capacity = ms->max_capacity;
+        MarkRange* items = NULL;
+        if (new_capacity > ms->capacity && !ms->fixed) {
+            items = (MarkRange*) realloc(ms->items, new_capacity * sizeof(MarkRange));
+        }
+        if (!items) {
+            TRACE_MARK("Mark stack overflow (cap=%zu)", ms->capacity);
+            ms->overflow = true;
+            return false;
+        }
+        ms->items = items;
+        ms->capacity = new_capacity;
+    }
+    ms->items[ms->size].ptr = (char*) ptr;
+    ms->items[ms->size].size = size;
+    ms->size++;
+    return true;
+}
+
+#ifndef GC_NO_THREADS
+/**
+ * Grow the mark stack to hold at least `n` entries, up to its maximum.
+ *
+ * Failing to grow is not an error, the stack overflows earlier instead.
+ *
+ * @param ms The mark stack.
+ * @param n The number of entries to make room for.
+ */
+static void gc_mark_stack_reserve(MarkStack* ms, size_t n)
+{
+    if (n > ms->max_capacity) n = ms->max_capacity;
+    if (n <= ms->capacity || ms->fixed) {
+        return;
+    }
+    MarkRange* items = (MarkRange*) realloc(ms->items, n * sizeof(MarkRange));
+    if (items) {
+        ms->items = items;
+        ms->capacity = n;
+    }
+}
+#endif
+
+/**
+ * A queue of unreachable allocations whose destructors have not run yet.
+ *
+ * With deferred finalizers, the sweep does not call destructors but moves
+ * the allocations to this queue. The entries are copies of the allocation
+ * objects, which are removed from the allocation map with the sweep; their
+ * memory is released once the destructor has run.
+ */
+typedef struct FinalizerQueue {
+    size_t capacity;
+    size_t size;
+    Allocation* items;
+} FinalizerQueue;
+
+/**
+ * Append an allocation to a finalizer queue.
+ *
+ * @param fq The finalizer queue.
+ * @param alloc The allocation to finalize later.
+ * @returns `false` if the queue could not grow.
+ */
+static bool gc_finalizer_queue_push(FinalizerQueue* fq, const Allocation* alloc)
+{
+    if (fq->size == fq->capacity) {
+        size_t new_capacity = fq->capacity ? fq->capacity * 2 : 64;
+        Allocation* items = (Allocation*) realloc(fq->items, new_capacity * sizeof(Allocation));
+        if (!items) {
+            return false;
+        }
+        fq->items = items;
+        fq->capacity = new_capacity;
+    }
+    fq->items[fq->size++] = *alloc;
+    return true;
+}
+
+/*
+ * Maximum number of ranges a mark worker takes from another worker's
+ * stack in one go.
+ */
+#define GC_MARK_STEAL_MAX 64
+
+/**
+ * A parallel mark and sweep worker.
+ *
+ * Every worker owns a mark stack. The owner pushes and pops at the top of
+ * its stack, idle workers steal ranges from the stacks of their peers. All
+ * accesses to a stack are serialized by the lock of its worker.
+ *
+ * When sweeping, every worker collects its results and the allocations to
+ * finalize separately; they are merged once all workers are done.
+ */
+typedef struct Worker {
+    MarkStack* stack;
+    FinalizerQueue finalizers;
+    size_t swept_bytes;
+    size_t swept_count;       // dead entries of the allocation map
+    size_t swept_small;       // dead small objects
+    size_t swept_small_bytes; // their slot sizes
+#ifndef GC_NO_THREADS
+    struct WorkerPool* pool;
+    size_t id;
+    pthread_mutex_t lock;
+#endif
+} Worker;
+
+#ifndef GC_NO_THREADS
+
+/**
+ * The pool of parallel mark and sweep workers.
+ *
+ * Worker 0 is the collecting thread itself, workers 1 to `nworkers - 1`
+ * run on helper threads that are started with the garbage collector and
+ * sleep between phases. A phase runs the same job on every worker.
+ */
+typedef struct WorkerPool {
+    GarbageCollector* gc;
+    size_t nworkers;
+    Worker* workers;
+    pthread_t* threads;
+    pthread_mutex_t lock;
+    pthread_cond_t start;     // a phase started (or shutdown)
+    pthread_cond_t done;      // a helper finished the phase
+    void (*job)(struct WorkerPool* pool, size_t id);
+    size_t phase;             // number of phases started so far
+    size_t finished;          // helpers done with the current phase
+    bool shutdown;
+    size_t active;            // workers that may still create work (atomic)
+} WorkerPool;
+
+static void gc_mark_worker_push(Worker* worker, void* ptr, size_t size)
+{
+    pthread_mutex_lock(&worker->lock);
+    gc_mark_stack_push(worker->stack, ptr, size);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static bool gc_mark_worker_pop(Worker* worker, MarkRange* range)
+{
+    pthread_mutex_lock(&worker->lock);
+    bool found = worker->stack->size > 0;
+    if (found) {
+        *range = worker->stack->items[--worker->stack->size];
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return found;
+}
+
+/**
+ * Move up to half of the ranges of another worker's stack to the stack of
+ * worker `id`.
+ *
+ * @param pool The mark pool.
+ * @param id The index of the stealing worker.
+ * @returns `true` if any ranges were stolen.
+ */
+static bool gc_mark_worker_steal(WorkerPool* pool, size_t id)
+{
+    MarkRange loot[GC_MARK_STEAL_MAX];
+    for (size_t k = 1; k < pool->nworkers; ++k) {
+        Worker* victim = &pool->workers[(id + k) % pool->nworkers];
+        size_t n = 0;
+        pthread_mutex_lock(&victim->lock);
+        if (victim->stack->size > 0) {
+            n = (victim->stack->size + 1) / 2;
+            if (n > GC_MARK_STEAL_MAX) n = GC_MARK_STEAL_MAX;
+            victim->stack->size -= n;
+            memcpy(loot, victim->stack->items + victim->stack->size, n * sizeof(MarkRange));
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (n) {
+            Worker* self = &pool->workers[id];
+            pthread_mutex_lock(&self->lock);
+            for (size_t i = 0; i < n; ++i) {
+                gc_mark_stack_push(self->stack, loot[i].ptr, loot[i].size);
+            }
+            pthread_mutex_unlock(&self->lock);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void* gc_worker_pool_thread(void* arg)
+{
+    Worker* worker = (Worker*) arg;
+    WorkerPool* pool = worker->pool;
+    size_t phase = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->shutdown && pool->phase == phase) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->shutdown) break;
+        phase = pool->phase;
+        pthread_mutex_unlock(&pool->lock);
+        pool->job(pool, worker->id);
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->finished == pool->nworkers - 1) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/**
+ * Run `job` on all workers of the pool and wait until all are done.
+ *
+ * @param pool The worker pool.
+ * @param job The job, called with the pool and the index of the worker.
+ */
+static void gc_worker_pool_run(WorkerPool* pool, void (*job)(WorkerPool* pool, size_t id))
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->finished = 0;
+    pool->phase++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    job(pool, 0);
+    pthread_mutex_lock(&pool->lock);
+    while (pool->finished < pool->nworkers - 1) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void gc_worker_pool_delete(WorkerPool* pool);
+
+/**
+ * Create a pool of mark workers and start its helper threads.
+ *
+ * @param gc The garbage collector the pool marks for.
+ * @param nworkers The number of workers, including the collecting thread.
+ * @returns The pool or `NULL` if it could not be set up, in which case
+ *          marking stays serial.
+ */
+static WorkerPool* gc_worker_pool_new(GarbageCollector* gc, size_t nworkers)
+{
+    WorkerPool* pool = (WorkerPool*) calloc(1, sizeof(WorkerPool));
+    if (!pool) return NULL;
+    pool->gc = gc;
+    pool->workers = (Worker*) calloc(nworkers, sizeof(Worker));
+    pool->threads = (pthread_t*) calloc(nworkers, sizeof(pthread_t));
+    if (!pool->workers || !pool->threads) {
+        free(pool->workers);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (size_t i = 0; i < nworkers; ++i) {
+        Worker* worker = &pool->workers[i];
+        worker->stack = gc_mark_stack_new(GC_MARK_STACK_INITIAL_CAPACITY,
+                                          GC_MARK_STACK_MAX_CAPACITY);
+        worker->pool = pool;
+        worker->id = i;
+        pthread_mutex_init(&worker->lock, NULL);
+    }
+    /* Worker 0 is the collecting thread, count only what was started */
+    pool->nworkers = 1;
+    while (pool->nworkers < nworkers) {
+        if (pthread_create(&pool->threads[pool->nworkers], NULL, gc_worker_pool_thread,
+                           &pool->workers[pool->nworkers])) {
+            LOG_WARNING("Failed to start mark worker %zu", pool->nworkers);
+            break;
+        }
+        pool->nworkers++;
+    }
+    /* Release the stacks of workers whose thread did not start */
+    for (size_t i = pool->nworkers; i < nworkers; ++i) {
+        pthread_mutex_destroy(&pool->workers[i].lock);
+        gc_mark_stack_delete(pool->workers[i].stack);
+    }
+    if (pool->nworkers < 2) {
+        gc_worker_pool_delete(pool);
+        return NULL;
+    }
+    LOG_DEBUG("Started %zu mark workers", pool->nworkers);
+    return pool;
+}
+
+static void gc_worker_pool_delete(WorkerPool* pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 1; i < pool->nworkers; ++i) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    for (size_t i = 0; i < pool->nworkers; ++i) {
+        pthread_mutex_destroy(&pool->workers[i].lock);
+        gc_mark_stack_delete(pool->workers[i].stack);
+        free(pool->workers[i].finalizers.items);
+    }
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool->workers);
+    free(pool);
+}
+
+#endif /* !GC_NO_THREADS */
+
+#ifndef GC_NO_THREADS
+
+/*
+ * Signals that suspend and resume mutator threads while the world is
+ * stopped. Override them if the application uses these signals itself.
+ */
+#ifndef GC_SIG_SUSPEND
+#define GC_SIG_SUSPEND SIGUSR1
+#endif
+#ifndef GC_SIG_RESTART
+#define GC_SIG_RESTART SIGUSR2
+#endif
+
+/*
+ * Number of small-object slots a thread cache holds per size class.
+ */
+#ifndef GC_THREAD_CACHE_SIZE
+#define GC_THREAD_CACHE_SIZE 64
+#endif
+
+/**
+ * A thread-local allocation cache.
+ *
+ * Holds free small-object slots that were reserved for one thread in a
+ * batch: their allocation bits are set and they count as allocated. The
+ * owning thread hands them out without taking the collector lock. A
+ * collection marks all cached slots without scanning them, so they survive
+ * until they are handed out or the thread is unregistered.
+ */
+typedef struct ThreadCache {
+    size_t nslots[GC_SIZE_CLASS_COUNT];
+    void* slots[GC_SIZE_CLASS_COUNT][GC_THREAD_CACHE_SIZE];
+} ThreadCache;
+
+/**
+ * A registered mutator thread.
+ */
+typedef struct MutatorThread {
+    pthread_t id;
+    void* bos;          // bottom of the thread's stack
+    void* tos;          // top of the thread's stack while it is suspended
+    ThreadCache* cache; // allocation cache, NULL if caching is disabled
+} MutatorThread;
+
+/**
+ * The mutator threads of a multi-threaded garbage collector.
+ *
+ * All operations on the collector are serialized by a recursive lock, so
+ * that destructors may call back into the collector. While a collection
+ * marks, the world is stopped: every registered thread other than the
+ * collecting one is interrupted by GC_SIG_SUSPEND. The kernel saves the
+ * registers of the interrupted code on the thread's stack, below which the
+ * signal handler records the top of the stack. The handler then waits for
+ * GC_SIG_RESTART.
+ */
+typedef struct ThreadRegistry {
+    pthread_mutex_t lock;
+    MutatorThread* threads;
+    size_t nthreads;
+    size_t capacity;
+    size_t nsuspended;      // threads suspended by the current stop
+    int stopped;            // the world is stopped
+    size_t acks;            // threads that acknowledged a stop or restart
+    size_t nfailed;         // threads the current stop failed to suspend
+    bool unregistered;      // the current stop is on an unregistered thread
+    bool caching;           // threads allocate small objects from caches
+    pthread_key_t cache_key; // the calling thread's cache
+} ThreadRegistry;
+
+/*
+ * The registry whose world is being stopped, as seen by the signal handlers.
+ * Only one collector per process can stop the world at a time.
+ */
+static ThreadRegistry* gc_stopping_registry;
+
+static MutatorThread* gc_thread_self(ThreadRegistry* reg)
+{
+    pthread_t self = pthread_self();
+    for (size_t i = 0; i < reg->nthreads; ++i) {
+        if (pthread_equal(reg->threads[i].id, self)) {
+            return &reg->threads[i];
+        }
+    }
+    return NULL;
+}
+
+static void gc_suspend_handler(int sig)
+{
+    (void) sig;
+    int saved_errno = errno;
+    ThreadRegistry* reg = gc_stopping_registry;
+    MutatorThread* self = reg ? gc_thread_self(reg) : NULL;
+    if (self) {
+        /* The interrupted context lies between this frame and the bottom of
+         * the stack */
+        self->tos = __builtin_frame_address(0);
+        __atomic_add_fetch(&reg->acks, 1, __ATOMIC_RELEASE);
+        sigset_t mask;
+        sigfillset(&mask);
+        sigdelset(&mask, GC_SIG_RESTART);
+        while (__atomic_load_n(&reg->stopped, __ATOMIC_ACQUIRE)) {
+            sigsuspend(&mask);
+        }
+        __atomic_add_fetch(&reg->acks, 1, __ATOMIC_RELEASE);
+    }
+    errno = saved_errno;
+}
+
+static void gc_restart_handler(int sig)
+{
+    (void) sig;
+}
+
+static ThreadRegistry* gc_thread_registry_new(bool caching)
+{
+    ThreadRegistry* reg = (ThreadRegistry*) calloc(1, sizeof(ThreadRegistry));
+    if (!reg) return NULL;
+    if (caching && pthread_key_create(&reg->cache_key, NULL) != 0) {
+        free(reg);
+        return NULL;
+    }
+    reg->caching = caching;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&reg->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    /* The restart signal stays blocked while the suspend handler runs, so
+     * that it cannot arrive before the handler waits for it */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_RESTART;
+    sa.sa_handler = gc_suspend_handler;
+    sigfillset(&sa.sa_mask);
+    sigaction(GC_SIG_SUSPEND, &sa, NULL);
+    sa.sa_handler = gc_restart_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(GC_SIG_RESTART, &sa, NULL);
+    return reg;
+}
+
+static void gc_thread_registry_delete(ThreadRegistry* reg)
+{
+    for (size_t i = 0; i < reg->nthreads; ++i) {
+        free(reg->threads[i].cache);
+    }
+    if (reg->caching) {
+        pthread_key_delete(reg->cache_key);
+    }
+    pthread_mutex_destroy(&reg->lock);
+    free(reg->threads);
+    free(reg);
+}
+
+/**
+ * Add the calling thread to the registry, unless it is registered already.
+ *
+ * @param reg The thread registry.
+ * @param bos The bottom of the calling thread's stack.
+ * @returns `false` if the registry could not grow.
+ */
+static bool gc_thread_registry_add(ThreadRegistry* reg, void* bos)
+{
+    if (gc_thread_self(reg)) {
+        return true;
+    }
+    if (reg->nthreads == reg->capacity) {
+        size_t capacity = reg->capacity ? reg->capacity * 2 : 8;
+        MutatorThread* threads = (MutatorThread*) realloc(reg->threads,
+                                 capacity * sizeof(MutatorThread));
+        if (!threads) {
+            return false;
+        }
+        reg->threads = threads;
+        reg->capacity = capacity;
+    }
+    ThreadCache* cache = NULL;
+    if (reg->caching) {
+        cache = (ThreadCache*) calloc(1, sizeof(ThreadCache));
+        if (!cache || pthread_setspecific(reg->cache_key, cache) != 0) {
+            free(cache);
+            return false;
+        }
+    }
+    MutatorThread* t = &reg->threads[reg->nthreads++];
+    t->id = pthread_self();
+    t->bos = bos;
+    t->tos = NULL;
+    t->cache = cache;
+    return true;
+}
+
+/**
+ * Suspend all registered threads other than the calling one.
+ *
+ * @param reg The thread registry.
+ */
+static void gc_thread_registry_stop(ThreadRegistry* reg)
+{
+    pthread_t self = pthread_self();
+    gc_stopping_registry = reg;
+    reg->acks = 0;
+    reg->nsuspended = 0;
+    reg->nfailed = 0;
+    __atomic_store_n(&reg->stopped, 1, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < reg->nthreads; ++i) {
+        MutatorThread* t = &reg->threads[i];
+        t->tos = NULL;
+        if (pthread_equal(t->id, self)) continue;
+        if (pthread_kill(t->id, GC_SIG_SUSPEND) == 0) {
+            reg->nsuspended++;
+        } else {
+            reg->nfailed++;
+        }
+    }
+    while (__atomic_load_n(&reg->acks, __ATOMIC_ACQUIRE) < reg->nsuspended) {
+        sched_yield();
+    }
+}
+
+/**
+ * Resume the threads suspended by `gc_thread_registry_stop()`.
+ *
+ * Warnings about the stop are only logged once the threads are resumed,
+ * since logging may block on a lock held by a suspended thread.
+ *
+ * @param reg The thread registry.
+ */
+static void gc_thread_registry_start(ThreadRegistry* reg)
+{
+    pthread_t self = pthread_self();
+    reg->acks = 0;
+    __atomic_store_n(&reg->stopped, 0, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < reg->nthreads; ++i) {
+        MutatorThread* t = &reg->threads[i];
+        if (t->tos && !pthread_equal(t->id, self)) {
+            pthread_kill(t->id, GC_SIG_RESTART);
+        }
+    }
+    /* Wait until all threads have left the handler, a later stop must not
+     * count their acknowledgements */
+    while (__atomic_load_n(&reg->acks, __ATOMIC_ACQUIRE) < reg->nsuspended) {
+        sched_yield();
+    }
+    gc_stopping_registry = NULL;
+    if (reg->nfailed) {
+        LOG_WARNING("Failed to suspend %zu registered thread(s)", reg->nfailed);
+    }
+    if (reg->unregistered) {
+        reg->unregistered = false;
+        LOG_WARNING("Collecting on an unregistered thread%s", "");
+    }
+}
+
+#endif /* !GC_NO_THREADS */
+
+static void gc_lock(GarbageCollector* gc)
+{
+#ifndef GC_NO_THREADS
+    if (gc->threads) {
+        pthread_mutex_lock(&gc->threads->lock);
+    }
+#else
+    (void) gc;
+#endif
+}
+
+static void gc_unlock(GarbageCollector* gc)
+{
+#ifndef GC_NO_THREADS
+    if (gc->threads) {
+        pthread_mutex_unlock(&gc->threads->lock);
+    }
+#else
+    (void) gc;
+#endif
+}
+
+#ifndef GC_NO_THREADS
+/**
+ * Fix or release the size of the shared and the workers' mark stacks.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param fixed `true` to keep the stacks from growing.
+ */
+static void gc_mark_stacks_fix(GarbageCollector* gc, bool fixed)
+{
+    gc->marks->fixed = fixed;
+    for (size_t i = 0; gc->pool && i < gc->pool->nworkers; ++i) {
+        gc->pool->workers[i].stack->fixed = fixed;
+    }
+}
+#endif
+
+/**
+ * Stop all registered mutator threads other than the calling one, if the
+ * garbage collector is multi-threaded.
+ *
+ * Until the world is started again, the collector must not allocate or
+ * log, since a suspended thread may hold the lock of the allocator or of
+ * the output stream. Anything that needs memory is prepared before.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ */
+static void gc_stop_world(GarbageCollector* gc)
+{
+#ifndef GC_NO_THREADS
+    if (gc->threads) {
+        gc_mark_stacks_fix(gc, true);
+        gc_thread_registry_stop(gc->threads);
+    }
+#else
+    (void) gc;
+#endif
+}
+
+static void gc_start_world(GarbageCollector* gc)
+{
+#ifndef GC_NO_THREADS
+    if (gc->threads) {
+        gc_thread_registry_start(gc->threads);
+        gc_mark_stacks_fix(gc, false);
+    }
+#else
+    (void) gc;
+#endif
+}
+
+/*
+ * Number of allocation map bitmap words (of 64 slots each) that a lazy
+ * sweep step covers.
+ */
+#define GC_LAZY_SWEEP_WORDS 4
+
+/**
+ * The state of a lazy sweep.
+ *
+ * In lazy sweep mode, a collection only marks. The sweep is carried out in
+ * small steps by subsequent allocations. While it is pending, the marks of
+ * the collection stay in place and new allocations are marked, so entries
+ * that move in the allocation map cannot be mistaken for garbage.
+ */
+typedef struct LazySweep {
+    bool pending;   // a collection has marked but not completely swept
+    size_t word;    // next mark bitmap word of the allocation map
+    size_t dead;    // swept map entries that await compaction
+} LazySweep;
+
+/*
+ * Default number of words an incremental mark step scans per allocation.
+ */
+#define GC_MARK_BUDGET 1024
+
+/**
+ * The state of incremental marking.
+ *
+ * In incremental mode, a collection marks in small steps during subsequent
+ * allocations. Objects allocated while marking are marked right away, and
+ * stores of pointers into marked objects must go through the write barrier.
+ * Memory freed while marking may still be on the mark stack, hence it is
+ * only released once the mark is complete.
+ */
+typedef struct IncrementalMark {
+    bool marking;      // a collection is marking in steps
+    size_t budget;     // words to scan per allocation
+    void** deferred;   // memory freed while marking
+    size_t ndeferred;
+    size_t deferred_capacity;
+    struct BackgroundMarker* background; // concurrent mark thread, NULL if disabled
+} IncrementalMark;
+
+#ifndef GC_NO_THREADS
+/**
+ * The background thread of a concurrent mark.
+ *
+ * The thread scans the mark stack in increments of the mark budget, each
+ * under the collector lock, while the mutators run between increments. A
+ * mutator starts the mark and completes it once the mark stack is empty.
+ */
+typedef struct BackgroundMarker {
+    pthread_t thread;
+    pthread_cond_t wake;  // a mark started (or shutdown)
+    bool shutdown;
+} BackgroundMarker;
+#endif
+
+/*
+ * Default number of young objects that triggers a minor collection, and
+ * default number of minor collections an object survives before it is
+ * promoted.
+ */
+#define GC_NURSERY_SIZE 8192
+#define GC_PROMOTION_AGE 2
+
+/**
+ * A young object and the number of minor collections it has survived.
+ */
+typedef struct NurseryEntry {
+    void* ptr;
+    size_t age;
+} NurseryEntry;
+
+/**
+ * The state of generational collection.
+ *
+ * Objects are not moved between generations. Instead, every new object is
+ * tagged as young and listed in the nursery. A minor collection only marks
+ * young objects, starting from the stack and from the remembered set, i.e.
+ * the old objects that were stored into since they may point to young ones.
+ * It then walks the nursery instead of the whole heap. Entries of both lists
+ * are looked up again before use, since their objects may have been freed.
+ */
+typedef struct Generations {
+    NurseryEntry* young;       // young objects, oldest first
+    size_t nyoung;
+    size_t young_capacity;
+    void** remembered;         // old objects that may point to young ones
+    size_t nremembered;
+    size_t remembered_capacity;
+    size_t nursery_size;       // young objects that trigger a minor collection
+    size_t promotion_age;      // minor collections survived before promotion
+    bool minor;                // a minor collection is marking
+    bool overflow;             // the remembered set is incomplete
+} Generations;
+
+/*
+ * Maximum number of hooks per event type.
+ */
+#define GC_MAX_HOOKS 8
+
+/**
+ * The registered hooks of each event type, see `gc_register_hook()`.
+ */
+typedef struct EventHooks {
+    GarbageCollectorHook hooks[GC_EVENT_COUNT][GC_MAX_HOOKS];
+    void* data[GC_EVENT_COUNT][GC_MAX_HOOKS];
+    size_t count[GC_EVENT_COUNT];
+    bool minor;                // the current collection is a minor one
+} EventHooks;
+
+/*
+ * Default number of live bytes below which the heap growth trigger does
+ * not start a collection, and the least growth of the heap between
+ * collections (as a fraction of the live bytes, 1/8) near the memory limit.
+ */
+#define GC_HEAP_MINIMUM ((size_t) 4 << 20)
+#define GC_HEAP_HEADROOM_SHIFT 3
+
+/**
+ * The state of the byte-based collection trigger.
+ *
+ * A collection starts once the live bytes (which include the garbage
+ * allocated since the last collection) reach the trigger. After every full
+ * collection, the trigger is set to the bytes that survived it plus
+ * `growth` percent of them, or to `minimum`, whichever is larger, so the
+ * collector runs in proportion to the memory that is allocated rather than
+ * to the number of objects. A memory limit lowers the trigger, but never
+ * below the headroom that keeps a heap close to the limit from collecting
+ * on every allocation.
+ */
+typedef struct Pacer {
+    size_t growth;             // percentage of the live bytes, 0 to keep the count trigger
+    size_t minimum;            // live bytes below which growth does not collect
+    size_t limit;              // soft limit of the live bytes, 0 for none
+    size_t trigger;            // live bytes that start the next collection
+} Pacer;
+
+/*
+ * The allocation profiler samples an allocation every `interval` bytes on
+ * average: the distance to the next sample is drawn from an exponential
+ * distribution, so every byte is equally likely to be sampled (and large
+ * allocations more likely than small ones). A sample records the
+ * backtrace of the allocation, which identifies its site, and stays in
+ * the table of sampled objects until a collection finds it unreachable.
+ */
+#define GC_PROFILE_DEPTH 32
+
+typedef struct ProfileSite {
+    void* frames[GC_PROFILE_DEPTH];
+    size_t depth;
+    uint64_t hash;
+    size_t allocated_samples;     // sampled allocations
+    size_t allocated_size;        // their sizes
+    double allocated_bytes;       // estimated bytes allocated
+    size_t live_samples;          // sampled objects that are still live
+    size_t live_size;             // their sizes
+    double live_bytes;            // estimated bytes still live
+} ProfileSite;
+
+typedef struct ProfileSample {
+    void* ptr;                    // NULL if the table slot is empty
+    size_t size;
+    double bytes;                 // estimated bytes the sample stands for
+    size_t site;
+} ProfileSample;
+
+typedef struct Profiler {
+    size_t interval;
+    size_t countdown;             // bytes to allocate until the next sample
+    uint64_t random;              // xorshift state
+    ProfileSite* sites;
+    size_t nsites;
+    size_t sites_capacity;
+    size_t* index;                // hash index of sites + 1, 0 if empty
+    size_t index_capacity;
+    ProfileSample* samples;       // open addressing, keyed by address
+    size_t nsamples;
+    size_t samples_capacity;
+} Profiler;
+
+static void gc_sweep_step(GarbageCollector* gc);
+static size_t gc_run_eager(GarbageCollector* gc);
+static void gc_mark_push(GarbageCollector* gc, Worker* worker, void* ptr);
+static void gc_mark_drain(GarbageCollector* gc);
+static void gc_sweep_lazy_begin(GarbageCollector* gc);
+size_t gc_sweep(GarbageCollector* gc);
+#ifndef GC_NO_THREADS
+static bool gc_background_marker_start(GarbageCollector* gc);
+#endif
+
+static void* gc_mcalloc(size_t count, size_t size)
+{
+    if (!count) return malloc(size);
+    return calloc(count, size);
+}
+
+/*
+ * Small requests without a destructor are served from size-class pages.
+ */
+static bool gc_is_small(GarbageCollector* gc, size_t count, size_t size, void(*dtor)(void*))
+{
+    return gc->small && !dtor && count <= GC_SMALL_MAX && size <= GC_SMALL_MAX &&
+           (count ? count * size : size) <= GC_SMALL_MAX;
+}
+
+static bool gc_is_marking(GarbageCollector* gc)
+{
+    return gc->incremental && gc->incremental->marking;
+}
+
+/*
+ * The live objects and bytes, for the statistics. The garbage found by a
+ * lazy sweep counts until it is swept.
+ */
+static size_t gc_live_objects(GarbageCollector* gc)
+{
+    return gc->allocs->size + (gc->small ? gc->small->count : 0);
+}
+
+static size_t gc_live_bytes(GarbageCollector* gc)
+{
+    return gc->allocs->bytes + (gc->small ? gc->small->bytes : 0);
+}
+
+/**
+ * Set the trigger of the next collection from the live bytes after a full
+ * collection.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ */
+static void gc_pacer_update(GarbageCollector* gc)
+{
+    Pacer* pacer = gc->pacer;
+    if (!pacer) {
+        return;
+    }
+    size_t live = gc_live_bytes(gc);
+    size_t trigger = SIZE_MAX;
+    if (pacer->growth) {
+        double growth = (double) live * pacer->growth / 100.0;
+        trigger = growth < (double) (SIZE_MAX - live) ? live + (size_t) growth : SIZE_MAX;
+        trigger = trigger < pacer->minimum ? pacer->minimum : trigger;
+    }
+    if (pacer->limit && trigger > pacer->limit) {
+        size_t headroom = live + (live >> GC_HEAP_HEADROOM_SHIFT);
+        trigger = pacer->limit > headroom ? pacer->limit : headroom;
+    }
+    pacer->trigger = trigger;
+    LOG_DEBUG("Next collection at %zu live bytes (%zu now)", trigger, live);
+}
+
+static bool gc_needs_sweep(GarbageCollector* gc)
+{
+    Pacer* pacer = gc->pacer;
+    if (pacer && gc_live_bytes(gc) >= pacer->trigger) {
+        return true;
+    }
+    /* The byte trigger replaces the count trigger, a memory limit alone
+     * adds to it */
+    if (pacer && pacer->growth) {
+        return false;
+    }
+    if (gc->small && gc->small->count > gc->small->sweep_limit) {
+        return true;
+    }
+    return gc->allocs->size > gc->allocs->sweep_limit;
+}
+
+static void gc_stats_peak(GarbageCollector* gc, size_t bytes)
+{
+    if (bytes > gc->stats.peak_bytes) {
+        gc->stats.peak_bytes = bytes;
+    }
+}
+
+/**
+ * Call the hooks registered for an event.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param type The event type.
+ * @param ns The duration of the event.
+ * @param old_capacity The map capacity before a resize, 0 for other events.
+ */
+static void gc_event(GarbageCollector* gc, GarbageCollectorEventType type,
+                     uint64_t ns, size_t old_capacity)
+{
+    EventHooks* eh = gc->hooks;
+    if (!eh) {
+        return;
+    }
+    bool minor = eh->minor;
+    if (type == GC_EVENT_SWEEP_END) {
+        eh->minor = false;
+    }
+    if (!eh->count[type]) {
+        return;
+    }
+    AllocationMap* am = gc->allocs;
+    GarbageCollectorEvent event;
+    event.type = type;
+    event.minor = minor;
+    event.time_ns = gc_now_ns();
+    event.duration_ns = ns;
+    event.live_bytes = gc_live_bytes(gc);
+    event.live_objects = gc_live_objects(gc);
+    event.freed_bytes = gc->stats.last_freed_bytes;
+    event.freed_objects = gc->stats.last_freed_objects;
+    event.map_capacity = am->capacity;
+    event.map_old_capacity = old_capacity ? old_capacity : am->capacity;
+    event.map_size = am->size;
+    for (size_t i = 0; i < eh->count[type]; ++i) {
+        eh->hooks[type][i](gc, &event, eh->data[type][i]);
+    }
+}
+
+static void gc_event_map_resized(void* data, size_t old_capacity, uint64_t ns)
+{
+    gc_event((GarbageCollector*) data, GC_EVENT_MAP_RESIZE, ns, old_capacity);
+}
+
+/**
+ * Start the statistics of a new collection.
+ *
+ * The heap is at its largest when a collection starts, so that is where
+ * the peak is taken.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param minor `true` for a minor collection.
+ */
+static void gc_stats_begin(GarbageCollector* gc, bool minor)
+{
+    GarbageCollectorStats* st = &gc->stats;
+    if (minor) {
+        st->minor_collections++;
+    } else {
+        st->collections++;
+    }
+    st->last_mark_ns = 0;
+    st->last_sweep_ns = 0;
+    st->last_freed_bytes = 0;
+    st->last_freed_objects = 0;
+    gc_stats_peak(gc, gc_live_bytes(gc));
+    if (gc->hooks) {
+        gc->hooks->minor = minor;
+        gc_event(gc, GC_EVENT_CYCLE_START, 0, 0);
+    }
+}
+
+static void gc_stats_mark(GarbageCollector* gc, uint64_t start)
+{
+    uint64_t ns = gc_now_ns() - start;
+    gc->stats.mark_ns += ns;
+    gc->stats.last_mark_ns += ns;
+}
+
+/**
+ * Account for a sweep or a step of a lazy sweep.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param start The time the sweep started at.
+ * @param objects The number of live objects before the sweep.
+ * @param bytes The number of live bytes before the sweep.
+ */
+static void gc_stats_sweep(GarbageCollector* gc, uint64_t start, size_t objects, size_t bytes)
+{
+    GarbageCollectorStats* st = &gc->stats;
+    uint64_t ns = gc_now_ns() - start;
+    /* Destructors may allocate while sweeping */
+    size_t live_objects = gc_live_objects(gc);
+    size_t live_bytes = gc_live_bytes(gc);
+    size_t freed_objects = objects > live_objects ? objects - live_objects : 0;
+    size_t freed_bytes = bytes > live_bytes ? bytes - live_bytes : 0;
+    gc_stats_peak(gc, bytes);
+    st->sweep_ns += ns;
+    st->last_sweep_ns += ns;
+    st->freed_objects += freed_objects;
+    st->last_freed_objects += freed_objects;
+    st->freed_bytes += freed_bytes;
+    st->last_freed_bytes += freed_bytes;
+}
+
+/**
+ * Check if `ptr` points to the start of a young object.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param ptr A candidate pointer, not necessarily pointing to managed memory.
+ * @returns `true` if `ptr` is a young object.
+ */
+static bool gc_is_young(GarbageCollector* gc, void* ptr)
+{
+    Allocation* alloc = gc_allocation_map_get(gc->allocs, ptr);
+    if (alloc) {
+        return alloc->tag & GC_TAG_YOUNG;
+    }
+    size_t slot;
+    SmallPage* page = gc->small ? gc_small_heap_find(gc->small, ptr, &slot) : NULL;
+    return page && gc_bit_test(page->young_bits, slot);
+}
+
+/**
+ * Add an old object to the remembered set, unless it is young or already
+ * remembered.
+ *
+ * If the remembered set cannot grow, the next collection is a major one.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param ptr The start of the object.
+ */
+static void gc_remember(GarbageCollector* gc, void* ptr)
+{
+    Generations* gen = gc->gen;
+    Allocation* alloc = gc_allocation_map_get(gc->allocs, ptr);
+    size_t slot;
+    SmallPage* page = NULL;
+    if (alloc) {
+        if (alloc->tag & (GC_TAG_YOUNG | GC_TAG_REMEMBERED)) return;
+    } else {
+        page = gc->small ? gc_small_heap_find(gc->small, ptr, &slot) : NULL;
+        if (!page || gc_bit_test(page->young_bits, slot) ||
+                gc_bit_test(page->remembered_bits, slot)) {
+            return;
+        }
+    }
+    if (gen->nremembered == gen->remembered_capacity) {
+        size_t capacity = gen->remembered_capacity ? gen->remembered_capacity * 2 : 64;
+        void** remembered = (void**) realloc(gen->remembered, capacity * sizeof(void*));
+        if (!remembered) {
+            gen->overflow = true;
+            return;
+        }
+        gen->remembered = remembered;
+        gen->remembered_capacity = capacity;
+    }
+    gen->remembered[gen->nremembered++] = ptr;
+    if (alloc) {
+        alloc->tag |= GC_TAG_REMEMBERED;
+    } else {
+        gc_bit_set(page->remembered_bits, slot);
+    }
+}
+
+/**
+ * Clear the young or the remembered state of an object.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param ptr The start of the object.
+ * @param tag `GC_TAG_YOUNG` or `GC_TAG_REMEMBERED`.
+ */
+static void gc_untag(GarbageCollector* gc, void* ptr, char tag)
+{
+    Allocation* alloc = gc_allocation_map_get(gc->allocs, ptr);
+    if (alloc) {
+        alloc->tag &= ~tag;
+        return;
+    }
+    size_t slot;
+    SmallPage* page = gc->small ? gc_small_heap_find(gc->small, ptr, &slot) : NULL;
+    if (page) {
+        gc_bit_clear(tag == GC_TAG_YOUNG ? page->young_bits : page->remembered_bits, slot);
+    }
+}
+
+/**
+ * Promote a young object to the old generation.
+ *
+ * The object is remembered, since it may still point to young objects.
+ * Its nursery entry, if any, is dropped by the next minor collection.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param ptr The start of the object.
+ */
+static void gc_promote(GarbageCollector* gc, void* ptr)
+{
+    gc_untag(gc, ptr, GC_TAG_YOUNG);
+    gc_remember(gc, ptr);
+}
+
+/**
+ * Add a young object to the nursery, or promote it right away if the
+ * nursery cannot grow.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param ptr The start of the object.
+ * @param age The number of minor collections the object survived.
+ */
+static void gc_nursery_add(GarbageCollector* gc, void* ptr, size_t age)
+{
+    Generations* gen = gc->gen;
+    if (gen->nyoung == gen->young_capacity) {
+        size_t capacity = gen->young_capacity ? gen->young_capacity * 2 : 64;
+        NurseryEntry* young = (NurseryEntry*) realloc(gen->young, capacity * sizeof(NurseryEntry));
+        if (!young) {
+            gc_promote(gc, ptr);
+            return;
+        }
+        gen->young = young;
+        gen->young_capacity = capacity;
+    }
+    gen->young[gen->nyoung].ptr = ptr;
+    gen->young[gen->nyoung].age = age;
+    gen->nyoung++;
+}
+
+/**
+ * Promote all young objects and forget the remembered set, after a major
+ * collection.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ */
+static void gc_generations_reset(GarbageCollector* gc)
+{
+    Generations* gen = gc->gen;
+    for (size_t i = 0; i < gen->nyoung; ++i) {
+        gc_untag(gc, gen->young[i].ptr, GC_TAG_YOUNG);
+    }
+    for (size_t i = 0; i < gen->nremembered; ++i) {
+        gc_untag(gc, gen->remembered[i], GC_TAG_REMEMBERED);
+    }
+    gen->nyoung = 0;
+    gen->nremembered = 0;
+    gen->overflow = false;
+}
+
+/**
+ * Compute the natural logarithm for the sampling distance. The profiler
+ * does without libm.
+ *
+ * @param x A number in (0, 1].
+ * @returns ln(x), precise enough for sampling.
+ */
+static double gc_profile_log(double x)
+{
+    int e = 0;
+    while (x < 0.5) {
+        x *= 2.0;
+        e--;
+    }
+    /* ln(x) = 2 atanh((x - 1) / (x + 1)), with |z| <= 1/3 */
+    double z = (x - 1.0) / (x + 1.0);
+    double z2 = z * z;
+    double atanh = z * (1.0 + z2 * (1.0 / 3 + z2 * (1.0 / 5 + z2 * (1.0 / 7 + z2 * (1.0 / 9)))));
+    return 2.0 * atanh + e * 0.6931471805599453;
+}
+
+/**
+ * The exponential function of `x` <= 0, precise enough for sampling.
+ */
+static double gc_profile_exp(double x)
+{
+    if (x < -700.0) {
+        return 0.0;
+    }
+    /* exp(x) = exp(r) / 2^k with r in (-ln 2, 0] */
+    int k = (int) (-x / 0.6931471805599453);
+    double r = x + k * 0.6931471805599453;
+    double term = 1.0;
+    double sum = 1.0;
+    for (int i = 1; i < 14; ++i) {
+        term *= r / i;
+        sum += term;
+    }
+    while (k-- > 0) {
+        sum *= 0.5;
+    }
+    return sum;
+}
+
+/**
+ * Draw the number of bytes until the next sample, exponentially
+ * distributed with a mean of the sampling interval.
+ */
+static size_t gc_profile_next(Profiler* p)
+{
+    /* xorshift64* */
+    p->random ^= p->random >> 12;
+    p->random ^= p->random << 25;
+    p->random ^= p->random >> 27;
+    uint64_t bits = p->random * 2685821657736338717ull;
+    double u = (double) ((bits >> 11) + 1) / 9007199254740992.0;
+    double next = -gc_profile_log(u) * (double) p->interval;
+    return next < 1.0 ? 1 : next > (double) (SIZE_MAX / 2) ? SIZE_MAX / 2 : (size_t) next;
+}
+
+static Profiler* gc_profiler_new(size_t interval)
+{
+    Profiler* p = (Profiler*) calloc(1, sizeof(Profiler));
+    if (p) {
+        p->interval = interval;
+        p->random = gc_now_ns() | 1;
+        p->countdown = gc_profile_next(p);
+    }
+    return p;
+}
+
+static void gc_profiler_delete(Profiler* p)
+{
+    if (p) {
+        free(p->sites);
+        free(p->index);
+        free(p->samples);
+        free(p);
+    }
+}
+
+static size_t gc_profile_home(void* ptr, size_t capacity)
+{
+    uint64_t h = (uint64_t) ((uintptr_t) ptr >> 3) * GC_FIBONACCI_MULTIPLIER;
+    return (size_t) (h >> 32) & (capacity - 1);
+}
+
+static ProfileSample* gc_profile_find(Profiler* p, void* ptr)
+{
+    if (!p->nsamples) {
+        return NULL;
+    }
+    size_t mask = p->samples_capacity - 1;
+    for (size_t i = gc_profile_home(ptr, p->samples_capacity); p->samples[i].ptr; i = (i + 1) & mask) {
+        if (p->samples[i].ptr == ptr) {
+            return &p->samples[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Rebuild the table of samples with `capacity` slots, a power of two.
+ */
+static bool gc_profile_rehash(Profiler* p, size_t capacity)
+{
+    ProfileSample* old = p->samples;
+    size_t old_capacity = p->samples_capacity;
+    ProfileSample* samples = (ProfileSample*) calloc(capacity, sizeof(ProfileSample));
+    if (!samples) {
+        return false;
+    }
+    for (size_t i = 0; i < old_capacity; ++i) {
+        if (old[i].ptr) {
+            size_t j = gc_profile_home(old[i].ptr, capacity);
+            while (samples[j].ptr) {
+                j = (j + 1) & (capacity - 1);
+            }
+            samples[j] = old[i];
+        }
+    }
+    free(old);
+    p->samples = samples;
+    p->samples_capacity = capacity;
+    return true;
+}
+
+static void gc_profile_insert(Profiler* p, ProfileSample sample)
+{
+    if (2 * (p->nsamples + 1) > p->samples_capacity &&
+            !gc_profile_rehash(p, p->samples_capacity ? 2 * p->samples_capacity : 64)) {
+        return;
+    }
+    size_t i = gc_profile_home(sample.ptr, p->samples_capacity);
+    while (p->samples[i].ptr) {
+        i = (i + 1) & (p->samples_capacity - 1);
+    }
+    p->samples[i] = sample;
+    p->nsamples++;
+    ProfileSite* site = &p->sites[sample.site];
+    site->live_samples++;
+    site->live_size += sample.size;
+    site->live_bytes += sample.bytes;
+}
+
+/**
+ * Remove a sample whose object died, closing the gap by shifting the
+ * entries after it back.
+ */
+static void gc_profile_remove(Profiler* p, ProfileSample* sample)
+{
+    ProfileSite* site = &p->sites[sample->site];
+    site->live_samples--;
+    site->live_size -= sample->size;
+    site->live_bytes -= sample->bytes;
+    size_t mask = p->samples_capacity - 1;
+    size_t hole = (size_t) (sample - p->samples);
+    for (size_t i = (hole + 1) & mask; p->samples[i].ptr; i = (i + 1) & mask) {
+        size_t home = gc_profile_home(p->samples[i].ptr, p->samples_capacity);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            p->samples[hole] = p->samples[i];
+            hole = i;
+        }
+    }
+    p->samples[hole].ptr = NULL;
+    p->nsamples--;
+}
+
+/**
+ * Find the site of a backtrace, adding it if it is new.
+ *
+ * @returns The index of the site, or `SIZE_MAX` if a new site could not be
+ *          added.
+ */
+static size_t gc_profile_site(Profiler* p, void** frames, size_t depth)
+{
+    uint64_t hash = depth;
+    for (size_t i = 0; i < depth; ++i) {
+        hash = (hash ^ (uint64_t) (uintptr_t) frames[i]) * GC_FIBONACCI_MULTIPLIER;
+    }
+    size_t mask = p->index_capacity - 1;
+    for (size_t i = (size_t) (hash >> 32) & mask; p->index_capacity && p->index[i]; i = (i + 1) & mask) {
+        ProfileSite* site = &p->sites[p->index[i] - 1];
+        if (site->hash == hash && site->depth == depth &&
+                memcmp(site->frames, frames, depth * sizeof(void*)) == 0) {
+            return p->index[i] - 1;
+        }
+    }
+    if (p->nsites == p->sites_capacity) {
+        size_t capacity = p->sites_capacity ? 2 * p->sites_capacity : 64;
+        ProfileSite* sites = (ProfileSite*) realloc(p->sites, capacity * sizeof(ProfileSite));
+        size_t* index = (size_t*) calloc(2 * capacity, sizeof(size_t));
+        if (!sites || !index) {
+            if (sites) {
+                p->sites = sites;
+            }
+            free(index);
+            return SIZE_MAX;
+        }
+        p->sites = sites;
+        p->sites_capacity = capacity;
+        free(p->index);
+        p->index = index;
+        p->index_capacity = 2 * capacity;
+        for (size_t s = 0; s < p->nsites; ++s) {
+            size_t i = (size_t) (p->sites[s].hash >> 32) & (p->index_capacity - 1);
+            while (p->index[i]) {
+                i = (i + 1) & (p->index_capacity - 1);
+            }
+            p->index[i] = s + 1;
+        }
+        mask = p->index_capacity - 1;
+    }
+    ProfileSite* site = &p->sites[p->nsites];
+    memset(site, 0, sizeof(ProfileSite));
+    memcpy(site->frames, frames, depth * sizeof(void*));
+    site->depth = depth;
+    site->hash = hash;
+    size_t i = (size_t) (hash >> 32) & mask;
+    while (p->index[i]) {
+        i = (i + 1) & mask;
+    }
+    p->index[i] = ++p->nsites;
+    return p->nsites - 1;
+}
+
+/**
+ * Sample an allocation: record its backtrace and track the object until
+ * it dies.
+ */
+static void gc_profile_sample(GarbageCollector* gc, void* ptr, size_t size)
+{
+    Profiler* p = gc->profile;
+    p->countdown = gc_profile_next(p);
+    void* frames[GC_PROFILE_DEPTH];
+    size_t depth = 0;
+#ifdef GC_HAVE_BACKTRACE
+    depth = (size_t) backtrace(frames, GC_PROFILE_DEPTH);
+#endif
+    size_t index = gc_profile_site(p, frames, depth);
+    if (index == SIZE_MAX) {
+        return;
+    }
+    /* An allocation of `size` bytes is sampled with a probability of
+     * 1 - exp(-size / interval), so a sample stands for this many bytes */
+    double bytes = (double) size / (1.0 - gc_profile_exp(-(double) size / (double) p->interval));
+    ProfileSite* site = &p->sites[index];
+    site->allocated_samples++;
+    site->allocated_size += size;
+    site->allocated_bytes += bytes;
+    ProfileSample* old = gc_profile_find(p, ptr);
+    if (old) {
+        gc_profile_remove(p, old);
+    }
+    ProfileSample sample = { .ptr = ptr, .size = size, .bytes = bytes, .site = index };
+    gc_profile_insert(p, sample);
+}
+
+/**
+ * Count an allocation towards the next sample.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param ptr The new object.
+ * @param size The requested size.
+ */
+static void gc_profile_count(GarbageCollector* gc, void* ptr, size_t size)
+{
+    Profiler* p = gc->profile;
+    if (!p) {
+        return;
+    }
+    if (size >= p->countdown) {
+        gc_profile_sample(gc, ptr, size);
+    } else {
+        p->countdown -= size;
+    }
+}
+
+/**
+ * Stop tracking a sampled object that was freed or moved.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param ptr The old address of the object.
+ * @param moved The new address of the object, `NULL` if it was freed.
+ */
+static void gc_profile_release(GarbageCollector* gc, void* ptr, void* moved)
+{
+    ProfileSample* sample = gc->profile ? gc_profile_find(gc->profile, ptr) : NULL;
+    if (!sample) {
+        return;
+    }
+    ProfileSample copy = *sample;
+    gc_profile_remove(gc->profile, sample);
+    if (moved) {
+        copy.ptr = moved;
+        gc_profile_insert(gc->profile, copy);
+    }
+}
+
+/**
+ * Drop the sampled objects that a mark found unreachable, before they are
+ * swept.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param minor A minor collection only marks young objects.
+ */
+static void gc_profile_marked(GarbageCollector* gc, bool minor)
+{
+    Profiler* p = gc->profile;
+    if (!p || !p->nsamples) {
+        return;
+    }
+    size_t dead = 0;
+    for (size_t i = 0; i < p->samples_capacity; ++i) {
+        ProfileSample* sample = &p->samples[i];
+        if (!sample->ptr) {
+            continue;
+        }
+        bool live;
+        Allocation* alloc = gc_allocation_map_get(gc->allocs, sample->ptr);
+        if (alloc) {
+            live = (minor && !(alloc->tag & GC_TAG_YOUNG)) ||
+                   gc_allocation_map_marked(gc->allocs, alloc);
+        } else {
+            size_t slot;
+            SmallPage* page = gc->small ? gc_small_heap_find(gc->small, sample->ptr, &slot) : NULL;
+            live = page && ((minor && !gc_bit_test(page->young_bits, slot)) ||
+                            gc_bit_test(page->mark_bits, slot));
+        }
+        if (!live) {
+            ProfileSite* site = &p->sites[sample->site];
+            site->live_samples--;
+            site->live_size -= sample->size;
+            site->live_bytes -= sample->bytes;
+            sample->ptr = NULL;
+            dead++;
+        }
+    }
+    /* The removal left holes in the probe sequences */
+    if (dead) {
+        p->nsamples -= dead;
+        gc_profile_rehash(p, p->samples_capacity);
+    }
+}
+
+/**
+ * Add memory from the system allocator to the allocation map.
+ *
+ * While a sweep is running or pending, or an incremental mark is in
+ * progress, the new entry is marked so that the sweep does not take it for
+ * garbage.
+ *
+ * @returns The allocation object or `NULL` if the map could not grow.
+ */
+static Allocation* gc_manage(GarbageCollector* gc, void* ptr, size_t size, void (*dtor)(void*))
+{
+    Allocation* alloc = gc_allocation_map_put(gc->allocs, ptr, size, dtor);
+    if (alloc && ((gc->lazy && gc->lazy->pending) || gc->allocs->sweeping || gc_is_marking(gc))) {
+        gc_allocation_map_mark(gc->allocs, alloc);
+    }
+    if (alloc && gc->gen) {
+        alloc->tag |= GC_TAG_YOUNG;
+        gc_nursery_add(gc, ptr, 0);
+    }
+    return alloc;
+}
+
+/**
+ * Return memory that is no longer managed to the system allocator.
+ *
+ * While an incremental mark is in progress, the memory is kept until the
+ * mark is complete, since it may still be scheduled for scanning. If it
+ * cannot be kept, the mark stack is drained first.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param ptr The memory to release.
+ */
+static void gc_release(GarbageCollector* gc, void* ptr)
+{
+    IncrementalMark* im = gc->incremental;
+    if (!gc_is_marking(gc)) {
+        free(ptr);
+        return;
+    }
+    if (im->ndeferred == im->deferred_capacity) {
+        size_t capacity = im->deferred_capacity ? im->deferred_capacity * 2 : 64;
+        void** deferred = (void**) realloc(im->deferred, capacity * sizeof(void*));
+        if (!deferred) {
+            gc_mark_drain(gc);
+            free(ptr);
+            return;
+        }
+        im->deferred = deferred;
+        im->deferred_capacity = capacity;
+    }
+    im->deferred[im->ndeferred++] = ptr;
+}
+
+/**
+ * Allocate a small object from the calling thread's cache, without taking
+ * the collector lock.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param count The number of elements for calloc-style requests, else 0.
+ * @param size The requested size (of each element).
+ * @param dtor The destructor of the object.
+ * @returns The object or `NULL` if the request must take the locked path.
+ */
+static void* gc_thread_cache_alloc(GarbageCollector* gc, size_t count, size_t size,
+                                   void(*dtor)(void*))
+{
+#ifndef GC_NO_THREADS
+    if (!gc->threads || !gc->threads->caching || !gc_is_small(gc, count, size, dtor)) {
+        return NULL;
+    }
+    ThreadCache* cache = (ThreadCache*) pthread_getspecific(gc->threads->cache_key);
+    unsigned int size_class = gc_size_class(count ? count * size : size);
+    size_t n = cache ? cache->nslots[size_class] : 0;
+    if (!n) {
+        return NULL;
+    }
+    void* ptr = cache->slots[size_class][n - 1];
+    /* A collection that suspends us in between finds the slot in the cache
+     * or in our registers, never in neither */
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    cache->nslots[size_class] = n - 1;
+    if (count) {
+        memset(ptr, 0, gc_size_classes[size_class]);
+    }
+    return ptr;
+#else
+    (void) gc;
+    (void) count;
+    (void) size;
+    (void) dtor;
+    return NULL;
+#endif
+}
+
+/**
+ * Fill the calling thread's cache for a size class with free slots.
+ *
+ * The slots are reserved in one batch under the collector lock. Running
+ * out of pages only leaves the cache short.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param size_class The size class to refill.
+ */
+static void gc_thread_cache_refill(GarbageCollector* gc, unsigned int size_class)
+{
+#ifndef GC_NO_THREADS
+    if (!gc->threads || !gc->threads->caching) {
+        return;
+    }
+    ThreadCache* cache = (ThreadCache*) pthread_getspecific(gc->threads->cache_key);
+    while (cache && cache->nslots[size_class] < GC_THREAD_CACHE_SIZE) {
+        void* ptr = gc_small_heap_alloc(gc->small, gc_size_classes[size_class], false);
+        if (!ptr) break;
+        cache->slots[size_class][cache->nslots[size_class]++] = ptr;
+    }
+#else
+    (void) gc;
+    (void) size_class;
+#endif
+}
+
+#ifndef GC_NO_THREADS
+/**
+ * Return the slots of a thread cache to their pages.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param cache The thread cache to empty.
+ */
+static void gc_thread_cache_release(GarbageCollector* gc, ThreadCache* cache)
+{
+    for (unsigned int c = 0; c < GC_SIZE_CLASS_COUNT; ++c) {
+        for (size_t i = 0; i < cache->nslots[c]; ++i) {
+            size_t slot;
+            SmallPage* page = gc_small_heap_find(gc->small, cache->slots[c][i], &slot);
+            if (page) {
+                gc_small_heap_free(gc->small, page, slot);
+            }
+        }
+        cache->nslots[c] = 0;
+    }
+}
+#endif
+
+static void* gc_allocate(GarbageCollector* gc, size_t count, size_t size, void(*dtor)(void*))
+{
+    /* Allocation logic that generalizes over malloc/calloc. */
+
+    /* Make progress with a pending lazy sweep. Its garbage still counts
+     * towards the high-water mark, hence no collection starts before the
+     * sweep is complete. */
+    bool sweeping = gc->lazy && gc->lazy->pending;
+    if (sweeping && !gc->paused) {
+        gc_sweep_step(gc);
+    }
+    /* Likewise, make progress with an incremental mark */
+    bool marking = gc_is_marking(gc);
+    if (marking && !gc->paused) {
+        gc_step(gc, gc->incremental->budget);
+    }
+    /* Check if we reached the high-water mark and need to clean up */
+    if (!sweeping && !marking && gc_needs_sweep(gc) && !gc->paused) {
+        if (gc->incremental) {
+            gc_step(gc, gc->incremental->budget);
+        } else {
+            gc_run(gc);
+            LOG_DEBUG("Garbage collection cleaned up %zu bytes.", gc->stats.last_freed_bytes);
+        }
+    } else if (gc->gen && gc->gen->nyoung >= gc->gen->nursery_size && !gc->paused) {
+        gc_run_minor(gc);
+        LOG_DEBUG("Minor collection cleaned up %zu bytes.", gc->stats.last_freed_bytes);
+    }
+    if (gc_is_small(gc, count, size, dtor)) {
+        size_t small_size = count ? count * size : size;
+        void* ptr = gc_small_heap_alloc(gc->small, small_size, count > 0);
+        if (!ptr && !gc->paused) {
+            gc_run_eager(gc);
+            ptr = gc_small_heap_alloc(gc->small, small_size, count > 0);
+        }
+        if (ptr && gc->gen) {
+            gc_nursery_add(gc, ptr, 0);
+        }
+        if (ptr) {
+            gc_thread_cache_refill(gc, gc_size_class(small_size));
+            gc_profile_count(gc, ptr, small_size);
+        }
+        return ptr;
+    }
+    /* With cleanup out of the way, attempt to allocate memory */
+    void* ptr = gc_mcalloc(count, size);
+    size_t alloc_size = count ? count * size : size;
+    /* If allocation fails, force an out-of-policy run to free some memory and try again. */
+    if (!ptr && !gc->paused && (errno == EAGAIN || errno == ENOMEM)) {
+        gc_run_eager(gc);
+        ptr = gc_mcalloc(count, size);
+    }
+    /* Start managing the memory we received from the system */
+    if (ptr) {
+        LOG_DEBUG("Allocated %zu bytes at %p", alloc_size, (void*) ptr);
+        Allocation* alloc = gc_manage(gc, ptr, alloc_size, dtor);
+        /* Deal with metadata allocation failure */
+        if (alloc) {
+            LOG_DEBUG("Managing %zu bytes at %p", alloc_size, (void*) alloc->ptr);
+            ptr = alloc->ptr;
+            gc_profile_count(gc, ptr, alloc_size);
+        } else {
+            /* We failed to allocate the metadata, fail cleanly. */
+            free(ptr);
+            ptr = NULL;
+        }
+    }
+    return ptr;
+}
+
+static void gc_make_root(GarbageCollector* gc, void* ptr)
+{
+    Allocation* alloc = gc_allocation_map_get(gc->allocs, ptr);
+    size_t slot;
+    SmallPage* page = !alloc && gc->small ? gc_small_heap_find(gc->small, ptr, &slot) : NULL;
+    if (alloc) {
+        alloc->tag |= GC_TAG_ROOT;
+    } else if (page) {
+        gc_bit_set(page->root_bits, slot);
+    }
+    if (alloc || page) {
+        GC_RECORD_EVENT(gc->record, "R %" PRIxPTR "\n", GC_RECORD_ADDR(ptr));
+    }
+    /* Minor collections do not look for roots on the heap */
+    if (gc->gen && (alloc || page)) {
+        gc_promote(gc, ptr);
+    }
+}
+
+void* gc_malloc(GarbageCollector* gc, size_t size)
+{
+    return gc_malloc_ext(gc, size, NULL);
+}
+
+void* gc_malloc_static(GarbageCollector* gc, size_t size, void(*dtor)(void*))
+{
+    gc_lock(gc);
+    void* ptr = gc_malloc_ext(gc, size, dtor);
+    gc_make_root(gc, ptr);
+    gc_unlock(gc);
+    return ptr;
+}
+
+void* gc_make_static(GarbageCollector* gc, void* ptr)
+{
+    gc_lock(gc);
+    gc_make_root(gc, ptr);
+    /* The new root may only be referenced from the stack, which an
+     * incremental mark does not scan before it ends */
+    if (gc_is_marking(gc)) {
+        gc_mark_push(gc, NULL, ptr);
+    }
+    gc_unlock(gc);
+    return ptr;
+}
+
+void* gc_malloc_ext(GarbageCollector* gc, size_t size, void(*dtor)(void*))
+{
+    void* ptr = gc_thread_cache_alloc(gc, 0, size, dtor);
+    /* Events are recorded under the lock, in the order of the operations */
+    if (!ptr || GC_RECORD_ENABLED) {
+        gc_lock(gc);
+        if (!ptr) {
+            ptr = gc_allocate(gc, 0, size, dtor);
+        }
+        if (ptr) {
+            GC_RECORD_EVENT(gc->record, "m %" PRIxPTR " %zu %" PRIxPTR "\n",
+                            GC_RECORD_ADDR(ptr), size, GC_RECORD_ADDR(dtor));
+        }
+        gc_unlock(gc);
+    }
+    return ptr;
+}
+
+
+void* gc_calloc(GarbageCollector* gc, size_t count, size_t size)
+{
+    return gc_calloc_ext(gc, count, size, NULL);
+}
+
+
+void* gc_calloc_ext(GarbageCollector* gc, size_t count, size_t size,
+                    void(*dtor)(void*))
+{
+    void* ptr = gc_thread_cache_alloc(gc, count, size, dtor);
+    if (!ptr || GC_RECORD_ENABLED) {
+        gc_lock(gc);
+        if (!ptr) {
+            ptr = gc_allocate(gc, count, size, dtor);
+        }
+        if (ptr) {
+            GC_RECORD_EVENT(gc->record, "c %" PRIxPTR " %zu %zu %" PRIxPTR "\n",
+                            GC_RECORD_ADDR(ptr), count, size, GC_RECORD_ADDR(dtor));
+        }
+        gc_unlock(gc);
+    }
+    return ptr;
+}
+
+
+/**
+ * Reallocate a small object.
+ *
+ * The object stays in place if it still fits into its slot. Otherwise it
+ * moves to a new slot or, if it outgrows the size classes, to memory from
+ * the system allocator.
+ */
+static void* gc_realloc_small(GarbageCollector* gc, void* p, size_t size,
+                              SmallPage* page, size_t slot)
+{
+    if (size <= page->slot_size) {
+        return p;
+    }
+    void* q;
+    if (size <= GC_SMALL_MAX) {
+        q = gc_small_heap_alloc(gc->small, size, false);
+        if (q && gc->gen) {
+            gc_nursery_add(gc, q, 0);
+        }
+    } else {
+        q = malloc(size);
+        if (q && !gc_manage(gc, q, size, NULL)) {
+            free(q);
+            q = NULL;
+        }
+    }
+    if (!q) {
+        return NULL;
+    }
+    memcpy(q, p, page->slot_size);
+    bool old = gc->gen && !gc_bit_test(page->young_bits, slot);
+    gc_small_heap_free(gc->small, page, slot);
+    if (old) {
+        gc_promote(gc, q);
+    }
+    gc_write_barrier(gc, q);
+    return q;
+}
+
+static void* gc_reallocate(GarbageCollector* gc, void* p, size_t size)
+{
+    size_t slot;
+    SmallPage* page = gc->small && p ? gc_small_heap_find(gc->small, p, &slot) : NULL;
+    if (page) {
+        return gc_realloc_small(gc, p, size, page, slot);
+    }
+    Allocation* alloc = gc_allocation_map_get(gc->allocs, p);
+    if (p && !alloc) {
+        // the user passed an unknown pointer
+        errno = EINVAL;
+        return NULL;
+    }
+    void* q;
+    if (p && gc_is_marking(gc)) {
+        /* Move, since the old memory may still be scheduled for scanning */
+        q = malloc(size);
+        if (q) {
+            memcpy(q, p, alloc->size < size ? alloc->size : size);
+        }
+    } else {
+        q = realloc(p, size);
+    }
+    if (!q) {
+        // realloc failed but p is still valid
+        return NULL;
+    }
+    if (!p) {
+        // allocation, not reallocation
+        Allocation* alloc = gc_manage(gc, q, size, NULL);
+        return alloc->ptr;
+    }
+    if (p == q) {
+        // successful reallocation w/o copy
+        gc->allocs->bytes += size - alloc->size;
+        alloc->size = size;
+    } else {
+        // successful reallocation w/ copy
+        void (*dtor)(void*) = alloc->dtor;
+        bool old = gc->gen && !(alloc->tag & GC_TAG_YOUNG);
+        gc_allocation_map_remove(gc->allocs, p, true);
+        gc_manage(gc, q, size, dtor);
+        if (old) {
+            gc_promote(gc, q);
+        }
+        if (gc_is_marking(gc)) {
+            gc_release(gc, p);
+            gc_write_barrier(gc, q);
+        }
+    }
+    return q;
 }
 
-
 void* gc_realloc(GarbageCollector* gc, void* p, size_t size)
 {
-    Allocation* alloc = gc_allocation_map_get(gc->allocs, p);
-    if (p && !alloc) {
-        // the user passed an unknown pointer
-        errno = EINVAL;
-        return NULL;
+    gc_lock(gc);
+    void* q = gc_reallocate(gc, p, size);
+    if (q && !p) {
+        gc_profile_count(gc, q, size);
+    } else if (q && q != p) {
+        gc_profile_release(gc, p, q);
+    }
+    if (q) {
+        GC_RECORD_EVENT(gc->record, "r %" PRIxPTR " %" PRIxPTR " %zu\n",
+                        GC_RECORD_ADDR(p), GC_RECORD_ADDR(q), size);
+    }
+    gc_unlock(gc);
+    return q;
+}
+
+static void gc_deallocate(GarbageCollector* gc, void* ptr)
+{
+    gc_profile_release(gc, ptr, NULL);
+    Allocation* alloc = gc_allocation_map_get(gc->allocs, ptr);
+    if (alloc && !(alloc->tag & GC_TAG_DEAD)) {
+        if (alloc->dtor) {
+            alloc->dtor(ptr);
+        }
+        gc_allocation_map_remove(gc->allocs, ptr, true);
+        gc_release(gc, ptr);
+        return;
+    }
+    if (alloc) {
+        /* A sweep frees it, e.g. a destructor frees its own allocation */
+        return;
+    }
+    size_t slot;
+    SmallPage* page = gc->small ? gc_small_heap_find(gc->small, ptr, &slot) : NULL;
+    if (page) {
+        gc_small_heap_free(gc->small, page, slot);
+    } else {
+        LOG_WARNING("Ignoring request to free unknown pointer %p", (void*) ptr);
+    }
+}
+
+void gc_free(GarbageCollector* gc, void* ptr)
+{
+    gc_lock(gc);
+    GC_RECORD_EVENT(gc->record, "f %" PRIxPTR "\n", GC_RECORD_ADDR(ptr));
+    gc_deallocate(gc, ptr);
+    gc_unlock(gc);
+}
+
+void gc_start(GarbageCollector* gc, void* bos)
+{
+    gc_start_ext(gc, bos, 1024, 1024, 0.2, 0.8, 0.5);
+}
+
+void gc_start_ext(GarbageCollector* gc,
+                  void* bos,
+                  size_t initial_capacity,
+                  size_t min_capacity,
+                  double downsize_load_factor,
+                  double upsize_load_factor,
+                  double sweep_factor)
+{
+    GarbageCollectorConfig config;
+    gc_config_default(&config);
+    config.initial_capacity = initial_capacity;
+    config.min_capacity = min_capacity;
+    config.downsize_load_factor = downsize_load_factor;
+    config.upsize_load_factor = upsize_load_factor;
+    config.sweep_factor = sweep_factor;
+    gc_start_config(gc, bos, &config);
+}
+
+void gc_config_default(GarbageCollectorConfig* config)
+{
+    config->initial_capacity = 1024;
+    config->min_capacity = 1024;
+    config->downsize_load_factor = 0.2;
+    config->upsize_load_factor = 0.8;
+    config->sweep_factor = 0.5;
+    config->sizing = GC_SIZING_PRIME;
+    config->size_classes = false;
+    config->interior_pointers = false;
+    config->mark_threads = 1;
+    config->deferred_finalizers = false;
+    config->lazy_sweep = false;
+    config->incremental_marking = false;
+    config->mark_budget = GC_MARK_BUDGET;
+    config->concurrent_marking = false;
+    config->multi_threaded = false;
+    config->thread_caches = false;
+    config->generational = false;
+    config->nursery_size = GC_NURSERY_SIZE;
+    config->promotion_age = GC_PROMOTION_AGE;
+    config->sample_interval = 0;
+    config->heap_growth = 0;
+    config->heap_minimum = GC_HEAP_MINIMUM;
+    config->memory_limit = 0;
+}
+
+void gc_start_config(GarbageCollector* gc, void* bos, const GarbageCollectorConfig* config)
+{
+    double downsize_limit = config->downsize_load_factor > 0.0 ? config->downsize_load_factor : 0.2;
+    double upsize_limit = config->upsize_load_factor > 0.0 ? config->upsize_load_factor : 0.8;
+    double sweep_factor = config->sweep_factor > 0.0 ? config->sweep_factor : 0.5;
+    size_t min_capacity = config->min_capacity;
+    size_t initial_capacity = config->initial_capacity;
+    gc->paused = false;
+    gc->bos = bos;
+    memset(&gc->stats, 0, sizeof(GarbageCollectorStats));
+    gc->hooks = NULL;
+    gc->record = NULL;
+    gc->profile = config->sample_interval ? gc_profiler_new(config->sample_interval) : NULL;
+    gc->pacer = NULL;
+    if (config->heap_growth || config->memory_limit) {
+        gc->pacer = (Pacer*) calloc(1, sizeof(Pacer));
+        gc->pacer->growth = config->heap_growth;
+        gc->pacer->minimum = config->heap_minimum;
+        gc->pacer->limit = config->memory_limit;
+    }
+    gc->marks = gc_mark_stack_new(GC_MARK_STACK_INITIAL_CAPACITY, GC_MARK_STACK_MAX_CAPACITY);
+    initial_capacity = initial_capacity < min_capacity ? min_capacity : initial_capacity;
+    gc->allocs = gc_allocation_map_new(min_capacity, initial_capacity,
+                                       sweep_factor, downsize_limit, upsize_limit,
+                                       config->sizing);
+    gc->small = config->size_classes ? gc_small_heap_new() : NULL;
+    gc->interior = config->interior_pointers ? gc_interior_index_new() : NULL;
+    gc->finalizers = config->deferred_finalizers
+                     ? (FinalizerQueue*) calloc(1, sizeof(FinalizerQueue)) : NULL;
+    gc->lazy = config->lazy_sweep ? (LazySweep*) calloc(1, sizeof(LazySweep)) : NULL;
+    gc->incremental = NULL;
+    bool incremental = config->incremental_marking || config->concurrent_marking;
+    if (incremental && config->interior_pointers) {
+        /* The interior pointer index cannot follow the map between steps */
+        LOG_WARNING("Incremental marking is not supported with interior pointers%s", "");
+    } else if (incremental) {
+        gc->incremental = (IncrementalMark*) calloc(1, sizeof(IncrementalMark));
+        gc->incremental->budget = config->mark_budget ? config->mark_budget : GC_MARK_BUDGET;
+    }
+    gc->gen = NULL;
+    if (config->generational && (gc->interior || gc->incremental || gc->lazy)) {
+        LOG_WARNING("Generational collection is not supported with interior pointers, "
+                    "incremental marking or lazy sweeping%s", "");
+    } else if (config->generational) {
+        gc->gen = (Generations*) calloc(1, sizeof(Generations));
+        gc->gen->nursery_size = config->nursery_size ? config->nursery_size : GC_NURSERY_SIZE;
+        gc->gen->promotion_age = config->promotion_age ? config->promotion_age : GC_PROMOTION_AGE;
+        if (gc->small) {
+            gc->small->allocate_young = true;
+        }
+    }
+    gc->threads = NULL;
+    /* A concurrent mark needs the collector lock */
+    if (config->multi_threaded || (gc->incremental && config->concurrent_marking)) {
+#ifndef GC_NO_THREADS
+        /* Cached slots are handed out without young or black allocation,
+         * and without counting towards the next sample */
+        bool caching = config->thread_caches && gc->small && !gc->gen && !gc->incremental &&
+                       !gc->profile;
+        if (config->thread_caches && !caching) {
+            LOG_WARNING("Thread caches need size classes and are not supported with "
+                        "generational collection, incremental marking or allocation "
+                        "profiling%s", "");
+        }
+        gc->threads = gc_thread_registry_new(caching);
+        if (!gc->threads || !gc_thread_registry_add(gc->threads, bos)) {
+            LOG_CRITICAL("Failed to set up the thread registry%s", "");
+        }
+#else
+        LOG_WARNING("Multi-threaded mutators and concurrent marking need POSIX threads%s", "");
+#endif
+    }
+#ifndef GC_NO_THREADS
+    if (gc->incremental && gc->threads && config->concurrent_marking &&
+            !gc_background_marker_start(gc)) {
+        LOG_WARNING("Failed to start the background mark thread, marking incrementally%s", "");
+    }
+#endif
+    gc->pool = NULL;
+#ifndef GC_NO_THREADS
+    if (config->mark_threads > 1) {
+        gc->pool = gc_worker_pool_new(gc, config->mark_threads);
+    }
+#endif
+    gc_pacer_update(gc);
+    LOG_DEBUG("Created new garbage collector (cap=%ld, siz=%ld).", gc->allocs->capacity,
+              gc->allocs->size);
+}
+
+void gc_register_thread(GarbageCollector* gc, void* bos)
+{
+#ifndef GC_NO_THREADS
+    if (!gc->threads) {
+        LOG_WARNING("Thread registration needs a multi-threaded collector%s", "");
+        return;
+    }
+    gc_lock(gc);
+    if (!gc_thread_registry_add(gc->threads, bos)) {
+        LOG_CRITICAL("Failed to register thread%s", "");
+    }
+    gc_unlock(gc);
+#else
+    (void) gc;
+    (void) bos;
+#endif
+}
+
+void gc_unregister_thread(GarbageCollector* gc)
+{
+#ifndef GC_NO_THREADS
+    if (!gc->threads) {
+        return;
+    }
+    gc_lock(gc);
+    ThreadRegistry* reg = gc->threads;
+    MutatorThread* self = gc_thread_self(reg);
+    if (self) {
+        if (self->cache) {
+            gc_thread_cache_release(gc, self->cache);
+            pthread_setspecific(reg->cache_key, NULL);
+            free(self->cache);
+        }
+        *self = reg->threads[--reg->nthreads];
+    }
+    gc_unlock(gc);
+#else
+    (void) gc;
+#endif
+}
+
+void gc_pause(GarbageCollector* gc)
+{
+    gc->paused = true;
+}
+
+void gc_resume(GarbageCollector* gc)
+{
+    gc->paused = false;
+}
+
+/**
+ * Schedule a memory range for scanning.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param worker The parallel mark worker scanning, `NULL` when marking serially.
+ * @param ptr The start of the memory range.
+ * @param size The size of the memory range in bytes.
+ */
+static void gc_mark_schedule(GarbageCollector* gc, Worker* worker, void* ptr, size_t size)
+{
+#ifndef GC_NO_THREADS
+    if (worker) {
+        gc_mark_worker_push(worker, ptr, size);
+        return;
+    }
+#else
+    (void) worker;
+#endif
+    gc_mark_stack_push(gc->marks, ptr, size);
+}
+
+/**
+ * Mark the allocation pointed to by `ptr`, if any, and schedule its
+ * contents for scanning.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param worker The parallel mark worker scanning, `NULL` when marking serially.
+ * @param ptr A candidate pointer, not necessarily pointing to managed memory.
+ */
+static void gc_mark_push(GarbageCollector* gc, Worker* worker, void* ptr)
+{
+    Allocation* alloc = gc_allocation_map_get(gc->allocs, ptr);
+    if (!alloc && gc->interior) {
+        alloc = gc_interior_index_find(gc->interior, ptr);
+    }
+    /* A minor collection takes all old objects for live */
+    bool minor = gc->gen && gc->gen->minor;
+    /* Mark if alloc exists and is not tagged already, otherwise skip */
+    if (alloc) {
+        if (minor && !(alloc->tag & GC_TAG_YOUNG)) {
+            return;
+        }
+        if (!gc_bit_test_and_set(gc->allocs->mark_bits, alloc - gc->allocs->allocs, worker != NULL)) {
+            TRACE_MARK("Marking allocation (ptr=%p)", ptr);
+            gc_mark_schedule(gc, worker, alloc->ptr, alloc->size);
+        }
+        return;
+    }
+    size_t slot;
+    SmallPage* page = gc->small
+                      ? gc_small_heap_lookup(gc->small, ptr, &slot, gc->interior != NULL)
+                      : NULL;
+    if (page && minor && !gc_bit_test(page->young_bits, slot)) {
+        return;
+    }
+    if (page && !gc_bit_test_and_set(page->mark_bits, slot, worker != NULL)) {
+        TRACE_MARK("Marking small object (ptr=%p)", ptr);
+        gc_mark_schedule(gc, worker, page->base + slot * page->slot_size, page->slot_size);
+    }
+}
+
+/**
+ * Scan a memory range for pointers to managed allocations.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param worker The parallel mark worker scanning, `NULL` when marking serially.
+ * @param ptr The start of the memory range.
+ * @param size The size of the memory range in bytes.
+ */
+static void gc_mark_scan(GarbageCollector* gc, Worker* worker, char* ptr, size_t size)
+{
+    TRACE_MARK("Checking allocation (ptr=%p, size=%lu) contents", (void*) ptr, size);
+    char* end = ptr + size;
+    char* p = (char*) (((uintptr_t) ptr + GC_SCAN_STEP - 1) & ~(uintptr_t) (GC_SCAN_STEP - 1));
+    for (; p + PTRSIZE <= end; p += GC_SCAN_STEP) {
+        TRACE_MARK("Checking allocation (ptr=%p) @%lu with value %p",
+                   (void*) ptr, p - ptr, *(void**)p);
+        gc_mark_push(gc, worker, *(void**)p);
+    }
+}
+
+/**
+ * Scan a memory range for pointers to managed allocations on the calling
+ * thread, pushing new work onto the shared mark stack.
+ *
+ * @see gc_mark_scan()
+ */
+static void gc_mark_range(GarbageCollector* gc, char* ptr, size_t size)
+{
+    gc_mark_scan(gc, NULL, ptr, size);
+}
+
+#ifndef GC_NO_THREADS
+
+/**
+ * Run mark worker `id` until no worker has any ranges left to scan.
+ *
+ * A worker that runs out of work turns idle and tries to steal from its
+ * peers. The phase ends once all workers are idle at the same time, since
+ * only a busy worker can create new work.
+ *
+ * @param pool The mark pool.
+ * @param id The index of the worker.
+ */
+static void gc_mark_pool_work(WorkerPool* pool, size_t id)
+{
+    Worker* self = &pool->workers[id];
+    MarkRange r;
+    for (;;) {
+        while (gc_mark_worker_pop(self, &r)) {
+            gc_mark_scan(pool->gc, self, r.ptr, r.size);
+        }
+        __atomic_sub_fetch(&pool->active, 1, __ATOMIC_ACQ_REL);
+        for (;;) {
+            /* Count as busy while stealing so nobody terminates while
+             * stolen ranges are in transit */
+            __atomic_add_fetch(&pool->active, 1, __ATOMIC_ACQ_REL);
+            if (gc_mark_worker_steal(pool, id)) {
+                break;
+            }
+            if (__atomic_sub_fetch(&pool->active, 1, __ATOMIC_ACQ_REL) == 0) {
+                return;
+            }
+            sched_yield();
+        }
+    }
+}
+
+/**
+ * Process the shared mark stack with all workers of the mark pool.
+ *
+ * The ranges on the shared stack are dealt out to the workers' stacks
+ * before the helper threads are woken up. Worker overflows are reported on
+ * the shared stack.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ */
+static void gc_mark_pool_drain(GarbageCollector* gc)
+{
+    WorkerPool* pool = gc->pool;
+    MarkStack* ms = gc->marks;
+    for (size_t i = 0; ms->size > 0; ++i) {
+        MarkRange r = ms->items[--ms->size];
+        gc_mark_stack_push(pool->workers[i % pool->nworkers].stack, r.ptr, r.size);
+    }
+    pool->active = pool->nworkers;
+    gc_worker_pool_run(pool, gc_mark_pool_work);
+    for (size_t i = 0; i < pool->nworkers; ++i) {
+        if (pool->workers[i].stack->overflow) {
+            pool->workers[i].stack->overflow = false;
+            ms->overflow = true;
+        }
+    }
+}
+
+#endif /* !GC_NO_THREADS */
+
+/**
+ * Rescan all marked allocations after a mark stack overflow.
+ *
+ * Every allocation that was dropped from the mark stack is marked, hence
+ * scanning the contents of all marked allocations again pushes all of their
+ * unmarked children.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ */
+static void gc_mark_rescan(GarbageCollector* gc)
+{
+    TRACE_MARK("Rescanning heap after mark stack overflow%s", "");
+    AllocationMap* am = gc->allocs;
+    for (size_t w = 0; w < GC_MARK_WORDS(am->capacity); ++w) {
+        for (uint64_t marks = am->mark_bits[w]; marks; marks &= marks - 1) {
+            Allocation* chunk = &am->allocs[w * 64 + gc_ctz64(marks)];
+            gc_mark_range(gc, (char*) chunk->ptr, chunk->size);
+        }
+    }
+    SmallHeap* sh = gc->small;
+    for (size_t i = 0; sh && i < sh->npages; ++i) {
+        SmallPage* page = sh->pages[i];
+        for (size_t slot = 0; slot < page->bump; ++slot) {
+            if (gc_bit_test(page->mark_bits, slot)) {
+                gc_mark_range(gc, page->base + slot * page->slot_size, page->slot_size);
+            }
+        }
+    }
+}
+
+/**
+ * Process the mark stack until all reachable allocations are marked.
+ *
+ * With a mark pool, the workers process the stack in parallel, while the
+ * rescan after an overflow always runs on the calling thread.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ */
+static void gc_mark_drain(GarbageCollector* gc)
+{
+    MarkStack* ms = gc->marks;
+    do {
+#ifndef GC_NO_THREADS
+        if (gc->pool && ms->size > 0) {
+            gc_mark_pool_drain(gc);
+        }
+#endif
+        while (ms->size > 0) {
+            MarkRange r = ms->items[--ms->size];
+            gc_mark_range(gc, r.ptr, r.size);
+        }
+        if (ms->overflow) {
+            ms->overflow = false;
+            gc_mark_rescan(gc);
+        }
+    } while (ms->size > 0);
+}
+
+/**
+ * Bring auxiliary lookup structures up to date before marking.
+ *
+ * Must be called before the world is stopped, nothing is allocated once
+ * it is. If other mutators are suspended for the mark, room is reserved
+ * on the mark stacks as well: on the shared stack for every managed
+ * object, on the workers' stacks for their share of them. Otherwise the
+ * stacks grow on demand.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ */
+static void gc_mark_prepare(GarbageCollector* gc)
+{
+    if (gc->marks->fixed) {
+        return;
+    }
+    if (gc->interior) {
+        gc_interior_index_update(gc->interior, gc->allocs);
+    }
+#ifndef GC_NO_THREADS
+    if (gc->threads) {
+        size_t objects = gc_live_objects(gc);
+        gc_mark_stack_reserve(gc->marks, objects);
+        for (size_t i = 0; gc->pool && i < gc->pool->nworkers; ++i) {
+            gc_mark_stack_reserve(gc->pool->workers[i].stack, objects / gc->pool->nworkers + 1);
+        }
+    }
+#endif
+}
+
+void gc_mark_alloc(GarbageCollector* gc, void* ptr)
+{
+    gc_mark_prepare(gc);
+    gc_mark_push(gc, NULL, ptr);
+    gc_mark_drain(gc);
+}
+
+#ifndef GC_NO_THREADS
+/**
+ * Mark the slots in all thread caches.
+ *
+ * The slots are not scanned, their contents are stale. They must be marked
+ * before the stacks are scanned, which may also point to them.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ */
+static void gc_mark_thread_caches(GarbageCollector* gc)
+{
+    ThreadRegistry* reg = gc->threads;
+    for (size_t i = 0; reg->caching && i < reg->nthreads; ++i) {
+        ThreadCache* cache = reg->threads[i].cache;
+        for (unsigned int c = 0; cache && c < GC_SIZE_CLASS_COUNT; ++c) {
+            for (size_t j = 0; j < cache->nslots[c]; ++j) {
+                size_t slot;
+                SmallPage* page = gc_small_heap_find(gc->small, cache->slots[c][j], &slot);
+                if (page) {
+                    gc_bit_set(page->mark_bits, slot);
+                }
+            }
+        }
+    }
+}
+#endif
+
+/**
+ * Mark the objects referenced from the stack and schedule their contents
+ * for scanning, without draining the mark stack.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ */
+static void gc_mark_stack_scan(GarbageCollector* gc)
+{
+    TRACE_MARK("Marking the stack (gc@%p) in increments of %ld", (void*) gc, (long) GC_SCAN_STEP);
+    void *tos = __builtin_frame_address(0);
+    void *bos = gc->bos;
+    gc_mark_prepare(gc);
+#ifndef GC_NO_THREADS
+    if (gc->threads) {
+        /* The stacks of the suspended threads, and our own */
+        ThreadRegistry* reg = gc->threads;
+        gc_mark_thread_caches(gc);
+        for (size_t i = 0; i < reg->nthreads; ++i) {
+            MutatorThread* t = &reg->threads[i];
+            if (t->tos) {
+                gc_mark_range(gc, (char*) t->tos, (char*) t->bos - (char*) t->tos);
+            }
+        }
+        MutatorThread* self = gc_thread_self(reg);
+        if (!self) {
+            reg->unregistered = true;
+        }
+        bos = self ? self->bos : tos;
+    }
+#endif
+    /* The stack grows towards smaller memory addresses, hence we scan tos->bos.
+     * Stop scanning once the distance between tos & bos is too small to hold a valid pointer */
+    gc_mark_range(gc, (char*) tos, (char*) bos - (char*) tos);
+}
+
+void gc_mark_stack(GarbageCollector* gc)
+{
+    gc_mark_stack_scan(gc);
+    gc_mark_drain(gc);
+}
+
+/**
+ * Mark all roots on the heap and schedule their contents for scanning.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ */
+static void gc_mark_push_roots(GarbageCollector* gc)
+{
+    for (size_t i = 0; i < gc->allocs->capacity; ++i) {
+        Allocation* chunk = &gc->allocs->allocs[i];
+        if (chunk->ptr && (chunk->tag & GC_TAG_ROOT)) {
+            TRACE_MARK("Marking root @ %p", chunk->ptr);
+            gc_mark_push(gc, NULL, chunk->ptr);
+        }
+    }
+    SmallHeap* sh = gc->small;
+    for (size_t i = 0; sh && i < sh->npages; ++i) {
+        SmallPage* page = sh->pages[i];
+        for (size_t w = 0; w < (page->bump + 63) / 64; ++w) {
+            for (uint64_t roots = page->root_bits[w]; roots; roots &= roots - 1) {
+                size_t slot = w * 64 + gc_ctz64(roots);
+                gc_mark_push(gc, NULL, page->base + slot * page->slot_size);
+            }
+        }
+    }
+}
+
+void gc_mark_roots(GarbageCollector* gc)
+{
+    TRACE_MARK("Marking roots%s", "");
+    gc_mark_prepare(gc);
+    /* Push all roots first and drain once, so that parallel mark workers
+     * start out with a share of the roots each */
+    gc_mark_push_roots(gc);
+    gc_mark_drain(gc);
+}
+
+void gc_mark(GarbageCollector* gc)
+{
+    /* Note: We only look at the stack and the heap, and ignore BSS. */
+    LOG_DEBUG("Initiating GC mark (gc@%p)", (void*) gc);
+    uint64_t start = gc_now_ns();
+    gc_stats_begin(gc, false);
+    gc_mark_prepare(gc);
+    gc_stop_world(gc);
+    /* Scan the heap for roots */
+    gc_mark_roots(gc);
+    /* Dump registers onto stack and scan the stack */
+    void (*volatile _mark_stack)(GarbageCollector*) = gc_mark_stack;
+    jmp_buf ctx;
+    memset(&ctx, 0, sizeof(jmp_buf));
+    setjmp(ctx);
+    _mark_stack(gc);
+    gc_start_world(gc);
+    gc_stats_mark(gc, start);
+    gc_profile_marked(gc, false);
+    gc_event(gc, GC_EVENT_MARK_END, gc->stats.last_mark_ns, 0);
+}
+
+/**
+ * Start an incremental mark by marking the roots on the heap.
+ *
+ * The stack is only scanned when the mark ends, since it changes with
+ * every step.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ */
+static void gc_mark_begin(GarbageCollector* gc)
+{
+    LOG_DEBUG("Starting incremental GC mark (gc@%p)", (void*) gc);
+    uint64_t start = gc_now_ns();
+    gc_stats_begin(gc, false);
+    gc_mark_push_roots(gc);
+    gc->incremental->marking = true;
+    if (gc->small) {
+        gc->small->allocate_black = true;
+    }
+#ifndef GC_NO_THREADS
+    BackgroundMarker* bg = gc->incremental->background;
+    if (bg) {
+        /* Hand the background thread the stacks as well, the remark only
+         * picks up what changed since */
+        void (*volatile _mark_stack_scan)(GarbageCollector*) = gc_mark_stack_scan;
+        jmp_buf ctx;
+        memset(&ctx, 0, sizeof(jmp_buf));
+        setjmp(ctx);
+        gc_mark_prepare(gc);
+        gc_stop_world(gc);
+        _mark_stack_scan(gc);
+        gc_start_world(gc);
+        pthread_cond_signal(&bg->wake);
+    }
+#endif
+    gc_stats_mark(gc, start);
+}
+
+/**
+ * Scan up to `budget` words of the ranges on the mark stack.
+ *
+ * A range that exceeds the remaining budget is split, and its remainder
+ * stays on the stack for the next step.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param budget The number of words to scan.
+ * @returns `true` if the mark stack is empty.
+ */
+static bool gc_mark_increment(GarbageCollector* gc, size_t budget)
+{
+    MarkStack* ms = gc->marks;
+    size_t bytes = budget < SIZE_MAX / PTRSIZE ? budget * PTRSIZE : SIZE_MAX - PTRSIZE;
+    while (ms->size > 0 && bytes > 0) {
+        MarkRange r = ms->items[--ms->size];
+        size_t offset = (size_t) ((((uintptr_t) r.ptr + GC_SCAN_STEP - 1) & ~(uintptr_t) (GC_SCAN_STEP - 1))
+                                  - (uintptr_t) r.ptr);
+        if (offset + bytes + PTRSIZE < r.size) {
+            /* Scan all words that start before the split, the remainder
+             * starts with the first word after it */
+            char* split = r.ptr + offset + bytes;
+            gc_mark_stack_push(ms, split, r.size - (offset + bytes));
+            r.size = offset + bytes + PTRSIZE - 1;
+        }
+        gc_mark_range(gc, r.ptr, r.size);
+        size_t cost = r.size > PTRSIZE ? r.size : PTRSIZE;
+        bytes = cost < bytes ? bytes - cost : 0;
+    }
+    return ms->size == 0;
+}
+
+/**
+ * Complete an incremental mark and sweep.
+ *
+ * Rescans the stack and completes marking from there, in a single pause.
+ * The memory freed while marking is released before the sweep, which is
+ * lazy in lazy sweep mode.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @returns The number of bytes freed by the sweep.
+ */
+static size_t gc_mark_finish(GarbageCollector* gc)
+{
+    LOG_DEBUG("Completing incremental GC mark (gc@%p)", (void*) gc);
+    IncrementalMark* im = gc->incremental;
+    uint64_t start = gc_now_ns();
+    /* Dump registers onto stack and scan the stack */
+    void (*volatile _mark_stack)(GarbageCollector*) = gc_mark_stack;
+    jmp_buf ctx;
+    memset(&ctx, 0, sizeof(jmp_buf));
+    setjmp(ctx);
+    gc_mark_prepare(gc);
+    gc_stop_world(gc);
+    _mark_stack(gc);
+    gc_start_world(gc);
+    gc_stats_mark(gc, start);
+    gc_profile_marked(gc, false);
+    gc_event(gc, GC_EVENT_MARK_END, gc->stats.last_mark_ns, 0);
+    im->marking = false;
+    if (gc->small) {
+        gc->small->allocate_black = false;
+    }
+    for (size_t i = 0; i < im->ndeferred; ++i) {
+        free(im->deferred[i]);
+    }
+    im->ndeferred = 0;
+    if (gc->lazy) {
+        gc_sweep_lazy_begin(gc);
+        return 0;
+    }
+    return gc_sweep(gc);
+}
+
+static size_t gc_collect_step(GarbageCollector* gc, size_t budget)
+{
+    IncrementalMark* im = gc->incremental;
+    if (!im) {
+        return gc_run(gc);
+    }
+    size_t total = 0;
+    if (!im->marking) {
+        /* Destructors left over from the previous collection run first */
+        gc_run_finalizers(gc);
+        if (gc->lazy && gc->lazy->pending) {
+            total = gc_sweep(gc);
+        }
+        gc_mark_begin(gc);
+    }
+#ifndef GC_NO_THREADS
+    if (im->background) {
+        /* The background thread scans, we only complete its mark. Barriers
+         * may have handed it more work since it went idle. */
+        if (gc->marks->size == 0) {
+            total += gc_mark_finish(gc);
+        } else {
+            pthread_cond_signal(&im->background->wake);
+        }
+        return total;
+    }
+#endif
+    uint64_t start = gc_now_ns();
+    bool done = gc_mark_increment(gc, budget);
+    gc_stats_mark(gc, start);
+    if (done) {
+        total += gc_mark_finish(gc);
+    }
+    return total;
+}
+
+size_t gc_step(GarbageCollector* gc, size_t budget)
+{
+    gc_lock(gc);
+    size_t total = gc_collect_step(gc, budget);
+    gc_unlock(gc);
+    return total;
+}
+
+#ifndef GC_NO_THREADS
+static void* gc_background_mark_thread(void* arg)
+{
+    GarbageCollector* gc = (GarbageCollector*) arg;
+    IncrementalMark* im = gc->incremental;
+    BackgroundMarker* bg = im->background;
+    gc_lock(gc);
+    while (!bg->shutdown) {
+        if (!im->marking || gc->marks->size == 0) {
+            pthread_cond_wait(&bg->wake, &gc->threads->lock);
+            continue;
+        }
+        uint64_t start = gc_now_ns();
+        gc_mark_increment(gc, im->budget);
+        gc_stats_mark(gc, start);
+        /* Let waiting mutators in between increments */
+        gc_unlock(gc);
+        sched_yield();
+        gc_lock(gc);
+    }
+    gc_unlock(gc);
+    return NULL;
+}
+
+/**
+ * Start the background thread of a concurrent mark.
+ *
+ * @param gc A pointer to a garbage collector instance with incremental
+ *           marking and a thread registry.
+ * @returns `false` if the thread could not be started.
+ */
+static bool gc_background_marker_start(GarbageCollector* gc)
+{
+    BackgroundMarker* bg = (BackgroundMarker*) calloc(1, sizeof(BackgroundMarker));
+    if (!bg) return false;
+    pthread_cond_init(&bg->wake, NULL);
+    gc->incremental->background = bg;
+    if (pthread_create(&bg->thread, NULL, gc_background_mark_thread, gc) != 0) {
+        pthread_cond_destroy(&bg->wake);
+        free(bg);
+        gc->incremental->background = NULL;
+        return false;
+    }
+    return true;
+}
+
+static void gc_background_marker_stop(GarbageCollector* gc)
+{
+    BackgroundMarker* bg = gc->incremental->background;
+    gc_lock(gc);
+    bg->shutdown = true;
+    pthread_cond_signal(&bg->wake);
+    gc_unlock(gc);
+    pthread_join(bg->thread, NULL);
+    pthread_cond_destroy(&bg->wake);
+    free(bg);
+    gc->incremental->background = NULL;
+}
+#endif
+
+/**
+ * Record a store into `obj`, see `gc_write_barrier()`.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param obj The start of the object stored into.
+ */
+static void gc_barrier(GarbageCollector* gc, void* obj)
+{
+    if (gc->gen) {
+        gc_remember(gc, obj);
+    }
+    if (!gc_is_marking(gc)) {
+        return;
+    }
+    /* Scan a marked object again, it may have been scanned before the store */
+    AllocationMap* am = gc->allocs;
+    Allocation* alloc = gc_allocation_map_get(am, obj);
+    if (alloc) {
+        if (gc_allocation_map_marked(am, alloc)) {
+            gc_mark_stack_push(gc->marks, alloc->ptr, alloc->size);
+        }
+        return;
+    }
+    size_t slot;
+    SmallPage* page = gc->small ? gc_small_heap_find(gc->small, obj, &slot) : NULL;
+    if (page && gc_bit_test(page->mark_bits, slot)) {
+        gc_mark_stack_push(gc->marks, page->base + slot * page->slot_size, page->slot_size);
+    }
+}
+
+void gc_write_barrier(GarbageCollector* gc, void* obj)
+{
+    /* Both modes are fixed when the collector starts */
+    if (!gc->gen && !gc->incremental) {
+        return;
+    }
+    gc_lock(gc);
+    gc_barrier(gc, obj);
+    gc_unlock(gc);
+}
+
+/**
+ * Free the unreachable entries in a range of mark bitmap words of an
+ * `AllocationMap`.
+ *
+ * The entries stay in the map, tagged as dead, until the map is compacted.
+ * Destructors run inline unless a finalizer queue is given, in which case
+ * allocations with a destructor are queued instead of being freed. An
+ * allocation that cannot be queued survives until the next sweep. Inline
+ * destructors need `am->sweeping` to be set, so that the map neither
+ * resizes nor moves entries back while they run.
+ *
+ * @param am The allocation map.
+ * @param begin The index of the first bitmap word.
+ * @param end One past the index of the last bitmap word.
+ * @param fq The finalizer queue, `NULL` to run destructors inline.
+ * @param dead Incremented by the number of dead entries.
+ * @returns The number of freed (or queued) bytes.
+ */
+static size_t gc_sweep_words(AllocationMap* am, size_t begin, size_t end,
+                             FinalizerQueue* fq, size_t* dead)
+{
+    size_t total = 0;
+    for (size_t w = begin; w < end; ++w) {
+        /* Slots of this word that have not been visited yet. The bitmaps are
+         * read again after every destructor call, which may allocate and
+         * thereby shift entries forward by one slot. */
+        uint64_t pending = ~(uint64_t) 0;
+        uint64_t unmarked;
+        while ((unmarked = am->used_bits[w] & ~am->mark_bits[w] & pending)) {
+            unsigned int bit = gc_ctz64(unmarked);
+            pending = bit < 63 ? ~(uint64_t) 0 << (bit + 1) : 0;
+            Allocation* chunk = &am->allocs[w * 64 + bit];
+            if (chunk->tag & GC_TAG_DEAD) {
+                continue;
+            }
+            TRACE_SWEEP("Found unused allocation %p (%lu bytes @ ptr=%p)", (void*) chunk, chunk->size, (void*) chunk->ptr);
+            if (chunk->dtor && fq) {
+                if (!gc_finalizer_queue_push(fq, chunk)) {
+                    continue;
+                }
+                GC_RECORD_EVENT(am->record, "d %" PRIxPTR "\n", GC_RECORD_ADDR(chunk->ptr));
+                total += chunk->size;
+                (*dead)++;
+                chunk->tag = GC_TAG_DEAD;
+                continue;
+            }
+            GC_RECORD_EVENT(am->record, "d %" PRIxPTR "\n", GC_RECORD_ADDR(chunk->ptr));
+            /* no reference to this chunk, hence delete it. The destructor
+             * may allocate and thereby move the entry, so it is tagged as
+             * dead (which also keeps gc_free() off it) beforehand. */
+            void* ptr = chunk->ptr;
+            void (*dtor)(void*) = chunk->dtor;
+            total += chunk->size;
+            (*dead)++;
+            chunk->tag = GC_TAG_DEAD;
+            if (dtor) {
+                dtor(ptr);
+            }
+            free(ptr);
+        }
+    }
+    return total;
+}
+
+#ifndef GC_NO_THREADS
+
+static void gc_sweep_pool_work(WorkerPool* pool, size_t id)
+{
+    GarbageCollector* gc = pool->gc;
+    Worker* self = &pool->workers[id];
+    size_t n = pool->nworkers;
+    size_t words = GC_MARK_WORDS(gc->allocs->capacity);
+    self->swept_count = 0;
+    self->swept_small = 0;
+    self->swept_small_bytes = 0;
+    self->swept_bytes = gc_sweep_words(gc->allocs, words * id / n, words * (id + 1) / n,
+                                       &self->finalizers, &self->swept_count);
+    if (gc->small) {
+        size_t npages = gc->small->npages;
+        self->swept_small_bytes = gc_small_heap_sweep_pages(gc->small, npages * id / n,
+                                                            npages * (id + 1) / n,
+                                                            &self->swept_small);
+        self->swept_bytes += self->swept_small_bytes;
+    }
+}
+
+/**
+ * Sweep the allocation map and the small-object pages with all workers of
+ * the worker pool, each taking an equal share of bitmap words and pages.
+ *
+ * Requires deferred finalizers, since destructors must not run on the
+ * workers. The queued allocations of all workers are moved to the
+ * finalizer queue of the garbage collector.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param dead Incremented by the number of dead allocation map entries.
+ * @returns The number of freed (or queued) bytes.
+ */
+static size_t gc_sweep_parallel(GarbageCollector* gc, size_t* dead)
+{
+    WorkerPool* pool = gc->pool;
+    gc_worker_pool_run(pool, gc_sweep_pool_work);
+    size_t total = 0;
+    for (size_t i = 0; i < pool->nworkers; ++i) {
+        Worker* worker = &pool->workers[i];
+        total += worker->swept_bytes;
+        *dead += worker->swept_count;
+        if (gc->small) {
+            gc->small->count -= worker->swept_small;
+            gc->small->bytes -= worker->swept_small_bytes;
+        }
+        for (size_t j = 0; j < worker->finalizers.size; ++j) {
+            Allocation* alloc = &worker->finalizers.items[j];
+            if (!gc_finalizer_queue_push(gc->finalizers, alloc)) {
+                alloc->dtor(alloc->ptr);
+                free(alloc->ptr);
+            }
+        }
+        worker->finalizers.size = 0;
+    }
+    return total;
+}
+
+#endif /* !GC_NO_THREADS */
+
+/**
+ * Clear all marks and remove the dead entries from the allocation map at
+ * the end of a sweep.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param dead The number of dead entries in the map.
+ */
+static void gc_sweep_end(GarbageCollector* gc, size_t dead)
+{
+    AllocationMap* am = gc->allocs;
+    am->sweeping = false;
+    /* unmark the survivors and remove the dead from the bookkeeping at once */
+    gc_allocation_map_unmark_all(am);
+    if (dead || am->removed) {
+        gc_allocation_map_compact(am);
+    }
+    gc_allocation_map_resize_to_fit(am);
+}
+
+/**
+ * Start a lazy sweep with the current marks.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ */
+static void gc_sweep_lazy_begin(GarbageCollector* gc)
+{
+    gc->lazy->pending = true;
+    gc->lazy->word = 0;
+    gc->lazy->dead = 0;
+    if (gc->small) {
+        gc_small_heap_sweep_lazy(gc->small);
+    }
+}
+
+/**
+ * Sweep everything a pending lazy sweep has not covered yet and end it.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @returns The number of bytes freed.
+ */
+static size_t gc_sweep_lazy_finish(GarbageCollector* gc)
+{
+    LazySweep* ls = gc->lazy;
+    AllocationMap* am = gc->allocs;
+    /* Destructors may allocate, which must neither collect nor step */
+    bool paused = gc->paused;
+    gc->paused = true;
+    am->sweeping = true;
+    size_t total = gc_sweep_words(am, ls->word, GC_MARK_WORDS(am->capacity),
+                                  gc->finalizers, &ls->dead);
+    gc_sweep_end(gc, ls->dead);
+    if (gc->small) {
+        while (gc_small_heap_sweep_next(gc->small, GC_SIZE_CLASS_COUNT, &total));
+        gc_small_heap_sweep_done(gc->small);
+    }
+    gc->paused = paused;
+    ls->pending = false;
+    return total;
+}
+
+/**
+ * Sweep the next few allocation map bitmap words and small-object pages of
+ * a pending lazy sweep, or end the sweep if nothing is left.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ */
+static void gc_sweep_step(GarbageCollector* gc)
+{
+    LazySweep* ls = gc->lazy;
+    AllocationMap* am = gc->allocs;
+    size_t words = GC_MARK_WORDS(am->capacity);
+    size_t freed = 0;
+    size_t objects = gc_live_objects(gc);
+    size_t bytes = gc_live_bytes(gc);
+    uint64_t start = gc_now_ns();
+    bool swept_page = gc->small && gc_small_heap_sweep_next(gc->small, GC_SIZE_CLASS_COUNT, &freed);
+    if (ls->word < words) {
+        size_t begin = ls->word;
+        ls->word = begin + GC_LAZY_SWEEP_WORDS < words ? begin + GC_LAZY_SWEEP_WORDS : words;
+        /* Destructors may allocate, which must neither collect nor step */
+        bool paused = gc->paused;
+        gc->paused = true;
+        am->sweeping = true;
+        gc_sweep_words(am, begin, ls->word, gc->finalizers, &ls->dead);
+        am->sweeping = false;
+        gc->paused = paused;
+    } else if (!swept_page) {
+        gc_sweep_lazy_finish(gc);
+    }
+    gc_stats_sweep(gc, start, objects, bytes);
+    if (!ls->pending) {
+        gc_pacer_update(gc);
+        gc_event(gc, GC_EVENT_SWEEP_END, gc->stats.last_sweep_ns, 0);
+    }
+}
+
+static size_t gc_sweep_heap(GarbageCollector* gc)
+{
+    TRACE_SWEEP("Initiating GC sweep (gc@%p)", (void*) gc);
+    if (gc->lazy && gc->lazy->pending) {
+        return gc_sweep_lazy_finish(gc);
+    }
+    size_t total = 0;
+    size_t dead = 0;
+    bool small_swept = false;
+    AllocationMap* am = gc->allocs;
+    /* Free unreachable allocations but keep their entries in the map (tagged
+     * as dead) so that the map stays consistent while destructors run.
+     * Destructors may allocate, which must not collect. */
+    bool paused = gc->paused;
+    gc->paused = true;
+    am->sweeping = true;
+#ifndef GC_NO_THREADS
+    if (gc->pool && gc->finalizers) {
+        total = gc_sweep_parallel(gc, &dead);
+        small_swept = true;
+    } else
+#endif
+    {
+        total = gc_sweep_words(am, 0, GC_MARK_WORDS(am->capacity), gc->finalizers, &dead);
+    }
+    gc_sweep_end(gc, dead);
+    /* Destructors of map entries may still free small objects, hence the
+     * small-object pages are swept last */
+    if (gc->small && small_swept) {
+        gc_small_heap_sweep_done(gc->small);
+    } else if (gc->small) {
+        total += gc_small_heap_sweep(gc->small);
+    }
+    gc->paused = paused;
+    /* Everything that survived a full collection is old */
+    if (gc->gen) {
+        gc_generations_reset(gc);
+    }
+    return total;
+}
+
+size_t gc_sweep(GarbageCollector* gc)
+{
+    size_t objects = gc_live_objects(gc);
+    size_t bytes = gc_live_bytes(gc);
+    uint64_t start = gc_now_ns();
+    size_t total = gc_sweep_heap(gc);
+    gc_stats_sweep(gc, start, objects, bytes);
+    gc_pacer_update(gc);
+    gc_event(gc, GC_EVENT_SWEEP_END, gc->stats.last_sweep_ns, 0);
+    return total;
+}
+
+/**
+ * Run the deferred destructors, see `gc_run_finalizers()`.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @returns The number of destructors run.
+ */
+static size_t gc_finalize(GarbageCollector* gc)
+{
+    FinalizerQueue* fq = gc->finalizers;
+    if (!fq || fq->size == 0) {
+        return 0;
+    }
+    LOG_DEBUG("Running %zu deferred destructors", fq->size);
+    /* Detach the queue and do not collect while destructors run, they may
+     * allocate or free managed memory */
+    Allocation* items = fq->items;
+    size_t count = fq->size;
+    fq->items = NULL;
+    fq->size = 0;
+    fq->capacity = 0;
+    bool paused = gc->paused;
+    gc->paused = true;
+    for (size_t i = 0; i < count; ++i) {
+        items[i].dtor(items[i].ptr);
+        free(items[i].ptr);
+    }
+    gc->paused = paused;
+    free(items);
+    return count;
+}
+
+size_t gc_run_finalizers(GarbageCollector* gc)
+{
+    gc_lock(gc);
+    size_t count = gc_finalize(gc);
+    gc_unlock(gc);
+    return count;
+}
+
+/**
+ * Unset the ROOT tag on all roots on the heap.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ */
+void gc_unroot_roots(GarbageCollector* gc)
+{
+    LOG_DEBUG("Unmarking roots%s", "");
+    for (size_t i = 0; i < gc->allocs->capacity; ++i) {
+        Allocation* chunk = &gc->allocs->allocs[i];
+        if (chunk->ptr && (chunk->tag & GC_TAG_ROOT)) {
+            chunk->tag &= ~GC_TAG_ROOT;
+        }
+    }
+    SmallHeap* sh = gc->small;
+    for (size_t i = 0; sh && i < sh->npages; ++i) {
+        memset(sh->pages[i]->root_bits, 0, sizeof(sh->pages[i]->root_bits));
+    }
+}
+
+size_t gc_stop(GarbageCollector* gc)
+{
+#ifndef GC_NO_THREADS
+    if (gc->incremental && gc->incremental->background) {
+        gc_background_marker_stop(gc);
+    }
+#endif
+    /* Complete an incremental mark and a pending lazy sweep */
+    size_t collected = gc_is_marking(gc) ? gc_mark_finish(gc) : 0;
+    if (gc->lazy && gc->lazy->pending) {
+        collected += gc_sweep(gc);
+    }
+    gc_unroot_roots(gc);
+    collected += gc_sweep(gc);
+    gc_run_finalizers(gc);
+    gc_allocation_map_delete(gc->allocs);
+    free(gc->hooks);
+    gc_profiler_delete(gc->profile);
+    free(gc->pacer);
+    if (gc->record) {
+        fflush(gc->record);
+    }
+    gc_mark_stack_delete(gc->marks);
+    if (gc->small) {
+        gc_small_heap_delete(gc->small);
+    }
+    if (gc->interior) {
+        gc_interior_index_delete(gc->interior);
+    }
+    if (gc->finalizers) {
+        free(gc->finalizers->items);
+        free(gc->finalizers);
+    }
+    free(gc->lazy);
+    if (gc->incremental) {
+        free(gc->incremental->deferred);
+        free(gc->incremental);
+    }
+    if (gc->gen) {
+        free(gc->gen->young);
+        free(gc->gen->remembered);
+        free(gc->gen);
+    }
+#ifndef GC_NO_THREADS
+    if (gc->threads) {
+        gc_thread_registry_delete(gc->threads);
+    }
+    if (gc->pool) {
+        gc_worker_pool_delete(gc->pool);
+    }
+#endif
+    return collected;
+}
+
+/**
+ * Run a collection in lazy sweep mode: complete the sweep of the previous
+ * collection, then only mark.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @returns The number of bytes freed by completing the previous sweep.
+ */
+static size_t gc_run_lazy(GarbageCollector* gc)
+{
+    size_t total = gc->lazy->pending ? gc_sweep(gc) : 0;
+    gc_mark(gc);
+    gc_sweep_lazy_begin(gc);
+    return total;
+}
+
+static size_t gc_collect(GarbageCollector* gc)
+{
+    LOG_DEBUG("Initiating GC run (gc@%p)", (void*) gc);
+    /* Destructors left over from the previous collection run first */
+    gc_run_finalizers(gc);
+    if (gc_is_marking(gc)) {
+        return gc_mark_finish(gc);
+    }
+    if (gc->lazy) {
+        return gc_run_lazy(gc);
+    }
+    gc_mark(gc);
+    return gc_sweep(gc);
+}
+
+size_t gc_run(GarbageCollector* gc)
+{
+    gc_lock(gc);
+    size_t total = gc_collect(gc);
+    gc_unlock(gc);
+    return total;
+}
+
+/**
+ * Free the unmarked young objects and age the marked ones, promoting those
+ * that reach the promotion age.
+ *
+ * The nursery is detached first, since destructors may allocate.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @returns The number of bytes freed (or queued for finalization).
+ */
+static size_t gc_nursery_sweep(GarbageCollector* gc)
+{
+    Generations* gen = gc->gen;
+    AllocationMap* am = gc->allocs;
+    NurseryEntry* young = gen->young;
+    size_t nyoung = gen->nyoung;
+    gen->young = NULL;
+    gen->nyoung = 0;
+    gen->young_capacity = 0;
+    bool paused = gc->paused;
+    gc->paused = true;
+    size_t total = 0;
+    for (size_t i = 0; i < nyoung; ++i) {
+        void* ptr = young[i].ptr;
+        Allocation* alloc = gc_allocation_map_get(am, ptr);
+        if (alloc) {
+            if (!(alloc->tag & GC_TAG_YOUNG)) {
+                continue;
+            }
+            if (!gc_allocation_map_marked(am, alloc)) {
+                size_t size = alloc->size;
+                if (alloc->dtor && gc->finalizers) {
+                    if (!gc_finalizer_queue_push(gc->finalizers, alloc)) {
+                        gc_nursery_add(gc, ptr, young[i].age);
+                        continue;
+                    }
+                    gc_allocation_map_remove(am, ptr, true);
+                } else {
+                    gc_deallocate(gc, ptr);
+                }
+                GC_RECORD_EVENT(gc->record, "d %" PRIxPTR "\n", GC_RECORD_ADDR(ptr));
+                total += size;
+                continue;
+            }
+            gc_bit_clear(am->mark_bits, alloc - am->allocs);
+        } else {
+            size_t slot;
+            SmallPage* page = gc->small ? gc_small_heap_find(gc->small, ptr, &slot) : NULL;
+            if (!page || !gc_bit_test(page->young_bits, slot)) {
+                continue;
+            }
+            if (!gc_bit_test(page->mark_bits, slot)) {
+                GC_RECORD_EVENT(gc->record, "d %" PRIxPTR "\n", GC_RECORD_ADDR(ptr));
+                total += page->slot_size;
+                gc_small_heap_free(gc->small, page, slot);
+                continue;
+            }
+            gc_bit_clear(page->mark_bits, slot);
+        }
+        if (young[i].age + 1 >= gen->promotion_age) {
+            gc_promote(gc, ptr);
+        } else {
+            gc_nursery_add(gc, ptr, young[i].age + 1);
+        }
     }
-    void* q = realloc(p, size);
-    if (!q) {
-        // realloc failed but p is still valid
-        return NULL;
+    free(young);
+    gc->paused = paused;
+    return total;
+}
+
+/**
+ * Drop the objects from the remembered set that no longer point to young
+ * objects, after a minor collection.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ */
+static void gc_remembered_refresh(GarbageCollector* gc)
+{
+    Generations* gen = gc->gen;
+    for (size_t i = 0; i < gen->nremembered; ++i) {
+        gc_untag(gc, gen->remembered[i], GC_TAG_REMEMBERED);
     }
-    if (!p) {
-        // allocation, not reallocation
-        Allocation* alloc = gc_allocation_map_put(gc->allocs, q, size, NULL);
-        return alloc->ptr;
+    void** remembered = gen->remembered;
+    size_t nremembered = gen->nremembered;
+    gen->nremembered = 0;
+    for (size_t i = 0; i < nremembered; ++i) {
+        char* ptr = (char*) remembered[i];
+        size_t size = 0;
+        Allocation* alloc = gc_allocation_map_get(gc->allocs, ptr);
+        size_t slot;
+        SmallPage* page = !alloc && gc->small ? gc_small_heap_find(gc->small, ptr, &slot) : NULL;
+        if (alloc && !(alloc->tag & (GC_TAG_YOUNG | GC_TAG_REMEMBERED))) {
+            size = alloc->size;
+        } else if (page && !gc_bit_test(page->young_bits, slot) &&
+                   !gc_bit_test(page->remembered_bits, slot)) {
+            size = page->slot_size;
+        }
+        char* p = (char*) (((uintptr_t) ptr + GC_SCAN_STEP - 1) & ~(uintptr_t) (GC_SCAN_STEP - 1));
+        for (; p + PTRSIZE <= ptr + size; p += GC_SCAN_STEP) {
+            if (gc_is_young(gc, *(void**) p)) {
+                /* Entries are kept in place, the array cannot grow here */
+                gc_remember(gc, ptr);
+                break;
+            }
+        }
     }
-    if (p == q) {
-        // successful reallocation w/o copy
-        alloc->size = size;
-    } else {
-        // successful reallocation w/ copy
-        void (*dtor)(void*) = alloc->dtor;
-        gc_allocation_map_remove(gc->allocs, p, true);
-        gc_allocation_map_put(gc->allocs, q, size, dtor);
+}
+
+static size_t gc_collect_minor(GarbageCollector* gc)
+{
+    Generations* gen = gc->gen;
+    if (!gen || gen->overflow) {
+        return gc_run(gc);
     }
-    return q;
+    LOG_DEBUG("Initiating minor GC run (gc@%p)", (void*) gc);
+    gc_run_finalizers(gc);
+    uint64_t start = gc_now_ns();
+    gc_stats_begin(gc, true);
+    gc_mark_prepare(gc);
+    gc_stop_world(gc);
+    gen->minor = true;
+    /* Remembered objects may hold the only references to young ones */
+    for (size_t i = 0; i < gen->nremembered; ++i) {
+        void* ptr = gen->remembered[i];
+        Allocation* alloc = gc_allocation_map_get(gc->allocs, ptr);
+        size_t slot;
+        SmallPage* page = !alloc && gc->small ? gc_small_heap_find(gc->small, ptr, &slot) : NULL;
+        if (alloc) {
+            gc_mark_range(gc, (char*) alloc->ptr, alloc->size);
+        } else if (page) {
+            gc_mark_range(gc, page->base + slot * page->slot_size, page->slot_size);
+        }
+    }
+    /* Dump registers onto stack and scan the stack */
+    void (*volatile _mark_stack)(GarbageCollector*) = gc_mark_stack;
+    jmp_buf ctx;
+    memset(&ctx, 0, sizeof(jmp_buf));
+    setjmp(ctx);
+    _mark_stack(gc);
+    gen->minor = false;
+    gc_start_world(gc);
+    gc_stats_mark(gc, start);
+    gc_profile_marked(gc, true);
+    gc_event(gc, GC_EVENT_MARK_END, gc->stats.last_mark_ns, 0);
+    size_t objects = gc_live_objects(gc);
+    size_t bytes = gc_live_bytes(gc);
+    start = gc_now_ns();
+    size_t total = gc_nursery_sweep(gc);
+    gc_stats_sweep(gc, start, objects, bytes);
+    gc_remembered_refresh(gc);
+    gc_event(gc, GC_EVENT_SWEEP_END, gc->stats.last_sweep_ns, 0);
+    return total;
 }
 
-void gc_free(GarbageCollector* gc, void* ptr)
+size_t gc_run_minor(GarbageCollector* gc)
 {
-    Allocation* alloc = gc_allocation_map_get(gc->allocs, ptr);
-    if (alloc) {
-        if (alloc->dtor) {
-            alloc->dtor(ptr);
+    gc_lock(gc);
+    size_t total = gc_collect_minor(gc);
+    gc_unlock(gc);
+    return total;
+}
+
+void gc_stats(GarbageCollector* gc, GarbageCollectorStats* stats)
+{
+    gc_lock(gc);
+    AllocationMap* am = gc->allocs;
+    gc_stats_peak(gc, gc_live_bytes(gc));
+    *stats = gc->stats;
+    stats->live_objects = gc_live_objects(gc);
+    stats->live_bytes = gc_live_bytes(gc);
+    stats->map_capacity = am->capacity;
+    stats->map_size = am->size;
+    stats->map_load_factor = gc_allocation_map_load_factor(am);
+    stats->map_max_probe = am->size ? (size_t) am->max_dist + 1 : 0;
+    stats->next_trigger_bytes = gc->pacer ? gc->pacer->trigger : 0;
+    gc_unlock(gc);
+}
+
+bool gc_register_hook(GarbageCollector* gc, GarbageCollectorEventType type,
+                      GarbageCollectorHook hook, void* data)
+{
+    if ((unsigned) type >= GC_EVENT_COUNT || !hook) {
+        return false;
+    }
+    gc_lock(gc);
+    if (!gc->hooks) {
+        gc->hooks = (EventHooks*) calloc(1, sizeof(EventHooks));
+    }
+    EventHooks* eh = gc->hooks;
+    bool registered = eh && eh->count[type] < GC_MAX_HOOKS;
+    if (registered) {
+        eh->hooks[type][eh->count[type]] = hook;
+        eh->data[type][eh->count[type]] = data;
+        eh->count[type]++;
+        if (type == GC_EVENT_MAP_RESIZE) {
+            gc->allocs->resized = gc_event_map_resized;
+            gc->allocs->resized_data = gc;
         }
-        free(ptr);
-        gc_allocation_map_remove(gc->allocs, ptr, true);
-    } else {
-        LOG_WARNING("Ignoring request to free unknown pointer %p", (void*) ptr);
     }
+    gc_unlock(gc);
+    return registered;
 }
 
-void gc_start(GarbageCollector* gc, void* bos)
+bool gc_unregister_hook(GarbageCollector* gc, GarbageCollectorEventType type,
+                        GarbageCollectorHook hook, void* data)
 {
-    gc_start_ext(gc, bos, 1024, 1024, 0.2, 0.8, 0.5);
+    if ((unsigned) type >= GC_EVENT_COUNT) {
+        return false;
+    }
+    gc_lock(gc);
+    EventHooks* eh = gc->hooks;
+    bool found = false;
+    for (size_t i = 0; eh && i < eh->count[type] && !found; ++i) {
+        if (eh->hooks[type][i] == hook && eh->data[type][i] == data) {
+            /* Keep the registration order of the others */
+            memmove(&eh->hooks[type][i], &eh->hooks[type][i + 1],
+                    (eh->count[type] - i - 1) * sizeof(GarbageCollectorHook));
+            memmove(&eh->data[type][i], &eh->data[type][i + 1],
+                    (eh->count[type] - i - 1) * sizeof(void*));
+            eh->count[type]--;
+            found = true;
+        }
+    }
+    if (found && type == GC_EVENT_MAP_RESIZE && !eh->count[type]) {
+        gc->allocs->resized = NULL;
+        gc->allocs->resized_data = NULL;
+    }
+    gc_unlock(gc);
+    return found;
 }
 
-void gc_start_ext(GarbageCollector* gc,
-                  void* bos,
-                  size_t initial_capacity,
-                  size_t min_capacity,
-                  double downsize_load_factor,
-                  double upsize_load_factor,
-                  double sweep_factor)
+/**
+ * Start (or stop) recording a trace of the heap operations.
+ *
+ * Every allocation, reallocation, free, new root and `GC_STORE()` is written
+ * to `out` as a line of text, as is the death of every object found by a
+ * sweep, see the README for the format. `bench/bench_replay` replays such a
+ * trace. Only builds with GC_RECORD can record, the recording code is
+ * compiled out otherwise.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param out The stream to write to, `NULL` to stop recording.
+ * @returns `false` if the collector was built without GC_RECORD.
+ */
+bool gc_record(GarbageCollector* gc, FILE* out)
 {
-    double downsize_limit = downsize_load_factor > 0.0 ? downsize_load_factor : 0.2;
-    double upsize_limit = upsize_load_factor > 0.0 ? upsize_load_factor : 0.8;
-    sweep_factor = sweep_factor > 0.0 ? sweep_factor : 0.5;
-    gc->paused = false;
-    gc->bos = bos;
-    initial_capacity = initial_capacity < min_capacity ? min_capacity : initial_capacity;
-    gc->allocs = gc_allocation_map_new(min_capacity, initial_capacity,
-                                       sweep_factor, downsize_limit, upsize_limit);
-    LOG_DEBUG("Created new garbage collector (cap=%ld, siz=%ld).", gc->allocs->capacity,
-              gc->allocs->size);
+#ifdef GC_RECORD
+    gc_lock(gc);
+    if (gc->record) {
+        fflush(gc->record);
+    }
+    gc->record = out;
+    gc->allocs->record = out;
+    if (gc->small) {
+        gc->small->record = out;
+    }
+    if (out) {
+        fprintf(out, "# gc trace 1\n");
+    }
+    gc_unlock(gc);
+    return true;
+#else
+    (void) gc;
+    if (out) {
+        LOG_WARNING("Recording needs a build with GC_RECORD%s", "");
+    }
+    return false;
+#endif
 }
 
-void gc_pause(GarbageCollector* gc)
+/**
+ * Record a pointer store into a managed object, then apply the write
+ * barrier. `GC_STORE()` calls this in builds with GC_RECORD.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param obj The object that was written to.
+ * @param slot The address of the pointer field inside `obj`.
+ */
+void gc_record_store(GarbageCollector* gc, void* obj, void* slot)
 {
-    gc->paused = true;
+    gc_lock(gc);
+    GC_RECORD_EVENT(gc->record, "s %" PRIxPTR " %zu %" PRIxPTR "\n", GC_RECORD_ADDR(obj),
+                    (size_t) ((char*) slot - (char*) obj), GC_RECORD_ADDR(*(void**) slot));
+    gc_unlock(gc);
+    (void) slot;
+    gc_write_barrier(gc, obj);
 }
 
-void gc_resume(GarbageCollector* gc)
+static void gc_dump_varint(FILE* out, uint64_t value)
 {
-    gc->paused = false;
+    while (value >= 0x80) {
+        putc((int) (value & 0x7f) | 0x80, out);
+        value >>= 7;
+    }
+    putc((int) value, out);
 }
 
-void gc_mark_alloc(GarbageCollector* gc, void* ptr)
+/**
+ * Find the object a candidate pointer refers to, the same way
+ * `gc_mark_push()` does, but without marking it.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param ptr A candidate pointer, not necessarily pointing to managed memory.
+ * @returns The start of the object or `NULL`.
+ */
+static void* gc_dump_target(GarbageCollector* gc, void* ptr)
 {
     Allocation* alloc = gc_allocation_map_get(gc->allocs, ptr);
-    /* Mark if alloc exists and is not tagged already, otherwise skip */
-    if (alloc && !(alloc->tag & GC_TAG_MARK)) {
-        LOG_DEBUG("Marking allocation (ptr=%p)", ptr);
-        alloc->tag |= GC_TAG_MARK;
-        /* Iterate over allocation contents and mark them as well */
-        LOG_DEBUG("Checking allocation (ptr=%p, size=%lu) contents", ptr, alloc->size);
-        for (char* p = (char*) alloc->ptr;
-                p <= (char*) alloc->ptr + alloc->size - PTRSIZE;
-                ++p) {
-            LOG_DEBUG("Checking allocation (ptr=%p) @%lu with value %p",
-                      ptr, p-((char*) alloc->ptr), *(void**)p);
-            gc_mark_alloc(gc, *(void**)p);
+    if (!alloc && gc->interior) {
+        alloc = gc_interior_index_find(gc->interior, ptr);
+    }
+    if (alloc) {
+        return alloc->tag & GC_TAG_DEAD ? NULL : alloc->ptr;
+    }
+    size_t slot;
+    SmallPage* page = gc->small
+                      ? gc_small_heap_lookup(gc->small, ptr, &slot, gc->interior != NULL)
+                      : NULL;
+    return page ? page->base + slot * page->slot_size : NULL;
+}
+
+/**
+ * Write the addresses of the objects referenced from a memory range, found
+ * by the same conservative scan as `gc_mark_scan()`.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param out The stream to write to.
+ * @param ptr The start of the memory range.
+ * @param size The size of the memory range in bytes.
+ */
+static void gc_dump_edges(GarbageCollector* gc, FILE* out, char* ptr, size_t size)
+{
+    char* end = ptr + size;
+    char* p = (char*) (((uintptr_t) ptr + GC_SCAN_STEP - 1) & ~(uintptr_t) (GC_SCAN_STEP - 1));
+    for (; p + PTRSIZE <= end; p += GC_SCAN_STEP) {
+        void* target = gc_dump_target(gc, *(void**) p);
+        if (target) {
+            gc_dump_varint(out, (uintptr_t) target);
         }
     }
 }
 
-void gc_mark_stack(GarbageCollector* gc)
+/*
+ * Initial number of references from the stacks that a heap snapshot makes
+ * room for. More room is made, and the stacks are captured again, if the
+ * references do not fit.
+ */
+#define GC_DUMP_ROOTS_CAPACITY 256
+
+/**
+ * The objects referenced from the stacks, captured while the world is
+ * stopped. `size` counts all references found, including those beyond
+ * `capacity`, which were dropped.
+ */
+typedef struct DumpRoots {
+    size_t capacity;
+    size_t size;
+    uintptr_t* items;
+} DumpRoots;
+
+/**
+ * Capture the objects referenced from a memory range, found by the same
+ * conservative scan as `gc_mark_scan()`.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param roots The captured references.
+ * @param ptr The start of the memory range.
+ * @param size The size of the memory range in bytes.
+ */
+static void gc_dump_roots_range(GarbageCollector* gc, DumpRoots* roots, char* ptr, size_t size)
+{
+    char* end = ptr + size;
+    char* p = (char*) (((uintptr_t) ptr + GC_SCAN_STEP - 1) & ~(uintptr_t) (GC_SCAN_STEP - 1));
+    for (; p + PTRSIZE <= end; p += GC_SCAN_STEP) {
+        void* target = gc_dump_target(gc, *(void**) p);
+        if (target) {
+            if (roots->size < roots->capacity) {
+                roots->items[roots->size] = (uintptr_t) target;
+            }
+            roots->size++;
+        }
+    }
+}
+
+/**
+ * Capture the objects referenced from the stacks (and the registers, which
+ * the caller dumped onto the stack) of all mutators. Called while the world
+ * is stopped, hence it neither allocates nor writes.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param roots The captured references, replaced by those found.
+ */
+static void gc_dump_roots_capture(GarbageCollector* gc, DumpRoots* roots)
 {
-    LOG_DEBUG("Marking the stack (gc@%p) in increments of %ld", (void*) gc, sizeof(char));
     void *tos = __builtin_frame_address(0);
     void *bos = gc->bos;
-    /* The stack grows towards smaller memory addresses, hence we scan tos->bos.
-     * Stop scanning once the distance between tos & bos is too small to hold a valid pointer */
-    for (char* p = (char*) tos; p <= (char*) bos - PTRSIZE; ++p) {
-        gc_mark_alloc(gc, *(void**)p);
+    roots->size = 0;
+#ifndef GC_NO_THREADS
+    if (gc->threads) {
+        ThreadRegistry* reg = gc->threads;
+        for (size_t i = 0; i < reg->nthreads; ++i) {
+            MutatorThread* t = &reg->threads[i];
+            if (t->tos) {
+                gc_dump_roots_range(gc, roots, (char*) t->tos, (char*) t->bos - (char*) t->tos);
+            }
+        }
+        MutatorThread* self = gc_thread_self(reg);
+        bos = self ? self->bos : tos;
     }
+#endif
+    gc_dump_roots_range(gc, roots, (char*) tos, (char*) bos - (char*) tos);
 }
 
-void gc_mark_roots(GarbageCollector* gc)
+#ifndef GC_NO_THREADS
+/**
+ * Capture the free slots in the thread caches, which are allocated in their
+ * pages but not objects. Called while the world is stopped.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param cached Room for the slots of all thread caches.
+ * @returns The number of slots captured.
+ */
+static size_t gc_dump_cached_capture(GarbageCollector* gc, uintptr_t* cached)
 {
-    LOG_DEBUG("Marking roots%s", "");
-    for (size_t i = 0; i < gc->allocs->capacity; ++i) {
-        Allocation* chunk = gc->allocs->allocs[i];
-        while (chunk) {
-            if (chunk->tag & GC_TAG_ROOT) {
-                LOG_DEBUG("Marking root @ %p", chunk->ptr);
-                gc_mark_alloc(gc, chunk->ptr);
+    ThreadRegistry* reg = gc->threads;
+    size_t n = 0;
+    for (size_t i = 0; reg && reg->caching && i < reg->nthreads; ++i) {
+        ThreadCache* cache = reg->threads[i].cache;
+        for (unsigned int c = 0; cache && c < GC_SIZE_CLASS_COUNT; ++c) {
+            for (size_t j = 0; j < cache->nslots[c]; ++j) {
+                cached[n++] = (uintptr_t) cache->slots[c][j];
             }
-            chunk = chunk->next;
         }
     }
+    return n;
 }
+#endif
 
-void gc_mark(GarbageCollector* gc)
+static int gc_dump_compare_addr(const void* a, const void* b)
 {
-    /* Note: We only look at the stack and the heap, and ignore BSS. */
-    LOG_DEBUG("Initiating GC mark (gc@%p)", (void*) gc);
-    /* Scan the heap for roots */
-    gc_mark_roots(gc);
-    /* Dump registers onto stack and scan the stack */
-    void (*volatile _mark_stack)(GarbageCollector*) = gc_mark_stack;
+    uintptr_t x = *(const uintptr_t*) a;
+    uintptr_t y = *(const uintptr_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static void gc_dump_object(GarbageCollector* gc, FILE* out, void* ptr, size_t size,
+                           unsigned int flags, void (*dtor)(void*))
+{
+    putc(GC_DUMP_OBJECT, out);
+    gc_dump_varint(out, (uintptr_t) ptr);
+    gc_dump_varint(out, size);
+    putc((int) flags, out);
+    /* The destructor identifies the type of an object, if anything does */
+    gc_dump_varint(out, (uintptr_t) dtor);
+    gc_dump_edges(gc, out, (char*) ptr, size);
+    putc(0, out);
+}
+
+/**
+ * Write a snapshot of the heap: every managed object with its size, flags
+ * and destructor, the objects it references and the objects referenced from
+ * the stacks. The format is described in gc.h.
+ *
+ * The world is only stopped to capture the references from the stacks and
+ * the free slots in thread caches into memory, the latter are not dumped.
+ * The heap is walked and written to `out` under the collector lock
+ * after the world is started again, without buffering the heap graph. It
+ * includes the garbage that was not swept yet, which is not reachable from
+ * the roots.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param out The stream to write to, check `ferror()` for errors.
+ * @returns The number of objects written.
+ */
+size_t gc_dump_heap(GarbageCollector* gc, FILE* out)
+{
+    gc_lock(gc);
+    gc_mark_prepare(gc);
+    DumpRoots roots = { GC_DUMP_ROOTS_CAPACITY, 0, NULL };
+    roots.items = (uintptr_t*) malloc(roots.capacity * sizeof(uintptr_t));
+    if (!roots.items) {
+        roots.capacity = 0;
+    }
+    size_t ncached = 0;
+    uintptr_t* cached = NULL;
+#ifndef GC_NO_THREADS
+    /* Threads register under the collector lock, so this is enough room */
+    if (gc->threads && gc->threads->caching) {
+        cached = (uintptr_t*) malloc(gc->threads->nthreads * GC_SIZE_CLASS_COUNT *
+                                     GC_THREAD_CACHE_SIZE * sizeof(uintptr_t));
+    }
+#endif
+    /* Dump registers onto the stack, as gc_mark() does */
+    void (*volatile _capture)(GarbageCollector*, DumpRoots*) = gc_dump_roots_capture;
     jmp_buf ctx;
     memset(&ctx, 0, sizeof(jmp_buf));
     setjmp(ctx);
-    _mark_stack(gc);
+    for (;;) {
+        gc_stop_world(gc);
+        _capture(gc, &roots);
+#ifndef GC_NO_THREADS
+        ncached = cached ? gc_dump_cached_capture(gc, cached) : 0;
+#endif
+        gc_start_world(gc);
+        if (roots.size <= roots.capacity) {
+            break;
+        }
+        /* Make room with some slack, the stacks keep changing */
+        size_t capacity = roots.size * 2;
+        uintptr_t* items = (uintptr_t*) realloc(roots.items, capacity * sizeof(uintptr_t));
+        if (!items) {
+            LOG_WARNING("Dropping %zu references from the stacks from the heap snapshot",
+                        roots.size - roots.capacity);
+            roots.size = roots.capacity;
+            break;
+        }
+        roots.items = items;
+        roots.capacity = capacity;
+    }
+    if (ncached) {
+        qsort(cached, ncached, sizeof(uintptr_t), gc_dump_compare_addr);
+    }
+    fwrite(GC_DUMP_MAGIC, 1, 8, out);
+    size_t count = 0;
+    AllocationMap* am = gc->allocs;
+    for (size_t w = 0; w < GC_MARK_WORDS(am->capacity); ++w) {
+        for (uint64_t used = am->used_bits[w]; used; used &= used - 1) {
+            Allocation* chunk = &am->allocs[w * 64 + gc_ctz64(used)];
+            if (chunk->tag & GC_TAG_DEAD) {
+                continue;
+            }
+            unsigned int flags = (chunk->tag & GC_TAG_ROOT ? GC_DUMP_ROOT : 0) |
+                                 (chunk->tag & GC_TAG_YOUNG ? GC_DUMP_YOUNG : 0);
+            gc_dump_object(gc, out, chunk->ptr, chunk->size, flags, chunk->dtor);
+            count++;
+        }
+    }
+    SmallHeap* sh = gc->small;
+    for (size_t i = 0; sh && i < sh->npages; ++i) {
+        SmallPage* page = sh->pages[i];
+        for (size_t w = 0; w < (page->bump + 63) / 64; ++w) {
+            for (uint64_t alloc = page->alloc_bits[w]; alloc; alloc &= alloc - 1) {
+                size_t slot = w * 64 + gc_ctz64(alloc);
+                uintptr_t addr = (uintptr_t) (page->base + slot * page->slot_size);
+                if (ncached && bsearch(&addr, cached, ncached, sizeof(uintptr_t),
+                                       gc_dump_compare_addr)) {
+                    continue;
+                }
+                unsigned int flags = GC_DUMP_SMALL |
+                                     (gc_bit_test(page->root_bits, slot) ? GC_DUMP_ROOT : 0) |
+                                     (gc_bit_test(page->young_bits, slot) ? GC_DUMP_YOUNG : 0);
+                gc_dump_object(gc, out, (void*) addr, page->slot_size, flags, NULL);
+                count++;
+            }
+        }
+    }
+    putc(GC_DUMP_ROOTS, out);
+    for (size_t i = 0; i < roots.size; ++i) {
+        gc_dump_varint(out, roots.items[i]);
+    }
+    putc(0, out);
+    free(roots.items);
+    free(cached);
+    putc(GC_DUMP_END, out);
+    gc_dump_varint(out, count);
+    gc_unlock(gc);
+    return count;
 }
 
-size_t gc_sweep(GarbageCollector* gc)
+/**
+ * Write the name of a frame for a folded stack: the function name from a
+ * `backtrace_symbols()` line like `prog(function+0x1a) [0x4005d6]`, or
+ * else the address.
+ */
+static void gc_profile_frame_name(const char* symbol, void* addr, char* buf, size_t size)
 {
-    LOG_DEBUG("Initiating GC sweep (gc@%p)", (void*) gc);
-    size_t total = 0;
-    for (size_t i = 0; i < gc->allocs->capacity; ++i) {
-        Allocation* chunk = gc->allocs->allocs[i];
-        Allocation* next = NULL;
-        /* Iterate over separate chaining */
-        while (chunk) {
-            if (chunk->tag & GC_TAG_MARK) {
-                LOG_DEBUG("Found used allocation %p (ptr=%p)", (void*) chunk, (void*) chunk->ptr);
-                /* unmark */
-                chunk->tag &= ~GC_TAG_MARK;
-                chunk = chunk->next;
-            } else {
-                LOG_DEBUG("Found unused allocation %p (%lu bytes @ ptr=%p)", (void*) chunk, chunk->size, (void*) chunk->ptr);
-                /* no reference to this chunk, hence delete it */
-                total += chunk->size;
-                if (chunk->dtor) {
-                    chunk->dtor(chunk->ptr);
-                }
-                free(chunk->ptr);
-                /* and remove it from the bookkeeping */
-                next = chunk->next;
-                gc_allocation_map_remove(gc->allocs, chunk->ptr, false);
-                chunk = next;
-            }
+    const char* begin = symbol ? strchr(symbol, '(') : NULL;
+    const char* end = begin ? strpbrk(begin, "+)") : NULL;
+    if (begin && end && end > begin + 1) {
+        snprintf(buf, size, "%.*s", (int) (end - begin - 1), begin + 1);
+    } else {
+        snprintf(buf, size, "0x%" PRIxPTR, (uintptr_t) addr);
+    }
+}
+
+static void gc_profile_write_folded(Profiler* p, FILE* out, bool live)
+{
+    for (size_t i = 0; i < p->nsites; ++i) {
+        ProfileSite* site = &p->sites[i];
+        double bytes = live ? site->live_bytes : site->allocated_bytes;
+        if (bytes < 0.5) {
+            continue;
+        }
+        char** symbols = NULL;
+#ifdef GC_HAVE_BACKTRACE
+        symbols = backtrace_symbols(site->frames, (int) site->depth);
+#endif
+        /* Outermost frame first */
+        for (size_t j = site->depth; j-- > 0;) {
+            char name[256];
+            gc_profile_frame_name(symbols ? symbols[j] : NULL, site->frames[j], name, sizeof(name));
+            fprintf(out, "%s%s", name, j ? ";" : "");
         }
+        fprintf(out, "%s %.0f\n", site->depth ? "" : "[unknown]", bytes);
+        free(symbols);
     }
-    gc_allocation_map_resize_to_fit(gc->allocs);
-    return total;
 }
 
 /**
- * Unset the ROOT tag on all roots on the heap.
- *
- * @param gc A pointer to a garbage collector instance.
+ * Write a heap profile in the legacy text format of pprof (as written by
+ * gperftools). pprof scales the sampled counts by itself.
  */
-void gc_unroot_roots(GarbageCollector* gc)
+static void gc_profile_write_pprof(Profiler* p, FILE* out)
 {
-    LOG_DEBUG("Unmarking roots%s", "");
-    for (size_t i = 0; i < gc->allocs->capacity; ++i) {
-        Allocation* chunk = gc->allocs->allocs[i];
-        while (chunk) {
-            if (chunk->tag & GC_TAG_ROOT) {
-                chunk->tag &= ~GC_TAG_ROOT;
-            }
-            chunk = chunk->next;
+    size_t live_samples = 0, live_size = 0, allocated_samples = 0, allocated_size = 0;
+    for (size_t i = 0; i < p->nsites; ++i) {
+        live_samples += p->sites[i].live_samples;
+        live_size += p->sites[i].live_size;
+        allocated_samples += p->sites[i].allocated_samples;
+        allocated_size += p->sites[i].allocated_size;
+    }
+    fprintf(out, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+            live_samples, live_size, allocated_samples, allocated_size, p->interval);
+    for (size_t i = 0; i < p->nsites; ++i) {
+        ProfileSite* site = &p->sites[i];
+        fprintf(out, "%zu: %zu [%zu: %zu] @", site->live_samples, site->live_size,
+                site->allocated_samples, site->allocated_size);
+        for (size_t j = 0; j < site->depth; ++j) {
+            fprintf(out, " 0x%" PRIxPTR, (uintptr_t) site->frames[j]);
+        }
+        fprintf(out, "\n");
+    }
+    /* pprof needs the mappings to symbolize position-independent code */
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if (maps) {
+        fprintf(out, "\nMAPPED_LIBRARIES:\n");
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), maps)) > 0) {
+            fwrite(buf, 1, n, out);
         }
+        fclose(maps);
     }
 }
 
-size_t gc_stop(GarbageCollector* gc)
+/**
+ * Write the allocation-site profile collected with `sample_interval` in
+ * `GarbageCollectorConfig`.
+ *
+ * Allocations are sampled every `sample_interval` bytes on average. Every
+ * sample records the backtrace of the allocation and stays live until a
+ * collection finds the object unreachable, so the profile shows both which
+ * sites allocate (and hence drive collections) and which sites retain
+ * memory. The folded formats (one line per stack, for flame graph tools)
+ * hold estimates of the bytes, the pprof format holds the samples.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @param out The stream to write to.
+ * @param format The format of the profile.
+ * @returns `false` if profiling is not enabled.
+ */
+bool gc_profile_write(GarbageCollector* gc, FILE* out, GarbageCollectorProfileFormat format)
 {
-    gc_unroot_roots(gc);
-    size_t collected = gc_sweep(gc);
-    gc_allocation_map_delete(gc->allocs);
-    return collected;
+    gc_lock(gc);
+    Profiler* p = gc->profile;
+    if (p && format == GC_PROFILE_PPROF) {
+        gc_profile_write_pprof(p, out);
+    } else if (p) {
+        gc_profile_write_folded(p, out, format == GC_PROFILE_FOLDED_LIVE);
+    }
+    gc_unlock(gc);
+    return p != NULL;
 }
 
-size_t gc_run(GarbageCollector* gc)
+/**
+ * Run a collection that frees memory right away, even in lazy sweep mode.
+ *
+ * @param gc A pointer to a garbage collector instance.
+ * @returns The number of bytes freed.
+ */
+static size_t gc_run_eager(GarbageCollector* gc)
 {
-    LOG_DEBUG("Initiating GC run (gc@%p)", (void*) gc);
-    gc_mark(gc);
-    return gc_sweep(gc);
+    size_t total = gc_run(gc);
+    if (gc->lazy) {
+        total += gc_sweep(gc);
+    }
+    return total;
 }
 
 char* gc_strdup (GarbageCollector* gc, const char* s)
@@ -8,11 +8,92 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 struct AllocationMap;
+struct MarkStack;
+struct SmallHeap;
+struct InteriorIndex;
+struct WorkerPool;
+struct FinalizerQueue;
+struct LazySweep;
+struct IncrementalMark;
+struct Generations;
+struct ThreadRegistry;
+struct EventHooks;
+struct Profiler;
+struct Pacer;
+
+/*
+ * Statistics of a garbage collector instance, see `gc_stats()`. Durations
+ * are in nanoseconds of a monotonic clock.
+ */
+typedef struct GarbageCollectorStats {
+    size_t collections;           // full collections started
+    size_t minor_collections;     // minor collections run
+    uint64_t mark_ns;             // total time spent marking
+    uint64_t sweep_ns;            // total time spent sweeping
+    uint64_t last_mark_ns;        // marking time of the last collection
+    uint64_t last_sweep_ns;       // sweeping time of the last collection
+    size_t live_bytes;            // bytes currently allocated
+    size_t live_objects;          // objects currently allocated
+    size_t peak_bytes;            // highest number of live bytes seen
+    size_t freed_bytes;           // total bytes freed by sweeps
+    size_t freed_objects;         // total objects freed by sweeps
+    size_t last_freed_bytes;      // bytes freed by the last collection
+    size_t last_freed_objects;    // objects freed by the last collection
+    size_t map_capacity;          // allocation map slots
+    size_t map_size;              // allocation map entries
+    double map_load_factor;       // map_size / map_capacity
+    size_t map_max_probe;         // longest probe sequence of the map
+    size_t next_trigger_bytes;    // live bytes that start a collection, 0 if count-based
+} GarbageCollectorStats;
+
+/*
+ * Collection events, see `gc_register_hook()`.
+ */
+typedef enum GarbageCollectorEventType {
+    GC_EVENT_CYCLE_START,  // a full or minor collection starts marking
+    GC_EVENT_MARK_END,     // marking is complete
+    GC_EVENT_SWEEP_END,    // sweeping is complete
+    GC_EVENT_MAP_RESIZE,   // the allocation map was resized
+    GC_EVENT_COUNT
+} GarbageCollectorEventType;
+
+/*
+ * The timings and counters passed to a hook. Durations are in nanoseconds of
+ * a monotonic clock, like in `GarbageCollectorStats`.
+ */
+typedef struct GarbageCollectorEvent {
+    GarbageCollectorEventType type;
+    bool minor;                   // event of a minor collection
+    uint64_t time_ns;             // when the event occurred
+    uint64_t duration_ns;         // mark, sweep or resize time, 0 at cycle start
+    size_t live_bytes;            // bytes currently allocated
+    size_t live_objects;          // objects currently allocated
+    size_t freed_bytes;           // bytes freed by the collection so far
+    size_t freed_objects;         // objects freed by the collection so far
+    size_t map_capacity;          // allocation map slots
+    size_t map_old_capacity;      // slots before a resize, else map_capacity
+    size_t map_size;              // allocation map entries
+} GarbageCollectorEvent;
 
 typedef struct GarbageCollector {
     struct AllocationMap* allocs; // allocation map
+    struct MarkStack* marks;      // work list for the mark phase
+    struct SmallHeap* small;      // size-class pages, NULL if disabled
+    struct InteriorIndex* interior; // address-ordered index, NULL if disabled
+    struct WorkerPool* pool;      // mark/sweep helper threads, NULL if serial
+    struct FinalizerQueue* finalizers; // deferred destructors, NULL if inline
+    struct LazySweep* lazy;       // lazy sweep state, NULL if disabled
+    struct IncrementalMark* incremental; // incremental mark state, NULL if disabled
+    struct Generations* gen;      // nursery and remembered set, NULL if disabled
+    struct ThreadRegistry* threads; // mutator threads, NULL if single-threaded
+    struct EventHooks* hooks;     // event callbacks, NULL if none were registered
+    FILE* record;                 // allocation trace output, NULL if not recording
+    struct Profiler* profile;     // sampled allocation sites, NULL if disabled
+    struct Pacer* pacer;          // byte-based collection trigger, NULL if disabled
+    GarbageCollectorStats stats;  // counters, see gc_stats()
     bool paused;                  // (temporarily) switch gc on/off
     void *bos;                    // bottom of stack
     size_t min_size;
@@ -21,16 +102,60 @@ typedef struct GarbageCollector {
 extern GarbageCollector gc;  // Global garbage collector for all
                              // single-threaded applications
 
+/*
+ * Sizing policy of the allocation map.
+ */
+typedef enum AllocationMapSizing {
+    GC_SIZING_PRIME,  // prime capacities, modulo hashing
+    GC_SIZING_POW2    // power-of-two capacities, multiplicative hashing
+} AllocationMapSizing;
+
+/*
+ * Tunable parameters of a garbage collector instance, see `gc_start_config()`.
+ */
+typedef struct GarbageCollectorConfig {
+    size_t initial_capacity;      // initial allocation map capacity
+    size_t min_capacity;          // allocation map never shrinks below this
+    double downsize_load_factor;  // shrink map below this load factor
+    double upsize_load_factor;    // grow map above this load factor
+    double sweep_factor;          // collect once this share of free slots is used
+    AllocationMapSizing sizing;   // allocation map sizing policy
+    bool size_classes;            // serve small requests from size-class pages
+    bool interior_pointers;       // pointers into an allocation keep it alive
+    size_t mark_threads;          // threads marking and sweeping in parallel
+    bool deferred_finalizers;     // run destructors after the sweep
+    bool lazy_sweep;              // sweep in steps during later allocations
+    bool incremental_marking;     // mark in steps during later allocations
+    size_t mark_budget;           // words an incremental mark step scans
+    bool concurrent_marking;      // mark on a background thread
+    bool multi_threaded;          // mutators on several registered threads
+    bool thread_caches;           // per-thread caches of small-object slots
+    bool generational;            // collect young objects separately
+    size_t nursery_size;          // young objects that trigger a minor collection
+    size_t promotion_age;         // minor collections survived before promotion
+    size_t sample_interval;       // mean bytes between sampled allocations, 0 disables
+    size_t heap_growth;           // collect once the heap grew by this percentage, 0 disables
+    size_t heap_minimum;          // live bytes below which heap_growth does not collect
+    size_t memory_limit;          // soft limit of the live bytes, 0 for none
+} GarbageCollectorConfig;
+
 /*
  * Starting, stopping, pausing, resuming and running the GC.
  */
 void gc_start(GarbageCollector* gc, void* bos);
 void gc_start_ext(GarbageCollector* gc, void* bos, size_t initial_size, size_t min_size,
                   double downsize_load_factor, double upsize_load_factor, double sweep_factor);
+void gc_config_default(GarbageCollectorConfig* config);
+void gc_start_config(GarbageCollector* gc, void* bos, const GarbageCollectorConfig* config);
 size_t gc_stop(GarbageCollector* gc);
+void gc_register_thread(GarbageCollector* gc, void* bos);
+void gc_unregister_thread(GarbageCollector* gc);
 void gc_pause(GarbageCollector* gc);
 void gc_resume(GarbageCollector* gc);
 size_t gc_run(GarbageCollector* gc);
+size_t gc_run_finalizers(GarbageCollector* gc);
+size_t gc_step(GarbageCollector* gc, size_t budget);
+size_t gc_run_minor(GarbageCollector* gc);
 
 /*
  * Allocating and deallocating memory.
@@ -48,6 +173,79 @@ void gc_free(GarbageCollector* gc, void* ptr);
  */
 void* gc_make_static(GarbageCollector* gc, void* ptr);
 
+/*
+ * Incremental marking and generational collection: notify the GC after
+ * storing a pointer into `obj`.
+ */
+void gc_write_barrier(GarbageCollector* gc, void* obj);
+
+/*
+ * Built with GC_RECORD, stores are also recorded, see `gc_record()`.
+ */
+void gc_record_store(GarbageCollector* gc, void* obj, void* slot);
+
+#ifdef GC_RECORD
+#define GC_STORE(gc, obj, field, value) \
+    do { (obj)->field = (value); gc_record_store((gc), (obj), (void*) &(obj)->field); } while (0)
+#else
+#define GC_STORE(gc, obj, field, value) \
+    do { (obj)->field = (value); gc_write_barrier((gc), (obj)); } while (0)
+#endif
+
+/*
+ * Statistics and event hooks
+ */
+typedef void (*GarbageCollectorHook)(GarbageCollector* gc, const GarbageCollectorEvent* event,
+                                     void* data);
+
+void gc_stats(GarbageCollector* gc, GarbageCollectorStats* stats);
+bool gc_register_hook(GarbageCollector* gc, GarbageCollectorEventType type,
+                      GarbageCollectorHook hook, void* data);
+bool gc_unregister_hook(GarbageCollector* gc, GarbageCollectorEventType type,
+                        GarbageCollectorHook hook, void* data);
+
+/*
+ * Recording allocation traces (needs a build with GC_RECORD)
+ */
+bool gc_record(GarbageCollector* gc, FILE* out);
+
+/*
+ * Heap snapshots, see `gc_dump_heap()` and tools/gc_heap.c. A dump starts
+ * with the 8 bytes of GC_DUMP_MAGIC, followed by records that start with
+ * their type byte. All numbers are unsigned LEB128 varints:
+ *
+ *   GC_DUMP_OBJECT: address, size, flags (GC_DUMP_*), destructor address,
+ *                   then the addresses of the referenced objects, ending in 0
+ *   GC_DUMP_ROOTS:  the addresses of the objects referenced from the stacks
+ *                   and registers, ending in 0
+ *   GC_DUMP_END:    the number of object records
+ */
+#define GC_DUMP_MAGIC "gcheap\0\1"
+
+typedef enum GarbageCollectorDumpRecord {
+    GC_DUMP_OBJECT = 1,
+    GC_DUMP_ROOTS = 2,
+    GC_DUMP_END = 3
+} GarbageCollectorDumpRecord;
+
+#define GC_DUMP_ROOT 0x1   // a root, see gc_make_static()
+#define GC_DUMP_SMALL 0x2  // allocated from a size class
+#define GC_DUMP_YOUNG 0x4  // in the nursery (generational mode)
+
+size_t gc_dump_heap(GarbageCollector* gc, FILE* out);
+
+/*
+ * Allocation-site profiles, see `sample_interval` in GarbageCollectorConfig
+ * and `gc_profile_write()`.
+ */
+typedef enum GarbageCollectorProfileFormat {
+    GC_PROFILE_PPROF,             // pprof heap profile (legacy text format)
+    GC_PROFILE_FOLDED_ALLOCATED,  // folded stacks, bytes allocated
+    GC_PROFILE_FOLDED_LIVE        // folded stacks, bytes that are still live
+} GarbageCollectorProfileFormat;
+
+bool gc_profile_write(GarbageCollector* gc, FILE* out, GarbageCollectorProfileFormat format);
+
 /*
  * Helper functions and stdlib replacements.
  */
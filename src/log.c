@@ -1,4 +1,110 @@
 #include "log.h"
 
+#include <stdarg.h>
+#include <string.h>
+
 const char * log_level_strings [] = { "CRIT", "WARN", "INFO", "DEBG", "NONE" };
 
+/*
+ * The trace ring buffer. Writers claim the next message number with an
+ * atomic increment and never wait for each other or for readers. The
+ * sequence number of an entry is 0 while it is written and the message
+ * number plus one afterwards, so a reader can tell whether it copied a
+ * complete message and whether that message was overwritten in between.
+ */
+typedef struct LogTraceEntry {
+    uint64_t seq;
+    char text[LOG_TRACE_LENGTH];
+} LogTraceEntry;
+
+static LogTraceEntry log_trace_ring[LOG_TRACE_ENTRIES];
+static uint64_t log_trace_head;  // number of messages written so far
+
+#if defined(_MSC_VER)
+/* Builds without POSIX threads have a single mutator thread */
+#define log_trace_fetch_add(p, v) ((*(p) += (v)) - (v))
+#define log_trace_load(p) (*(p))
+#define log_trace_store(p, v) (*(p) = (v))
+#define log_trace_fence(order) ((void) 0)
+#else
+#define log_trace_fetch_add(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define log_trace_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define log_trace_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define log_trace_fence(order) __atomic_thread_fence(order)
+#endif
+
+/**
+ * Append a message to the trace ring buffer, overwriting the oldest one.
+ *
+ * @param fmt A `printf()` format string.
+ */
+void log_trace(const char* fmt, ...)
+{
+    uint64_t n = log_trace_fetch_add(&log_trace_head, 1);
+    LogTraceEntry* entry = &log_trace_ring[n & (LOG_TRACE_ENTRIES - 1)];
+    log_trace_store(&entry->seq, 0);
+    /* The text must not be written before the entry is marked */
+    log_trace_fence(__ATOMIC_RELEASE);
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(entry->text, LOG_TRACE_LENGTH, fmt, args);
+    va_end(args);
+    log_trace_store(&entry->seq, n + 1);
+}
+
+/**
+ * Read the next message from the trace ring buffer.
+ *
+ * Messages that were overwritten before they were read are skipped, as
+ * are messages that are being written concurrently.
+ *
+ * @param cursor The number of the next message to read, 0 initially.
+ *               Advanced past the message that was read.
+ * @param buf The buffer to copy the message to.
+ * @param size The size of `buf`.
+ * @returns `false` if there are no more messages.
+ */
+bool log_trace_next(uint64_t* cursor, char* buf, size_t size)
+{
+    uint64_t head = log_trace_load(&log_trace_head);
+    if (head > LOG_TRACE_ENTRIES && *cursor < head - LOG_TRACE_ENTRIES) {
+        *cursor = head - LOG_TRACE_ENTRIES;
+    }
+    char text[LOG_TRACE_LENGTH];
+    for (; *cursor < head; ++*cursor) {
+        LogTraceEntry* entry = &log_trace_ring[*cursor & (LOG_TRACE_ENTRIES - 1)];
+        if (log_trace_load(&entry->seq) != *cursor + 1) {
+            continue;
+        }
+        memcpy(text, entry->text, LOG_TRACE_LENGTH);
+        log_trace_fence(__ATOMIC_ACQUIRE);
+        if (log_trace_load(&entry->seq) != *cursor + 1) {
+            continue;
+        }
+        if (size > 0) {
+            text[LOG_TRACE_LENGTH - 1] = '\0';
+            snprintf(buf, size, "%s", text);
+        }
+        ++*cursor;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Write the messages in the trace ring buffer to `out`, oldest first.
+ *
+ * @param out The stream to write to.
+ * @returns The number of messages written.
+ */
+size_t log_trace_dump(FILE* out)
+{
+    uint64_t cursor = 0;
+    char text[LOG_TRACE_LENGTH];
+    size_t count = 0;
+    while (log_trace_next(&cursor, text, sizeof(text))) {
+        fprintf(out, "%s\n", text);
+        count++;
+    }
+    return count;
+}
@@ -1,26 +1,100 @@
 #ifndef __LOG_H__
 #define __LOG_H__
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
-#define LOGLEVEL LOGLEVEL_DEBUG
+/*
+ * Log levels. Messages above LOGLEVEL are removed by the preprocessor, define
+ * LOGLEVEL before including this header (or with -DLOGLEVEL=...) to change it.
+ */
+#define LOGLEVEL_CRITICAL 0
+#define LOGLEVEL_WARNING 1
+#define LOGLEVEL_INFO 2
+#define LOGLEVEL_DEBUG 3
+#define LOGLEVEL_NONE 4
 
-enum {
-    LOGLEVEL_CRITICAL,
-    LOGLEVEL_WARNING,
-    LOGLEVEL_INFO,
-    LOGLEVEL_DEBUG,
-    LOGLEVEL_NONE
-};
+#ifndef LOGLEVEL
+#define LOGLEVEL LOGLEVEL_INFO
+#endif
 
 extern const char* log_level_strings[];
 
 #define log(level, fmt, ...) \
     do { if (level <= LOGLEVEL) fprintf(stderr, "[%s] %s:%s:%d: " fmt "\n", log_level_strings[level], __func__, __FILE__, __LINE__, __VA_ARGS__); } while (0)
 
-#define LOG_CRITICAL(fmt, ...) log(LOGLEVEL_CRITICAL, fmt, __VA_ARGS__)
-#define LOG_WARNING(fmt, ...) log(LOGLEVEL_WARNING, fmt, __VA_ARGS__)
-#define LOG_INFO(fmt, ...) log(LOGLEVEL_INFO, fmt, __VA_ARGS__)
-#define LOG_DEBUG(fmt, ...) log(LOGLEVEL_DEBUG, fmt, __VA_ARGS__)
+/* The level tag is part of the format, so a build shows which levels it logs */
+#define log_print(tag, fmt, ...) \
+    fprintf(stderr, "[" tag "] %s:%s:%d: " fmt "\n", __func__, __FILE__, __LINE__, __VA_ARGS__)
+
+#if LOGLEVEL >= LOGLEVEL_CRITICAL
+#define LOG_CRITICAL(fmt, ...) log_print("CRIT", fmt, __VA_ARGS__)
+#else
+#define LOG_CRITICAL(fmt, ...) do { } while (0)
+#endif
+
+#if LOGLEVEL >= LOGLEVEL_WARNING
+#define LOG_WARNING(fmt, ...) log_print("WARN", fmt, __VA_ARGS__)
+#else
+#define LOG_WARNING(fmt, ...) do { } while (0)
+#endif
+
+#if LOGLEVEL >= LOGLEVEL_INFO
+#define LOG_INFO(fmt, ...) log_print("INFO", fmt, __VA_ARGS__)
+#else
+#define LOG_INFO(fmt, ...) do { } while (0)
+#endif
+
+#if LOGLEVEL >= LOGLEVEL_DEBUG
+#define LOG_DEBUG(fmt, ...) log_print("DEBG", fmt, __VA_ARGS__)
+#else
+#define LOG_DEBUG(fmt, ...) do { } while (0)
+#endif
+
+/*
+ * Tracing of individual subsystems, independent of the log level. Define
+ * LOGTRACE as a combination of the flags below to enable it, e.g.
+ * -DLOGTRACE=LOGTRACE_MARK|LOGTRACE_SWEEP. Trace messages are prefixed with
+ * their subsystem and do not go to stderr but into a ring buffer of the most
+ * recent ones, see `log_trace_next()`.
+ */
+#define LOGTRACE_MARK 0x1
+#define LOGTRACE_SWEEP 0x2
+#define LOGTRACE_MAP 0x4
+
+#ifndef LOGTRACE
+#define LOGTRACE 0
+#endif
+
+#if (LOGTRACE) & LOGTRACE_MARK
+#define TRACE_MARK(fmt, ...) log_trace("[mark] " fmt, __VA_ARGS__)
+#else
+#define TRACE_MARK(fmt, ...) do { } while (0)
+#endif
+
+#if (LOGTRACE) & LOGTRACE_SWEEP
+#define TRACE_SWEEP(fmt, ...) log_trace("[sweep] " fmt, __VA_ARGS__)
+#else
+#define TRACE_SWEEP(fmt, ...) do { } while (0)
+#endif
+
+#if (LOGTRACE) & LOGTRACE_MAP
+#define TRACE_MAP(fmt, ...) log_trace("[map] " fmt, __VA_ARGS__)
+#else
+#define TRACE_MAP(fmt, ...) do { } while (0)
+#endif
+
+/*
+ * Number of messages the trace ring buffer holds (a power of two), and the
+ * length a message is truncated to.
+ */
+#define LOG_TRACE_ENTRIES 4096
+#define LOG_TRACE_LENGTH 120
+
+void log_trace(const char* fmt, ...);
+bool log_trace_next(uint64_t* cursor, char* buf, size_t size);
+size_t log_trace_dump(FILE* out);
 
 #endif /* !__LOG_H__ */
@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include "minunit.h"
 
+/* Compile the trace recorder in, see test_gc_record() */
+#define GC_RECORD
 #include "../src/gc.c"
 
 #define UNUSED(x) (void)(x)
@@ -30,17 +32,20 @@ void dtor(void* ptr)
     DTOR_COUNT++;
 }
 
-static char* test_gc_allocation_new_delete()
+static char* test_gc_allocation_map_inline_metadata()
 {
+    AllocationMap* am = gc_allocation_map_new(8, 16, 0.5, 0.2, 0.8, GC_SIZING_PRIME);
     int* ptr = malloc(sizeof(int));
-    Allocation* a = gc_allocation_new(ptr, sizeof(int), dtor);
+    Allocation* a = gc_allocation_map_put(am, ptr, sizeof(int), dtor);
     mu_assert(a != NULL, "Allocation should return non-NULL");
+    mu_assert(a >= am->allocs && a < am->allocs + am->capacity,
+              "Allocation metadata should be stored inline in the map");
     mu_assert(a->ptr == ptr, "Allocation should contain original pointer");
     mu_assert(a->size == sizeof(int), "Size of mem pointed to should not change");
     mu_assert(a->tag == GC_TAG_NONE, "Annotation should initially be untagged");
     mu_assert(a->dtor == dtor, "Destructor pointer should not change");
-    mu_assert(a->next == NULL, "Annotation should initilally be unlinked");
-    gc_allocation_delete(a);
+    mu_assert(a->dist == 0, "First entry should be stored in its home slot");
+    gc_allocation_map_delete(am);
     free(ptr);
     return NULL;
 }
@@ -49,7 +54,7 @@ static char* test_gc_allocation_new_delete()
 static char* test_gc_allocation_map_new_delete()
 {
     /* Standard invocation */
-    AllocationMap* am = gc_allocation_map_new(8, 16, 0.5, 0.2, 0.8);
+    AllocationMap* am = gc_allocation_map_new(8, 16, 0.5, 0.2, 0.8, GC_SIZING_PRIME);
     mu_assert(am->min_capacity == 11, "True min capacity should be next prime");
     mu_assert(am->capacity == 17, "True capacity should be next prime");
     mu_assert(am->size == 0, "Allocation map should be initialized to empty");
@@ -60,7 +65,7 @@ static char* test_gc_allocation_map_new_delete()
     gc_allocation_map_delete(am);
 
     /* Enforce min sizes */
-    am = gc_allocation_map_new(8, 4, 0.5, 0.2, 0.8);
+    am = gc_allocation_map_new(8, 4, 0.5, 0.2, 0.8, GC_SIZING_PRIME);
     mu_assert(am->min_capacity == 11, "True min capacity should be next prime");
     mu_assert(am->capacity == 11, "True capacity should be next prime");
     mu_assert(am->size == 0, "Allocation map should be initialized to empty");
@@ -76,7 +81,7 @@ static char* test_gc_allocation_map_new_delete()
 
 static char* test_gc_allocation_map_basic_get()
 {
-    AllocationMap* am = gc_allocation_map_new(8, 16, 0.5, 0.2, 0.8);
+    AllocationMap* am = gc_allocation_map_new(8, 16, 0.5, 0.2, 0.8, GC_SIZING_PRIME);
 
     /* Ask for something that does not exist */
     int* five = malloc(sizeof(int));
@@ -121,24 +126,33 @@ static char* test_gc_allocation_map_put_get_remove()
         ints[i] = malloc(sizeof(int));
     }
 
-    /* Enforce separate chaining by disallowing up/downsizing.
-     * The pigeonhole principle then states that we need to have at least one
-     * entry in the hash map that has a separare chain with len > 1
+    /* Disallow up/downsizing. Open addressing cannot hold more entries than
+     * slots, hence the map must grow nevertheless once it is nearly full.
      */
-    AllocationMap* am = gc_allocation_map_new(32, 32, DBL_MAX, 0.0, DBL_MAX);
+    AllocationMap* am = gc_allocation_map_new(32, 32, DBL_MAX, 0.0, DBL_MAX, GC_SIZING_PRIME);
     Allocation* a;
     for (size_t i=0; i<64; ++i) {
         a = gc_allocation_map_put(am, ints[i], sizeof(int), NULL);
+        mu_assert(a->ptr == ints[i], "Put should return the inserted allocation");
     }
     mu_assert(am->size == 64, "Maps w/ 64 elements should have size 64");
+    mu_assert(am->capacity > 64, "Full maps should grow beyond the upsize factor");
+    for (size_t i=0; i<64; ++i) {
+        a = gc_allocation_map_get(am, ints[i]);
+        mu_assert(a && a->ptr == ints[i], "All entries should be found after growing");
+    }
     /* Now update all of them with a new dtor */
     for (size_t i=0; i<64; ++i) {
         a = gc_allocation_map_put(am, ints[i], sizeof(int), dtor);
     }
     mu_assert(am->size == 64, "Maps w/ 64 elements should have size 64");
-    /* Now delete all of them again */
+    /* Now delete all of them again, checking that removal keeps the
+     * remaining entries reachable */
     for (size_t i=0; i<64; ++i) {
         gc_allocation_map_remove(am, ints[i], true);
+        for (size_t j=i+1; j<64; ++j) {
+            mu_assert(gc_allocation_map_get(am, ints[j]), "Removal lost an entry");
+        }
     }
     mu_assert(am->size == 0, "Empty map must have size 0");
     /* And delete the entire map */
@@ -153,11 +167,181 @@ static char* test_gc_allocation_map_put_get_remove()
     return NULL;
 }
 
+static char* test_gc_allocation_map_pow2()
+{
+    AllocationMap* am = gc_allocation_map_new(8, 20, 0.5, 0.2, 0.8, GC_SIZING_POW2);
+    mu_assert(am->min_capacity == 8, "Min capacity should be a power of two");
+    mu_assert(am->capacity == 32, "Capacity should be the next power of two");
+    mu_assert(am->hash_shift == 59, "Hash shift should select the top log2(capacity) bits");
+
+    size_t N = 200;
+    int** ints = malloc(N*sizeof(int*));
+    for (size_t i=0; i<N; ++i) {
+        ints[i] = malloc(sizeof(int));
+        gc_allocation_map_put(am, ints[i], sizeof(int), NULL);
+        mu_assert(gc_allocation_map_home(am, ints[i]) < am->capacity, "Home slot out of range");
+    }
+    mu_assert(am->size == N, "All entries should be stored");
+    mu_assert((am->capacity & (am->capacity - 1)) == 0, "Capacity should stay a power of two");
+    for (size_t i=0; i<N; ++i) {
+        Allocation* a = gc_allocation_map_get(am, ints[i]);
+        mu_assert(a && a->ptr == ints[i], "Entries should be found after resizing");
+    }
+    for (size_t i=0; i<N; ++i) {
+        gc_allocation_map_remove(am, ints[i], true);
+        free(ints[i]);
+    }
+    mu_assert(am->size == 0, "Empty map must have size 0");
+    mu_assert((am->capacity & (am->capacity - 1)) == 0, "Capacity should stay a power of two");
+    free(ints);
+    gc_allocation_map_delete(am);
+
+    /* Select the policy when starting the collector */
+    GarbageCollector gc_;
+    GarbageCollectorConfig config;
+    gc_config_default(&config);
+    config.sizing = GC_SIZING_POW2;
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    mu_assert(gc_.allocs->sizing == GC_SIZING_POW2, "Sizing policy should be configurable");
+    mu_assert(gc_.allocs->capacity == 1024, "Default capacity should be a power of two");
+    gc_stop(&gc_);
+    return NULL;
+}
+
+static char* test_gc_allocation_map_compact()
+{
+    /* Build a densely packed map so that clusters are long */
+    size_t N = 256;
+    int** ints = malloc(N*sizeof(int*));
+    AllocationMap* am = gc_allocation_map_new(293, 293, DBL_MAX, 0.0, DBL_MAX, GC_SIZING_PRIME);
+    for (size_t i=0; i<N; ++i) {
+        ints[i] = malloc(sizeof(int));
+        gc_allocation_map_put(am, ints[i], sizeof(int), NULL);
+    }
+    size_t capacity = am->capacity;
+    mu_assert(capacity == 293, "Map should not have been resized");
+    /* Tag every third entry as dead and remove them in bulk */
+    size_t dead = 0;
+    for (size_t i=0; i<N; i+=3) {
+        gc_allocation_map_get(am, ints[i])->tag = GC_TAG_DEAD;
+        dead++;
+    }
+    size_t removed = gc_allocation_map_compact(am);
+    mu_assert(removed == dead, "Compaction should remove all dead entries");
+    mu_assert(am->size == N - dead, "Compaction should update the map size");
+    mu_assert(am->capacity == capacity, "Compaction should not resize the map");
+    for (size_t i=0; i<N; ++i) {
+        Allocation* a = gc_allocation_map_get(am, ints[i]);
+        if (i % 3 == 0) {
+            mu_assert(a == NULL, "Dead entries should be gone after compaction");
+        } else {
+            mu_assert(a && a->ptr == ints[i], "Live entries should survive compaction");
+        }
+    }
+    /* Every entry must sit exactly dist slots after its home slot */
+    for (size_t i=0; i<am->capacity; ++i) {
+        Allocation* a = &am->allocs[i];
+        if (a->ptr) {
+            size_t home = gc_allocation_map_home(am, a->ptr);
+            mu_assert((home + a->dist) % am->capacity == i, "Probe distance is inconsistent");
+        }
+    }
+    gc_allocation_map_delete(am);
+    for (size_t i=0; i<N; ++i) {
+        free(ints[i]);
+    }
+    free(ints);
+    return NULL;
+}
+
+static char* test_gc_allocation_map_mark_bits()
+{
+    /* Mark bits live in a side table and must follow their entries when
+     * insertion, removal or resizing moves them to other slots */
+    size_t N = 256;
+    int** ints = malloc(N*sizeof(int*));
+    AllocationMap* am = gc_allocation_map_new(8, 8, DBL_MAX, 0.0, DBL_MAX, GC_SIZING_PRIME);
+    for (size_t i=0; i<N; ++i) {
+        ints[i] = malloc(sizeof(int));
+        gc_allocation_map_put(am, ints[i], sizeof(int), NULL);
+        for (size_t j=0; j<i; j+=2) {
+            mu_assert(gc_allocation_map_marked(am, gc_allocation_map_get(am, ints[j])),
+                      "Marks should survive inserts and resizes");
+        }
+        if (i % 2 == 0) {
+            mu_assert(gc_allocation_map_mark(am, gc_allocation_map_get(am, ints[i])),
+                      "First mark should report an unmarked entry");
+            mu_assert(!gc_allocation_map_mark(am, gc_allocation_map_get(am, ints[i])),
+                      "Second mark should report a marked entry");
+        }
+    }
+    for (size_t i=0; i<N; i+=3) {
+        gc_allocation_map_remove(am, ints[i], false);
+    }
+    size_t marked = 0;
+    for (size_t i=0; i<N; ++i) {
+        Allocation* a = gc_allocation_map_get(am, ints[i]);
+        if (i % 3 == 0) continue;
+        mu_assert(gc_allocation_map_marked(am, a) == (i % 2 == 0), "Marks should survive removals");
+        marked += i % 2 == 0;
+    }
+    size_t bits = 0;
+    for (size_t w=0; w<GC_MARK_WORDS(am->capacity); ++w) {
+        bits += (size_t) __builtin_popcountll(am->mark_bits[w]);
+    }
+    mu_assert(bits == marked, "Removed entries should not leave marks behind");
+    for (size_t i=0; i<am->capacity; ++i) {
+        mu_assert(gc_bit_test(am->used_bits, i) == (am->allocs[i].ptr != NULL),
+                  "Occupancy bitmap should match the slots");
+    }
+    gc_allocation_map_unmark_all(am);
+    for (size_t i=1; i<N; i+=3) {
+        mu_assert(!gc_allocation_map_marked(am, gc_allocation_map_get(am, ints[i])),
+                  "Unmarking should clear all marks");
+    }
+    gc_allocation_map_delete(am);
+    for (size_t i=0; i<N; ++i) {
+        free(ints[i]);
+    }
+    free(ints);
+    return NULL;
+}
+
+static char* test_gc_allocation_map_filter()
+{
+    AllocationMap* am = gc_allocation_map_new(8, 16, 0.5, 0.2, 0.8, GC_SIZING_PRIME);
+    int* five = malloc(sizeof(int));
+    int* six = malloc(sizeof(int));
+    int local = 0;
+    mu_assert(!gc_allocation_map_filter_test(am, five), "Empty map should reject all pointers");
+
+    gc_allocation_map_put(am, five, sizeof(int), NULL);
+    gc_allocation_map_put(am, six, sizeof(int), NULL);
+    mu_assert(gc_allocation_map_filter_test(am, five), "Managed pointers must pass the filter");
+    mu_assert(gc_allocation_map_filter_test(am, six), "Managed pointers must pass the filter");
+    mu_assert(!gc_allocation_map_filter_test(am, (void*) 42), "Small integers should be rejected");
+    mu_assert(!gc_allocation_map_filter_test(am, &local), "Stack addresses should be rejected");
+    mu_assert(gc_allocation_map_get(am, (void*) 42) == NULL, "Filtered pointers are not managed");
+
+    /* Removal keeps the filter conservative until it is rebuilt */
+    gc_allocation_map_remove(am, six, true);
+    mu_assert(gc_allocation_map_get(am, six) == NULL, "Removed pointer should not be found");
+    gc_allocation_map_filter_reset(am);
+    gc_allocation_map_filter_add(am, five);
+    mu_assert(am->min_ptr == (uintptr_t) five && am->max_ptr == (uintptr_t) five,
+              "Rebuilt filter should span the remaining pointers only");
+
+    gc_allocation_map_delete(am);
+    free(five);
+    free(six);
+    return NULL;
+}
+
 static char* test_gc_allocation_map_cleanup()
 {
     /* Make sure that the entries in the allocation map get reset
      * to NULL when we delete things. This is required for the
-     * chunk != NULL checks when iterating over the items in the hash map.
+     * chunk->ptr != NULL checks when iterating over the items in the hash map.
      */
     DTOR_COUNT = 0;
     GarbageCollector gc_;
@@ -180,7 +364,7 @@ static char* test_gc_allocation_map_cleanup()
 
     /* now make sure that all allocation entries are NULL */
     for (size_t i=0; i<gc_.allocs->capacity; ++i) {
-        mu_assert(gc_.allocs->allocs[i] == NULL, "Deleted allocs should be reset to NULL");
+        mu_assert(gc_.allocs->allocs[i].ptr == NULL, "Deleted allocs should be reset to NULL");
     }
     gc_stop(&gc_);
     return NULL;
@@ -199,10 +383,10 @@ static char* test_gc_mark_stack()
     int** five_ptr = gc_calloc(&gc_, 2, sizeof(int*));
     gc_mark_stack(&gc_);
     Allocation* a = gc_allocation_map_get(gc_.allocs, five_ptr);
-    mu_assert(a->tag & GC_TAG_MARK, "Heap allocation referenced from stack should be tagged");
+    mu_assert(gc_allocation_map_marked(gc_.allocs, a), "Heap allocation referenced from stack should be tagged");
 
-    /* manually reset the tags */
-    a->tag = GC_TAG_NONE;
+    /* manually reset the marks */
+    gc_allocation_map_unmark_all(gc_.allocs);
 
     /* Part 2: Add dependent allocations and check if these allocations
      * get marked properly*/
@@ -212,19 +396,14 @@ static char* test_gc_mark_stack()
     *five_ptr[1] = 5;
     gc_mark_stack(&gc_);
     a = gc_allocation_map_get(gc_.allocs, five_ptr);
-    mu_assert(a->tag & GC_TAG_MARK, "Referenced heap allocation should be tagged");
+    mu_assert(gc_allocation_map_marked(gc_.allocs, a), "Referenced heap allocation should be tagged");
     for (size_t i=0; i<2; ++i) {
         a = gc_allocation_map_get(gc_.allocs, five_ptr[i]);
-        mu_assert(a->tag & GC_TAG_MARK, "Dependent heap allocs should be tagged");
+        mu_assert(gc_allocation_map_marked(gc_.allocs, a), "Dependent heap allocs should be tagged");
     }
 
-    /* Clean up the tags manually */
-    a = gc_allocation_map_get(gc_.allocs, five_ptr);
-    a->tag = GC_TAG_NONE;
-    for (size_t i=0; i<2; ++i) {
-        a = gc_allocation_map_get(gc_.allocs, five_ptr[i]);
-        a->tag = GC_TAG_NONE;
-    }
+    /* Clean up the marks manually */
+    gc_allocation_map_unmark_all(gc_.allocs);
 
     /* Part3: Now delete the pointer to five_ptr[1] which should
      * leave the allocation for five_ptr[1] unmarked. */
@@ -232,21 +411,512 @@ static char* test_gc_mark_stack()
     five_ptr[1] = NULL;
     gc_mark_stack(&gc_);
     a = gc_allocation_map_get(gc_.allocs, five_ptr);
-    mu_assert(a->tag & GC_TAG_MARK, "Referenced heap allocation should be tagged");
+    mu_assert(gc_allocation_map_marked(gc_.allocs, a), "Referenced heap allocation should be tagged");
     a = gc_allocation_map_get(gc_.allocs, five_ptr[0]);
-    mu_assert(a->tag & GC_TAG_MARK, "Referenced alloc should be tagged");
-    mu_assert(unmarked_alloc->tag == GC_TAG_NONE, "Unreferenced alloc should not be tagged");
+    mu_assert(gc_allocation_map_marked(gc_.allocs, a), "Referenced alloc should be tagged");
+    mu_assert(!gc_allocation_map_marked(gc_.allocs, unmarked_alloc), "Unreferenced alloc should not be tagged");
 
-    /* Clean up the tags manually, again */
-    a = gc_allocation_map_get(gc_.allocs, five_ptr[0]);
-    a->tag = GC_TAG_NONE;
-    a = gc_allocation_map_get(gc_.allocs, five_ptr);
-    a->tag = GC_TAG_NONE;
+    /* Clean up the marks manually, again */
+    gc_allocation_map_unmark_all(gc_.allocs);
+
+    gc_stop(&gc_);
+    return NULL;
+}
+
+
+typedef struct Node {
+    struct Node* next;
+    struct Node* other;
+} Node;
+
+static char* test_gc_mark_deep_list()
+{
+    /* A long linked list must not exhaust the C stack during marking */
+    GarbageCollector gc_;
+    void *bos = __builtin_frame_address(0);
+    gc_start(&gc_, bos);
+    gc_pause(&gc_);
+    size_t N = 1 << 19;
+    Node* head = gc_calloc(&gc_, 1, sizeof(Node));
+    Node* tail = head;
+    for (size_t i=1; i<N; ++i) {
+        tail->next = gc_calloc(&gc_, 1, sizeof(Node));
+        tail = tail->next;
+    }
+    size_t collected = gc_run(&gc_);
+    mu_assert(collected == 0, "Reachable list nodes should not be collected");
+    mu_assert(gc_.allocs->size == N, "All list nodes should still be managed");
+    mu_assert(gc_.marks->size == 0, "Mark stack should be empty after marking");
+    gc_stop(&gc_);
+    return NULL;
+}
+
+static char* test_gc_mark_stack_overflow()
+{
+    /* Restrict the mark stack to a few entries and make sure that overflow
+     * handling still marks every node of a binary tree */
+    GarbageCollector gc_;
+    void *bos = __builtin_frame_address(0);
+    gc_start_ext(&gc_, bos, 32, 32, 0.0, DBL_MAX, DBL_MAX);
+    gc_pause(&gc_);
+    gc_mark_stack_delete(gc_.marks);
+    gc_.marks = gc_mark_stack_new(4, 4);
+    size_t N = 1023;
+    Node** nodes = gc_calloc(&gc_, N, sizeof(Node*));
+    for (size_t i=0; i<N; ++i) {
+        nodes[i] = gc_calloc(&gc_, 1, sizeof(Node));
+    }
+    for (size_t i=0; 2*i+2<N; ++i) {
+        nodes[i]->next = nodes[2*i+1];
+        nodes[i]->other = nodes[2*i+2];
+    }
+    Node* root = nodes[0];
+    memset(nodes, 0, N * sizeof(Node*));
+    gc_mark_alloc(&gc_, root);
+    size_t marked = 0;
+    for (size_t i=0; i<gc_.allocs->capacity; ++i) {
+        Allocation* chunk = &gc_.allocs->allocs[i];
+        if (chunk->ptr && gc_allocation_map_marked(gc_.allocs, chunk)) marked++;
+    }
+    mu_assert(marked == N, "All tree nodes should be marked despite overflow");
+    mu_assert(gc_.marks->capacity <= 4, "Mark stack should not exceed its maximum");
+
+    /* A fixed stack, as while the world is stopped, overflows instead of
+     * growing */
+    gc_mark_stack_delete(gc_.marks);
+    gc_.marks = gc_mark_stack_new(4, GC_MARK_STACK_MAX_CAPACITY);
+    gc_.marks->fixed = true;
+    gc_mark_alloc(&gc_, root);
+    mu_assert(gc_.marks->capacity == 4, "A fixed mark stack should not grow");
+    gc_.marks->fixed = false;
+    gc_mark_prepare(&gc_);
+    mu_assert(gc_.marks->capacity == 4, "A single mutator's mark stack should grow on demand");
+    gc_stop(&gc_);
+
+#ifndef GC_NO_THREADS
+    /* Multi-threaded collectors reserve room before stopping the world */
+    GarbageCollectorConfig config;
+    gc_config_default(&config);
+    config.multi_threaded = true;
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    gc_pause(&gc_);
+    for (size_t i=0; i<N; ++i) {
+        gc_calloc(&gc_, 1, sizeof(Node));
+    }
+    gc_mark_prepare(&gc_);
+    mu_assert(gc_.marks->capacity >= N, "Preparing should make room for all objects");
+    gc_stop(&gc_);
+#endif
+    return NULL;
+}
+
+#ifndef GC_NO_THREADS
+static char* test_gc_mark_parallel()
+{
+    /* Mark a binary tree of small and large objects with several workers,
+     * once with regular and once with tiny (overflowing) worker stacks */
+    GarbageCollector gc_;
+    GarbageCollectorConfig config;
+    gc_config_default(&config);
+    config.size_classes = true;
+    config.mark_threads = 4;
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    gc_pause(&gc_);
+    mu_assert(gc_.pool != NULL, "Mark pool should be started");
+    mu_assert(gc_.pool->nworkers == 4, "Mark pool should have the configured size");
+
+    size_t N = (1 << 14) + 1;
+    size_t M = 1000;
+    Node** nodes = malloc(N * sizeof(Node*));
+    nodes[0] = gc_malloc_static(&gc_, 512, NULL);
+    memset(nodes[0], 0, 512);
+    for (size_t i=1; i<N; ++i) {
+        /* odd nodes live in size-class pages, even ones in the map */
+        nodes[i] = gc_calloc(&gc_, 1, i % 2 ? sizeof(Node) : 512);
+    }
+    for (size_t i=0; 2*i+2<N; ++i) {
+        nodes[i]->next = nodes[2*i+1];
+        nodes[i]->other = nodes[2*i+2];
+    }
+    free(nodes);
+
+    for (size_t round=0; round<2; ++round) {
+        for (size_t i=0; i<M; ++i) {
+            gc_calloc(&gc_, 1, 512);
+        }
+        if (round == 1) {
+            for (size_t i=0; i<gc_.pool->nworkers; ++i) {
+                gc_mark_stack_delete(gc_.pool->workers[i].stack);
+                gc_.pool->workers[i].stack = gc_mark_stack_new(4, 4);
+            }
+        }
+        gc_mark_roots(&gc_);
+        for (size_t i=0; i<gc_.pool->nworkers; ++i) {
+            mu_assert(gc_.pool->workers[i].stack->size == 0,
+                      "Worker stacks should be empty after marking");
+        }
+        size_t collected = gc_sweep(&gc_);
+        mu_assert(collected == M * 512, "Only unreachable objects should be collected");
+        mu_assert(gc_.allocs->size == (N + 1) / 2, "All large tree nodes should survive");
+        mu_assert(gc_.small->count == N / 2, "All small tree nodes should survive");
+    }
+    gc_stop(&gc_);
+
+    /* One thread means serial marking */
+    config.mark_threads = 1;
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    mu_assert(gc_.pool == NULL, "Serial marking should not start a mark pool");
+    gc_stop(&gc_);
+    return NULL;
+}
+#endif
+
+static char* test_gc_deferred_finalizers()
+{
+    /* Destructors of unreachable objects run after the sweep. Sweeping in
+     * parallel must give the same result as sweeping serially. */
+    for (size_t threads = 1; threads <= 4; threads *= 4) {
+        GarbageCollector gc_;
+        GarbageCollectorConfig config;
+        gc_config_default(&config);
+        config.size_classes = true;
+        config.deferred_finalizers = true;
+        config.mark_threads = threads;
+        gc_start_config(&gc_, __builtin_frame_address(0), &config);
+        gc_pause(&gc_);
+        size_t N = 2000;
+        void** keep = gc_malloc_static(&gc_, N * sizeof(void*), NULL);
+        for (size_t i=0; i<N; ++i) {
+            /* keep the destructed objects at odd and the plain (large)
+             * ones at even indices */
+            void* with_dtor = gc_calloc_ext(&gc_, 1, 64, dtor);
+            void* plain = gc_calloc(&gc_, 1, i % 2 ? 32 : 300);
+            keep[i] = i % 2 ? with_dtor : plain;
+        }
+        gc_mark_roots(&gc_);
+        DTOR_COUNT = 0;
+        size_t collected = gc_sweep(&gc_);
+        mu_assert(collected == N / 2 * 64 + N / 2 * 32, "Unreachable objects should be collected");
+        mu_assert(DTOR_COUNT == 0, "Destructors should not run during the sweep");
+        mu_assert(gc_.finalizers->size == N / 2, "Destructors should be queued");
+        mu_assert(gc_.allocs->size == N + 1, "Queued objects should leave the allocation map");
+        mu_assert(gc_.small->count == 0, "Unreachable small objects should be freed");
+        mu_assert(gc_run_finalizers(&gc_) == N / 2, "All queued destructors should run");
+        mu_assert(DTOR_COUNT == N / 2, "Destructors should run once");
+        mu_assert(gc_.finalizers->size == 0, "Finalizer queue should be empty");
+        gc_stop(&gc_);
+        mu_assert(DTOR_COUNT == N, "Stopping should run the remaining destructors");
+    }
+    return NULL;
+}
+
+static char* test_gc_lazy_sweep()
+{
+    GarbageCollector gc_;
+    GarbageCollectorConfig config;
+    gc_config_default(&config);
+    config.size_classes = true;
+    config.lazy_sweep = true;
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    gc_pause(&gc_);
+    size_t N = 1000;
+    void** keep = gc_malloc_static(&gc_, (N + 2) * sizeof(void*), NULL);
+    for (size_t i=0; i<N; ++i) {
+        /* keep the small objects at even and the large ones at odd indices */
+        void* large = gc_calloc(&gc_, 1, 300);
+        void* small = gc_calloc(&gc_, 1, 32);
+        keep[i] = i % 2 ? large : small;
+    }
+    keep[N] = keep[N + 1] = NULL;
+    gc_mark_roots(&gc_);
+    gc_sweep_lazy_begin(&gc_);
+    mu_assert(gc_.lazy->pending, "Sweep should be pending");
+    mu_assert(gc_.allocs->size == N + 1, "Nothing should be swept right away");
+    mu_assert(gc_.small->count == N, "No small object should be swept right away");
+
+    /* Allocations and frees while the sweep is pending */
+    keep[N] = gc_calloc(&gc_, 1, 300);
+    keep[N + 1] = gc_calloc(&gc_, 1, 32);
+    mu_assert(gc_.small->count < N + 1, "Small allocation should sweep a page of its class");
+    gc_free(&gc_, keep[0]);
+    keep[0] = NULL;
+
+    size_t steps = 0;
+    while (gc_.lazy->pending) {
+        gc_sweep_step(&gc_);
+        steps++;
+    }
+    mu_assert(steps > 1, "Sweep should take several steps");
+    mu_assert(gc_.paused, "Sweep steps should leave the collector paused");
+    mu_assert(gc_.allocs->size == N / 2 + 2, "Unreachable large objects should be swept");
+    mu_assert(gc_.small->count == N / 2, "Unreachable small objects should be swept");
+    mu_assert(gc_allocation_map_get(gc_.allocs, keep[N]) != NULL,
+              "Allocation during the sweep should survive");
+    size_t slot;
+    mu_assert(gc_small_heap_find(gc_.small, keep[N + 1], &slot) != NULL,
+              "Small allocation during the sweep should survive");
+
+    /* Collecting only marks */
+    mu_assert(gc_run(&gc_) == 0, "Lazy collection should not free memory while marking");
+    mu_assert(gc_.lazy->pending, "Collection should leave a pending sweep");
+    gc_stop(&gc_);
+    return NULL;
+}
+
+static bool _is_marked(GarbageCollector* gc, void* ptr)
+{
+    Allocation* alloc = gc_allocation_map_get(gc->allocs, ptr);
+    if (alloc) {
+        return gc_allocation_map_marked(gc->allocs, alloc);
+    }
+    size_t slot;
+    SmallPage* page = gc->small ? gc_small_heap_find(gc->small, ptr, &slot) : NULL;
+    return page && gc_bit_test(page->mark_bits, slot);
+}
+
+static char* test_gc_incremental_marking()
+{
+    for (int small = 0; small < 2; ++small) {
+        GarbageCollector gc_;
+        GarbageCollectorConfig config;
+        gc_config_default(&config);
+        config.size_classes = small;
+        config.incremental_marking = true;
+        config.mark_budget = 2;
+        gc_start_config(&gc_, __builtin_frame_address(0), &config);
+        gc_pause(&gc_);
+        /* A list of N nodes hanging off a root, x at its end refers to y */
+        size_t N = 100;
+        Node* root = gc_calloc(&gc_, 1, sizeof(Node));
+        gc_make_static(&gc_, root);
+        Node* last = root;
+        for (size_t i=0; i<N; ++i) {
+            last->next = gc_calloc(&gc_, 1, sizeof(Node));
+            last = last->next;
+        }
+        Node* x = gc_calloc(&gc_, 1, sizeof(Node));
+        Node* y = gc_calloc(&gc_, 1, sizeof(Node));
+        x->other = y;
+        last->next = x;
+        /* A large root, which is scanned in slices of the budget */
+        size_t M = 10 * N;
+        void** arr = gc_calloc(&gc_, M, sizeof(void*));
+        for (size_t i=0; i<M; ++i) {
+            arr[i] = gc_calloc(&gc_, 1, sizeof(Node));
+        }
+        gc_make_static(&gc_, arr);
+
+        /* The first step scans the root, the list is still white */
+        mu_assert(gc_step(&gc_, config.mark_budget) == 0, "A step should not free memory");
+        mu_assert(gc_is_marking(&gc_), "Collection should be marking");
+        mu_assert(_is_marked(&gc_, root), "Root should be marked");
+        mu_assert(!_is_marked(&gc_, x), "End of the list should not be marked yet");
+
+        /* Move y from the unscanned end of the list to the scanned root */
+        GC_STORE(&gc_, root, other, y);
+        GC_STORE(&gc_, x, other, NULL);
+        GC_STORE(&gc_, last, next, NULL);
+        Node* z = gc_calloc(&gc_, 1, sizeof(Node));
+        mu_assert(_is_marked(&gc_, z), "Allocation while marking should be marked");
+        /* Unlink and free a node that may still be scheduled for scanning */
+        Node* dead = root->next->next;
+        GC_STORE(&gc_, root->next, next, dead->next);
+        gc_free(&gc_, dead);
+
+        size_t steps = 1;
+        while (!gc_mark_increment(&gc_, config.mark_budget)) {
+            steps++;
+        }
+        /* Each node takes a step, the array another one per two elements */
+        mu_assert(steps >= N + M + M / 4, "Marking should take a step per budget");
+        mu_assert(_is_marked(&gc_, y), "Write barrier should keep y alive");
+        mu_assert(!_is_marked(&gc_, x), "Unlinked x should not be marked");
+        for (size_t i=0; i<M; ++i) {
+            mu_assert(_is_marked(&gc_, arr[i]), "Array elements should be marked");
+        }
+
+        gc_run(&gc_);
+        mu_assert(!gc_is_marking(&gc_), "Collection should be complete");
+        mu_assert(gc_allocation_map_get(gc_.allocs, y) ||
+                  (gc_.small && gc_small_heap_find(gc_.small, y, &(size_t){0})),
+                  "y should survive the collection");
+        gc_stop(&gc_);
+    }
+    return NULL;
+}
+
+static char* test_gc_mark_range_alignment()
+{
+    GarbageCollector gc_;
+    void *bos = __builtin_frame_address(0);
+    gc_start_ext(&gc_, bos, 32, 32, 0.0, DBL_MAX, DBL_MAX);
+    gc_pause(&gc_);
+    void* target = gc_malloc(&gc_, sizeof(int));
+    char* buf = gc_calloc(&gc_, 4, PTRSIZE);
+
+    /* A pointer at a misaligned offset is only found by unaligned scanning */
+    memcpy(buf + 1, &target, sizeof(void*));
+    gc_mark_range(&gc_, buf, 4 * PTRSIZE);
+    Allocation* a = gc_allocation_map_get(gc_.allocs, target);
+#ifdef GC_SCAN_ALIGNED
+    mu_assert(!gc_allocation_map_marked(gc_.allocs, a), "Aligned scanning should skip misaligned pointers");
+#else
+    mu_assert(gc_allocation_map_marked(gc_.allocs, a), "Unaligned scanning should find misaligned pointers");
+#endif
+    gc_allocation_map_unmark_all(gc_.allocs);
+
+    /* Scanning an unaligned range starts at the first aligned address */
+    memset(buf, 0, 4 * PTRSIZE);
+    memcpy(buf + PTRSIZE, &target, sizeof(void*));
+    gc_mark_range(&gc_, buf + 1, 4 * PTRSIZE - 1);
+    a = gc_allocation_map_get(gc_.allocs, target);
+    mu_assert(gc_allocation_map_marked(gc_.allocs, a), "Aligned pointers should always be found");
+    gc_allocation_map_unmark_all(gc_.allocs);
+    gc_.marks->size = 0;
 
     gc_stop(&gc_);
     return NULL;
 }
 
+static void _create_small_garbage(GarbageCollector* gc, size_t count)
+{
+    for (size_t i=0; i<count; ++i) {
+        gc_malloc(gc, 1 + i % GC_SMALL_MAX);
+    }
+}
+
+static char* test_gc_small_objects()
+{
+    GarbageCollector gc_;
+    GarbageCollectorConfig config;
+    gc_config_default(&config);
+    config.size_classes = true;
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    gc_pause(&gc_);
+    mu_assert(gc_size_class(1) == 0 && gc_size_class(16) == 0, "Wrong size class for 16 bytes");
+    mu_assert(gc_size_class(17) == 1, "Wrong size class for 17 bytes");
+    mu_assert(gc_size_class(100) == 5, "Wrong size class for 100 bytes");
+    mu_assert(gc_size_class(GC_SMALL_MAX) == GC_SIZE_CLASS_COUNT - 1, "Wrong size class for max size");
+
+    /* Small objects w/o destructor bypass the allocation map */
+    size_t slot;
+    Node* root = gc_calloc(&gc_, 1, sizeof(Node));
+    SmallPage* page = gc_small_heap_find(gc_.small, root, &slot);
+    mu_assert(page != NULL, "Small object should live in a size-class page");
+    mu_assert(page->slot_size == 16, "Small object should use the smallest fitting class");
+    mu_assert(gc_allocation_map_get(gc_.allocs, root) == NULL, "Small object should not be in the map");
+    mu_assert(gc_small_heap_find(gc_.small, (char*) root + 8, &slot) == NULL,
+              "Only slot starts should be found");
+    void* big = gc_malloc(&gc_, GC_SMALL_MAX + 1);
+    mu_assert(gc_allocation_map_get(gc_.allocs, big) != NULL, "Large objects should be in the map");
+    void* with_dtor = gc_malloc_ext(&gc_, 8, dtor);
+    mu_assert(gc_allocation_map_get(gc_.allocs, with_dtor) != NULL,
+              "Objects with a destructor should be in the map");
+
+    /* Freed slots are reused, calloc zeroes them */
+    Node* n = gc_malloc(&gc_, sizeof(Node));
+    n->next = root;
+    gc_free(&gc_, n);
+    mu_assert(gc_small_heap_find(gc_.small, n, &slot) == NULL, "Freed objects should not be found");
+    Node* m = gc_calloc(&gc_, 1, sizeof(Node));
+    mu_assert(m == n, "Freed slot should be reused first");
+    mu_assert(m->next == NULL && m->other == NULL, "Calloc should zero reused slots");
+
+    /* Reachable small objects survive, unreachable ones are collected */
+    gc_make_static(&gc_, root);
+    root->next = m;
+    m->other = big;
+    size_t before = gc_.small->count;
+    _create_small_garbage(&gc_, 10000);
+    mu_assert(gc_.small->count == before + 10000, "Small objects should be counted");
+    gc_mark_roots(&gc_);
+    gc_sweep(&gc_);
+    mu_assert(gc_.small->count == 2, "Only reachable small objects should survive");
+    mu_assert(gc_small_heap_find(gc_.small, root, &slot), "Root should survive");
+    mu_assert(gc_small_heap_find(gc_.small, m, &slot), "Referenced object should survive");
+    mu_assert(gc_allocation_map_get(gc_.allocs, big) != NULL, "Referenced large object should survive");
+    mu_assert(gc_.small->npages == 1, "Empty pages should be released");
+
+    /* Growing beyond the slot moves the object */
+    char* s = gc_malloc(&gc_, 10);
+    memcpy(s, "small", 6);
+    mu_assert(gc_realloc(&gc_, s, 16) == s, "Realloc within the slot should not move");
+    char* t = gc_realloc(&gc_, s, 100);
+    mu_assert(strcmp(t, "small") == 0, "Realloc should preserve the contents");
+    mu_assert(gc_small_heap_find(gc_.small, t, &slot)->slot_size == 128, "Realloc should change the class");
+    char* u = gc_realloc(&gc_, t, 1000);
+    mu_assert(strcmp(u, "small") == 0, "Realloc should preserve the contents");
+    mu_assert(gc_allocation_map_get(gc_.allocs, u) != NULL, "Large realloc should move to the map");
+
+    gc_stop(&gc_);
+    return NULL;
+}
+
+static char* test_gc_interior_pointers()
+{
+    GarbageCollector gc_;
+    GarbageCollectorConfig config;
+    gc_config_default(&config);
+    config.size_classes = true;
+    config.interior_pointers = true;
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    gc_pause(&gc_);
+
+    /* A root that only holds pointers into the middle of other objects */
+    char** root = gc_malloc_static(&gc_, 4 * sizeof(char*), NULL);
+    char* big = gc_malloc(&gc_, 1024);
+    char* small = gc_malloc(&gc_, 64);
+    char* unreferenced = gc_malloc(&gc_, 1024);
+    root[0] = big + 512;
+    root[1] = small + 63;
+    root[2] = unreferenced + 1024;  /* one past the end is not inside */
+    root[3] = NULL;
+
+    InteriorIndex* idx = gc_.interior;
+    gc_interior_index_update(idx, gc_.allocs);
+    mu_assert(idx->size == gc_.allocs->size, "Index should hold all map entries");
+    mu_assert(gc_interior_index_find(idx, big) == gc_allocation_map_get(gc_.allocs, big),
+              "Start addresses should be found");
+    mu_assert(gc_interior_index_find(idx, big + 1023) == gc_allocation_map_get(gc_.allocs, big),
+              "Last byte should be found");
+    mu_assert(gc_interior_index_find(idx, unreferenced + 1024) == NULL,
+              "One past the end should not be found");
+    size_t slot;
+    mu_assert(gc_small_heap_lookup(gc_.small, small + 8, &slot, true) != NULL,
+              "Interior lookup should find small objects");
+    mu_assert(gc_small_heap_find(gc_.small, small + 8, &slot) == NULL,
+              "Exact lookup should not find interior pointers");
+
+    gc_mark_roots(&gc_);
+    mu_assert(gc_allocation_map_marked(gc_.allocs, gc_allocation_map_get(gc_.allocs, big)),
+              "Interior pointer should mark a large object");
+    SmallPage* page = gc_small_heap_find(gc_.small, small, &slot);
+    mu_assert(gc_bit_test(page->mark_bits, slot), "Interior pointer should mark a small object");
+    mu_assert(!gc_allocation_map_marked(gc_.allocs, gc_allocation_map_get(gc_.allocs, unreferenced)),
+              "Pointer past the end should not mark");
+    size_t collected = gc_sweep(&gc_);
+    mu_assert(collected == 1024, "Only the unreferenced object should be collected");
+
+    /* The index is rebuilt after the map changed */
+    char* later = gc_malloc(&gc_, 512);
+    root[3] = later + 100;
+    gc_mark_roots(&gc_);
+    mu_assert(gc_allocation_map_marked(gc_.allocs, gc_allocation_map_get(gc_.allocs, later)),
+              "Index should be rebuilt for new allocations");
+    gc_sweep(&gc_);
+    gc_stop(&gc_);
+
+    /* Interior pointers do not keep objects alive by default */
+    gc_start(&gc_, __builtin_frame_address(0));
+    gc_pause(&gc_);
+    root = gc_malloc_static(&gc_, sizeof(char*), NULL);
+    root[0] = (char*) gc_malloc(&gc_, 1024) + 8;
+    gc_mark_roots(&gc_);
+    collected = gc_sweep(&gc_);
+    mu_assert(collected == 1024, "Interior pointers should be ignored by default");
+    gc_stop(&gc_);
+    return NULL;
+}
 
 static char* test_gc_basic_alloc_free()
 {
@@ -272,14 +942,13 @@ static char* test_gc_basic_alloc_free()
     /* Test that all managed allocations get tagged if the root is present */
     gc_mark(&gc_);
     for (size_t i=0; i<gc_.allocs->capacity; ++i) {
-        Allocation* chunk = gc_.allocs->allocs[i];
-        while (chunk) {
-            mu_assert(chunk->tag & GC_TAG_MARK, "Referenced allocs should be marked");
-            // reset for next test
-            chunk->tag = GC_TAG_NONE;
-            chunk = chunk->next;
+        Allocation* chunk = &gc_.allocs->allocs[i];
+        if (chunk->ptr) {
+            mu_assert(gc_allocation_map_marked(gc_.allocs, chunk), "Referenced allocs should be marked");
         }
     }
+    // reset for next test
+    gc_allocation_map_unmark_all(gc_.allocs);
 
     /* Now drop the root allocation */
     ints = NULL;
@@ -288,11 +957,10 @@ static char* test_gc_basic_alloc_free()
     /* Check that none of the allocations get tagged */
     size_t total = 0;
     for (size_t i=0; i<gc_.allocs->capacity; ++i) {
-        Allocation* chunk = gc_.allocs->allocs[i];
-        while (chunk) {
-            mu_assert(!(chunk->tag & GC_TAG_MARK), "Unreferenced allocs should not be marked");
+        Allocation* chunk = &gc_.allocs->allocs[i];
+        if (chunk->ptr) {
+            mu_assert(!gc_allocation_map_marked(gc_.allocs, chunk), "Unreferenced allocs should not be marked");
             total += chunk->size;
-            chunk = chunk->next;
         }
     }
     mu_assert(total == 16 * sizeof(int) + 16 * sizeof(int*),
@@ -336,13 +1004,12 @@ static char* test_gc_static_allocation()
     size_t total = 0;
     size_t n = 0;
     for (size_t i=0; i<gc_.allocs->capacity; ++i) {
-        Allocation* chunk = gc_.allocs->allocs[i];
-        while (chunk) {
-            mu_assert(!(chunk->tag & GC_TAG_MARK), "Marked an unused alloc");
+        Allocation* chunk = &gc_.allocs->allocs[i];
+        if (chunk->ptr) {
+            mu_assert(!gc_allocation_map_marked(gc_.allocs, chunk), "Marked an unused alloc");
             mu_assert(!(chunk->tag & GC_TAG_ROOT), "Unrooting failed");
             total += chunk->size;
             n++;
-            chunk = chunk->next;
         }
     }
     mu_assert(n == N, "Expected number of allocations is off");
@@ -395,6 +1062,16 @@ static char* test_gc_realloc()
         mu_assert(a->size == 42*sizeof(int*), "Wrong allocation size");
     }
 
+    /* the live bytes follow the new sizes, whether the memory moved or not */
+    {
+        size_t before = gc_.allocs->bytes;
+        char* chars = gc_malloc(&gc_, 4096);
+        chars = gc_realloc(&gc_, chars, 64);
+        mu_assert(gc_.allocs->bytes == before + 64, "Wrong live bytes after shrinking");
+        chars = gc_realloc(&gc_, chars, 8192);
+        mu_assert(gc_.allocs->bytes == before + 8192, "Wrong live bytes after growing");
+    }
+
     gc_stop(&gc_);
     return NULL;
 }
@@ -431,6 +1108,21 @@ static char* test_gc_pause_resume()
     return NULL;
 }
 
+/*
+ * Zero the stack region that the next test's frame will occupy. Pointers
+ * left behind by a previous test may refer to addresses that malloc hands
+ * out again and would be picked up by the conservative stack scan.
+ */
+static void scrub_stack()
+{
+    /* static loop index, so the buffer is the only local in this frame */
+    static size_t i;
+    volatile char buf[16384];
+    for (i=0; i<sizeof(buf); ++i) {
+        buf[i] = 0;
+    }
+}
+
 static char* duplicate_string(GarbageCollector* gc, char* str)
 {
     char* copy = (char*) gc_strdup(gc, str);
@@ -446,33 +1138,986 @@ char* test_gc_strdup()
     char* str = "This is a string";
     char* error = duplicate_string(&gc_, str);
     mu_assert(error == NULL, "Duplication failed"); // cascade minunit tests
+    /* the copy must not survive in a dead frame of the allocation path */
+    scrub_stack();
     size_t collected = gc_run(&gc_);
     mu_assert(collected == 17, "Unexpected number of collected bytes in strdup");
     gc_stop(&gc_);
     return NULL;
 }
 
+static void _create_young_garbage(GarbageCollector* gc, size_t count)
+{
+    for (size_t i=0; i<count; ++i) {
+        gc_calloc(gc, 1, sizeof(Node));
+    }
+}
+
+static size_t _managed(GarbageCollector* gc)
+{
+    return gc->allocs->size + (gc->small ? gc->small->count : 0);
+}
+
+static char* test_gc_generational()
+{
+    for (int small = 0; small < 2; ++small) {
+        GarbageCollector gc_;
+        GarbageCollectorConfig config;
+        gc_config_default(&config);
+        config.size_classes = small;
+        config.generational = true;
+        config.nursery_size = 1 << 20;
+        config.promotion_age = 2;
+        gc_start_config(&gc_, __builtin_frame_address(0), &config);
+        /* An old root o refers to a young object y1, which refers to y2 */
+        Node* o = gc_calloc(&gc_, 1, sizeof(Node));
+        gc_make_static(&gc_, o);
+        mu_assert(!gc_is_young(&gc_, o), "Roots should be old");
+        gc_run_minor(&gc_);
+        mu_assert(gc_.gen->nremembered == 0, "o should not stay remembered");
+        Node* y1 = gc_calloc(&gc_, 1, sizeof(Node));
+        Node* y2 = gc_calloc(&gc_, 1, sizeof(Node));
+        mu_assert(gc_is_young(&gc_, y1), "New objects should be young");
+        GC_STORE(&gc_, y1, next, y2);
+        mu_assert(gc_.gen->nremembered == 0, "Stores into young objects should not be remembered");
+        GC_STORE(&gc_, o, next, y1);
+        GC_STORE(&gc_, o, other, y1);
+        mu_assert(gc_.gen->nremembered == 1, "Stores into old objects should be remembered");
+
+        _create_young_garbage(&gc_, 100);
+        scrub_stack();
+        size_t before = _managed(&gc_);
+        gc_run_minor(&gc_);
+        mu_assert(_managed(&gc_) == before - 100, "Minor collection should free young garbage");
+        mu_assert(gc_is_young(&gc_, y1) && gc_is_young(&gc_, y2), "Survivors should stay young");
+        mu_assert(gc_.gen->nremembered == 1, "o should stay remembered");
+
+        gc_run_minor(&gc_);
+        mu_assert(!gc_is_young(&gc_, y1) && !gc_is_young(&gc_, y2), "Survivors should be promoted");
+        mu_assert(gc_.gen->nyoung == 0, "Nursery should be empty");
+        mu_assert(gc_.gen->nremembered == 0, "Remembered set should be empty");
+
+        /* Unreachable old objects are only freed by a major collection */
+        GC_STORE(&gc_, o, next, NULL);
+        GC_STORE(&gc_, o, other, NULL);
+        y1 = y2 = NULL;
+        scrub_stack();
+        before = _managed(&gc_);
+        gc_run_minor(&gc_);
+        mu_assert(_managed(&gc_) == before, "Minor collection should not free old objects");
+        gc_run(&gc_);
+        mu_assert(_managed(&gc_) == before - 2, "Major collection should free old garbage");
+        gc_stop(&gc_);
+    }
+    return NULL;
+}
+
+#ifndef GC_NO_THREADS
+typedef struct {
+    GarbageCollector* gc;
+    size_t id;
+    bool ok;
+} MutatorArgs;
+
+static void* _mutate(void* arg)
+{
+    MutatorArgs* args = arg;
+    GarbageCollector* gc = args->gc;
+    gc_register_thread(gc, __builtin_frame_address(0));
+    /* A list that is only reachable from this thread's stack; the tag in
+     * `other` is odd and never a valid pointer */
+    Node* head = NULL;
+    for (size_t i=0; i<256; ++i) {
+        Node* node = gc_calloc(gc, 1, sizeof(Node));
+        GC_STORE(gc, node, next, head);
+        node->other = (Node*) (uintptr_t) ((args->id << 16 | i) << 1 | 1);
+        head = node;
+        _create_young_garbage(gc, 64);
+        if (i % 32 == 0) {
+            gc_run(gc);
+        }
+    }
+    args->ok = true;
+    size_t i = 256;
+    for (Node* node = head; node; node = node->next) {
+        --i;
+        if ((uintptr_t) node->other != ((args->id << 16 | i) << 1 | 1)) {
+            args->ok = false;
+        }
+    }
+    args->ok = args->ok && i == 0;
+    gc_unregister_thread(gc);
+    return NULL;
+}
+
+static char* test_gc_multi_threaded()
+{
+    /* malloc'ed objects, size classes, size classes with thread caches,
+     * size classes with concurrent marking */
+    for (int mode = 0; mode < 4; ++mode) {
+        GarbageCollector gc_;
+        GarbageCollectorConfig config;
+        gc_config_default(&config);
+        config.size_classes = mode > 0;
+        config.multi_threaded = true;
+        config.thread_caches = mode == 2;
+        config.concurrent_marking = mode == 3;
+        gc_start_config(&gc_, __builtin_frame_address(0), &config);
+        mu_assert(gc_.threads->nthreads == 1, "The starting thread should be registered");
+
+        pthread_t threads[4];
+        MutatorArgs args[4];
+        for (size_t i=0; i<4; ++i) {
+            args[i] = (MutatorArgs) { .gc = &gc_, .id = i, .ok = false };
+            pthread_create(&threads[i], NULL, _mutate, &args[i]);
+        }
+        for (size_t i=0; i<4; ++i) {
+            pthread_join(threads[i], NULL);
+            mu_assert(args[i].ok, "Lists on mutator stacks should survive collections");
+        }
+        mu_assert(gc_.threads->nthreads == 1, "Mutators should be unregistered");
+        scrub_stack();
+        gc_run(&gc_);
+        mu_assert(_managed(&gc_) == 0, "Lists of exited mutators should be collected");
+        gc_stop(&gc_);
+    }
+    return NULL;
+}
+
+static char* test_gc_concurrent_marking()
+{
+    for (int small = 0; small < 2; ++small) {
+        GarbageCollector gc_;
+        GarbageCollectorConfig config;
+        gc_config_default(&config);
+        config.size_classes = small;
+        config.concurrent_marking = true;
+        gc_start_config(&gc_, __builtin_frame_address(0), &config);
+        mu_assert(gc_.incremental && gc_.incremental->background,
+                  "Background marker should be running");
+        gc_pause(&gc_);
+        Node* head = NULL;
+        for (size_t i=0; i<1000; ++i) {
+            Node* node = gc_calloc(&gc_, 1, sizeof(Node));
+            node->next = head;
+            head = node;
+        }
+        _create_young_garbage(&gc_, 100);
+        scrub_stack();
+        size_t before = _managed(&gc_);
+
+        /* Starting the mark only scans roots and stacks */
+        mu_assert(gc_step(&gc_, 1) == 0, "Starting a mark should not free memory");
+        mu_assert(gc_.incremental->marking, "Mark should be in progress");
+        size_t pending;
+        do {
+            sched_yield();
+            gc_lock(&gc_);
+            pending = gc_.marks->size;
+            gc_unlock(&gc_);
+        } while (pending);
+        bool all = true;
+        for (Node* node = head; node; node = node->next) {
+            all = all && _is_marked(&gc_, node);
+        }
+        mu_assert(all, "The background thread should mark the list");
+
+        /* Stores while marking go through the barrier. The lock keeps the
+         * background thread from rescanning the list head right away. */
+        Node* fresh = gc_calloc(&gc_, 1, sizeof(Node));
+        gc_lock(&gc_);
+        GC_STORE(&gc_, head, other, fresh);
+        pending = gc_.marks->size;
+        gc_unlock(&gc_);
+        mu_assert(pending > 0, "The barrier should rescan the list head");
+        fresh = NULL;
+        scrub_stack();
+        while (gc_.incremental->marking) {
+            gc_step(&gc_, 1);
+            sched_yield();
+        }
+        mu_assert(_managed(&gc_) == before - 100 + 1, "Only the garbage should be freed");
+        mu_assert(_is_marked(&gc_, head->other) == false, "Marks should be cleared");
+        gc_stop(&gc_);
+    }
+    return NULL;
+}
+
+static char* test_gc_thread_caches()
+{
+    GarbageCollector gc_;
+    GarbageCollectorConfig config;
+    gc_config_default(&config);
+    config.size_classes = true;
+    config.multi_threaded = true;
+    config.thread_caches = true;
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    mu_assert(gc_.threads->caching, "Thread caches should be enabled");
+    ThreadCache* cache = gc_.threads->threads[0].cache;
+    unsigned int size_class = gc_size_class(sizeof(Node));
+
+    /* The first allocation reserves a batch, the next ones take from it */
+    gc_calloc(&gc_, 1, sizeof(Node));
+    mu_assert(cache->nslots[size_class] == GC_THREAD_CACHE_SIZE, "Cache should be filled");
+    mu_assert(gc_.small->count == GC_THREAD_CACHE_SIZE + 1, "Cached slots count as allocated");
+    Node* node = gc_calloc(&gc_, 1, sizeof(Node));
+    mu_assert(cache->nslots[size_class] == GC_THREAD_CACHE_SIZE - 1, "Cache should be used");
+    mu_assert(gc_.small->count == GC_THREAD_CACHE_SIZE + 1, "Cached allocations take no slots");
+    mu_assert(node->next == NULL && node->other == NULL, "Cached calloc should zero");
+
+    /* Cached slots survive collections, garbage does not */
+    node = NULL;
+    scrub_stack();
+    gc_run(&gc_);
+    mu_assert(gc_.small->count == GC_THREAD_CACHE_SIZE - 1, "Only cached slots should survive");
+
+    /* Unregistering returns the cached slots */
+    gc_unregister_thread(&gc_);
+    mu_assert(gc_.small->count == 0, "Cached slots should be released");
+    gc_stop(&gc_);
+
+    /* Thread caches need size classes */
+    config.size_classes = false;
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    mu_assert(!gc_.threads->caching, "Thread caches should be disabled");
+    mu_assert(gc_malloc(&gc_, 16) != NULL, "Allocation should take the locked path");
+    gc_stop(&gc_);
+    return NULL;
+}
+#endif
+
+static char* test_gc_stats()
+{
+    for (int small = 0; small < 2; ++small) {
+        GarbageCollector gc_;
+        GarbageCollectorConfig config;
+        gc_config_default(&config);
+        config.size_classes = small;
+        gc_start_config(&gc_, __builtin_frame_address(0), &config);
+        GarbageCollectorStats stats;
+        gc_stats(&gc_, &stats);
+        mu_assert(stats.collections == 0 && stats.live_objects == 0 && stats.live_bytes == 0,
+                  "A new collector should have empty statistics");
+
+        void** live = gc_malloc_static(&gc_, 10 * sizeof(void*), NULL);
+        for (size_t i=0; i<10; ++i) {
+            live[i] = gc_calloc(&gc_, 1, 64);
+        }
+        for (size_t i=0; i<20; ++i) {
+            gc_malloc(&gc_, 32);
+        }
+        scrub_stack();
+        gc_stats(&gc_, &stats);
+        size_t bytes = stats.live_bytes;
+        mu_assert(stats.live_objects == 31, "All allocations should be live");
+        mu_assert(bytes >= 10 * sizeof(void*) + 10 * 64 + 20 * 32, "Live bytes should add up");
+
+        gc_run(&gc_);
+        gc_stats(&gc_, &stats);
+        mu_assert(stats.collections == 1, "One collection should have run");
+        mu_assert(stats.last_freed_objects == 20 && stats.freed_objects == 20,
+                  "The garbage should be counted as freed");
+        mu_assert(stats.last_freed_bytes == 20 * 32 && stats.freed_bytes == 20 * 32,
+                  "The freed bytes should be counted");
+        mu_assert(stats.live_objects == 11 && stats.live_bytes == bytes - 20 * 32,
+                  "The survivors should be live");
+        mu_assert(stats.peak_bytes == bytes, "The peak should be taken before the sweep");
+        mu_assert(stats.last_mark_ns == stats.mark_ns && stats.last_sweep_ns == stats.sweep_ns,
+                  "The only collection should be the last one");
+        mu_assert(stats.map_size == (small ? 0 : 11), "Map entries should be counted");
+        mu_assert(stats.map_load_factor == (double) stats.map_size / stats.map_capacity,
+                  "Load factor should match the map");
+        mu_assert((stats.map_max_probe > 0) == !small, "Probe length should cover the entries");
+
+        gc_run(&gc_);
+        gc_stats(&gc_, &stats);
+        mu_assert(stats.collections == 2, "Two collections should have run");
+        mu_assert(stats.last_freed_objects == 0 && stats.freed_objects == 20,
+                  "Last-cycle counters should be reset");
+        gc_stop(&gc_);
+    }
+    return NULL;
+}
+
+typedef struct HookLog {
+    GarbageCollectorEvent events[64];
+    size_t count;
+} HookLog;
+
+static void _log_event(GarbageCollector* gc, const GarbageCollectorEvent* event, void* data)
+{
+    (void) gc;
+    HookLog* log = (HookLog*) data;
+    if (log->count < 64) {
+        log->events[log->count++] = *event;
+    }
+}
+
+static char* test_gc_hooks()
+{
+    GarbageCollector gc_;
+    GarbageCollectorConfig config;
+    gc_config_default(&config);
+    config.initial_capacity = 8;
+    config.min_capacity = 8;
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    HookLog log = {0};
+    mu_assert(!gc_register_hook(&gc_, GC_EVENT_COUNT, _log_event, &log),
+              "Unknown event types should be rejected");
+    for (int type = 0; type < GC_EVENT_COUNT; ++type) {
+        mu_assert(gc_register_hook(&gc_, (GarbageCollectorEventType) type, _log_event, &log),
+                  "Hooks should be registered");
+    }
+
+    /* The map grows past its initial capacity */
+    gc_pause(&gc_);
+    for (size_t i=0; i<20; ++i) {
+        gc_malloc(&gc_, 32);
+    }
+    gc_resume(&gc_);
+    mu_assert(log.count > 0, "Resizing the map should be reported");
+    for (size_t i=0; i<log.count; ++i) {
+        mu_assert(log.events[i].type == GC_EVENT_MAP_RESIZE, "Only resizes should be reported");
+        mu_assert(log.events[i].map_capacity > log.events[i].map_old_capacity,
+                  "The map should have grown");
+    }
+
+    scrub_stack();
+    log.count = 0;
+    gc_run(&gc_);
+    GarbageCollectorStats stats;
+    gc_stats(&gc_, &stats);
+    mu_assert(log.count >= 3, "A collection should report its phases");
+    mu_assert(log.events[0].type == GC_EVENT_CYCLE_START && !log.events[0].minor &&
+              log.events[0].live_objects == 20, "The collection should start with the garbage");
+    mu_assert(log.events[1].type == GC_EVENT_MARK_END &&
+              log.events[1].duration_ns == stats.last_mark_ns, "Marking should end next");
+    /* The map shrinks as the sweep ends */
+    GarbageCollectorEvent* end = &log.events[log.count - 1];
+    for (size_t i=2; i<log.count - 1; ++i) {
+        mu_assert(log.events[i].type == GC_EVENT_MAP_RESIZE, "The sweep may resize the map");
+    }
+    mu_assert(end->type == GC_EVENT_SWEEP_END && end->duration_ns == stats.last_sweep_ns,
+              "The sweep should end last");
+    mu_assert(end->freed_objects == 20 && end->freed_bytes == 20 * 32 && end->live_objects == 0,
+              "The sweep should report the freed garbage");
+    mu_assert(log.events[0].time_ns <= log.events[1].time_ns &&
+              log.events[1].time_ns <= end->time_ns, "Events should be in order");
+
+    for (int type = 0; type < GC_EVENT_COUNT; ++type) {
+        mu_assert(gc_unregister_hook(&gc_, (GarbageCollectorEventType) type, _log_event, &log),
+                  "Hooks should be unregistered");
+    }
+    mu_assert(!gc_unregister_hook(&gc_, GC_EVENT_MARK_END, _log_event, &log),
+              "Hooks should only be unregistered once");
+    log.count = 0;
+    for (size_t i=0; i<20; ++i) {
+        gc_malloc(&gc_, 32);
+    }
+    gc_run(&gc_);
+    mu_assert(log.count == 0, "Unregistered hooks should not be called");
+    gc_stop(&gc_);
+
+    /* Minor collections are flagged as such */
+    gc_config_default(&config);
+    config.generational = true;
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    gc_register_hook(&gc_, GC_EVENT_CYCLE_START, _log_event, &log);
+    gc_register_hook(&gc_, GC_EVENT_SWEEP_END, _log_event, &log);
+    gc_malloc(&gc_, 32);
+    scrub_stack();
+    gc_run_minor(&gc_);
+    mu_assert(log.count == 2 && log.events[0].minor && log.events[1].minor,
+              "A minor collection should be reported");
+    mu_assert(log.events[1].freed_objects == 1, "The nursery sweep should free the garbage");
+    gc_run(&gc_);
+    mu_assert(log.count == 4 && !log.events[2].minor && !log.events[3].minor,
+              "A full collection should be reported");
+    gc_stop(&gc_);
+    return NULL;
+}
+
+typedef struct RecordNode {
+    struct RecordNode* next;
+} RecordNode;
+
+static char* test_gc_record()
+{
+    GarbageCollector gc_;
+    GarbageCollectorConfig config;
+    gc_config_default(&config);
+    config.size_classes = true;
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    FILE* out = tmpfile();
+    mu_assert(out != NULL, "The trace file should be created");
+    mu_assert(gc_record(&gc_, out), "Recording should be compiled in");
+
+    /* The expected lines are formatted as we go, which does not leave
+     * pointers to the garbage on the stack */
+    char expected[8][64];
+    char dead[2][64];
+    RecordNode* a = gc_malloc(&gc_, sizeof(RecordNode));
+    RecordNode* b = gc_calloc_ext(&gc_, 1, 512, dtor);
+    snprintf(expected[0], 64, "m %" PRIxPTR " %zu 0", (uintptr_t) a, sizeof(RecordNode));
+    snprintf(expected[1], 64, "c %" PRIxPTR " 1 512 %" PRIxPTR, (uintptr_t) b, (uintptr_t) dtor);
+    GC_STORE(&gc_, a, next, b);
+    snprintf(expected[2], 64, "s %" PRIxPTR " 0 %" PRIxPTR, (uintptr_t) a, (uintptr_t) b);
+    char* c = gc_realloc(&gc_, NULL, 300);
+    snprintf(expected[3], 64, "r 0 %" PRIxPTR " 300", (uintptr_t) c);
+    char* d = gc_realloc(&gc_, c, 600);
+    snprintf(expected[4], 64, "r %" PRIxPTR " %" PRIxPTR " 600", (uintptr_t) c, (uintptr_t) d);
+    void* root = gc_malloc_static(&gc_, 32, NULL);
+    snprintf(expected[5], 64, "m %" PRIxPTR " 32 0", (uintptr_t) root);
+    snprintf(expected[6], 64, "R %" PRIxPTR, (uintptr_t) root);
+    gc_free(&gc_, d);
+    snprintf(expected[7], 64, "f %" PRIxPTR, (uintptr_t) d);
+    snprintf(dead[0], 64, "d %" PRIxPTR, (uintptr_t) a);
+    snprintf(dead[1], 64, "d %" PRIxPTR, (uintptr_t) b);
+    a = b = NULL;
+    c = d = NULL;
+    scrub_stack();
+    gc_run(&gc_);
+    gc_record(&gc_, NULL);
+    /* Nothing is recorded after recording stopped */
+    gc_malloc(&gc_, 8);
+
+    rewind(out);
+    char line[128];
+    mu_assert(fgets(line, sizeof(line), out) && strcmp(line, "# gc trace 1\n") == 0,
+              "The trace should start with a header");
+    for (size_t i = 0; i < 8; ++i) {
+        mu_assert(fgets(line, sizeof(line), out), "Every operation should be recorded");
+        line[strcspn(line, "\n")] = '\0';
+        mu_assert(strcmp(line, expected[i]) == 0, "Operations should be recorded in order");
+    }
+    /* The sweep may find the garbage in any order */
+    size_t deaths = 0;
+    while (fgets(line, sizeof(line), out)) {
+        line[strcspn(line, "\n")] = '\0';
+        mu_assert(strcmp(line, dead[0]) == 0 || strcmp(line, dead[1]) == 0,
+                  "Only the garbage should be recorded as dead");
+        deaths++;
+    }
+    mu_assert(deaths == 2, "The sweep should record the deaths");
+    fclose(out);
+    gc_stop(&gc_);
+    return NULL;
+}
+
+#ifndef GC_NO_THREADS
+/*
+ * A set of addresses for checking traces, with open addressing and
+ * tombstones (1) for removed addresses.
+ */
+#define RECORD_SET_SIZE (1 << 18)
+
+static bool _record_set_update(uintptr_t* set, uintptr_t addr, bool insert)
+{
+    size_t i = (size_t) ((addr >> 4) * 11400714819323198485ull >> 46);
+    size_t empty = RECORD_SET_SIZE;
+    for (; set[i]; i = (i + 1) & (RECORD_SET_SIZE - 1)) {
+        if (set[i] == addr) {
+            if (!insert) {
+                set[i] = 1;
+            }
+            return !insert;
+        }
+        if (set[i] == 1 && empty == RECORD_SET_SIZE) {
+            empty = i;
+        }
+    }
+    if (insert) {
+        set[empty < RECORD_SET_SIZE ? empty : i] = addr;
+    }
+    return insert;
+}
+
+static char* test_gc_record_threads()
+{
+    /* Allocations from thread caches are recorded in the same order as
+     * the frees and deaths found by collections on other threads */
+    GarbageCollector gc_;
+    GarbageCollectorConfig config;
+    gc_config_default(&config);
+    config.size_classes = true;
+    config.multi_threaded = true;
+    config.thread_caches = true;
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    FILE* out = tmpfile();
+    gc_record(&gc_, out);
+    pthread_t threads[4];
+    MutatorArgs args[4];
+    for (size_t i=0; i<4; ++i) {
+        args[i] = (MutatorArgs) { .gc = &gc_, .id = i, .ok = false };
+        pthread_create(&threads[i], NULL, _mutate, &args[i]);
+    }
+    for (size_t i=0; i<4; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    gc_record(&gc_, NULL);
+    gc_stop(&gc_);
+
+    rewind(out);
+    uintptr_t* live = calloc(RECORD_SET_SIZE, sizeof(uintptr_t));
+    char line[128];
+    size_t allocations = 0;
+    bool ordered = true;
+    mu_assert(fgets(line, sizeof(line), out) != NULL, "The trace should have a header");
+    while (fgets(line, sizeof(line), out)) {
+        uintptr_t addr, other;
+        size_t count, size;
+        if (sscanf(line, "c %" SCNxPTR " %zu %zu %" SCNxPTR, &addr, &count, &size, &other) == 4) {
+            ordered = ordered && _record_set_update(live, addr, true);
+            allocations++;
+        } else if (sscanf(line, "d %" SCNxPTR, &addr) == 1) {
+            ordered = ordered && _record_set_update(live, addr, false);
+        } else {
+            mu_assert(sscanf(line, "s %" SCNxPTR " %zu %" SCNxPTR, &addr, &size, &other) == 3,
+                      "Every line should be a complete event");
+        }
+    }
+    free(live);
+    fclose(out);
+    mu_assert(allocations == 4 * 256 * 65, "Every allocation should be recorded");
+    mu_assert(ordered, "Deaths should follow the allocations of their objects");
+    return NULL;
+}
+#endif
+
+static uint64_t _read_varint(FILE* in)
+{
+    uint64_t value = 0;
+    int c;
+    for (unsigned int shift = 0; (c = getc(in)) != EOF; shift += 7) {
+        value |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            break;
+        }
+    }
+    return value;
+}
+
+typedef struct DumpNode {
+    struct DumpNode* next;
+    char data[24];
+} DumpNode;
+
+static char* test_gc_dump_heap()
+{
+    /* Once more with a multi-threaded collector, whose thread caches hold
+     * free slots that are not objects. The stack holds more references
+     * than the initial buffer for them. */
+#ifndef GC_NO_THREADS
+    size_t rounds = 2;
+#else
+    size_t rounds = 1;
+#endif
+    for (size_t round = 0; round < rounds; ++round) {
+        GarbageCollector gc_;
+        GarbageCollectorConfig config;
+        gc_config_default(&config);
+        config.size_classes = true;
+        config.multi_threaded = round == 1;
+        config.thread_caches = round == 1;
+        gc_start_config(&gc_, __builtin_frame_address(0), &config);
+        DumpNode** root = gc_malloc_static(&gc_, 2 * sizeof(DumpNode*), NULL);
+        root[0] = gc_malloc_ext(&gc_, 512, dtor);
+        root[0]->next = gc_calloc(&gc_, 1, sizeof(DumpNode));
+        root[1] = root[0]->next;
+        mu_assert(round == 0 || gc_.small->count > 2, "Thread caches should hold free slots");
+        void* volatile refs[2 * GC_DUMP_ROOTS_CAPACITY];
+        for (size_t i = 0; i < 2 * GC_DUMP_ROOTS_CAPACITY; ++i) {
+            refs[i] = root;
+        }
+        (void) refs;
+        FILE* out = tmpfile();
+        mu_assert(out != NULL, "The dump file should be created");
+        size_t count = gc_dump_heap(&gc_, out);
+        mu_assert(count == 3, "All objects should be dumped");
+
+        rewind(out);
+        char magic[8];
+        mu_assert(fread(magic, 1, 8, out) == 8 && memcmp(magic, GC_DUMP_MAGIC, 8) == 0,
+                  "The dump should start with the magic bytes");
+        size_t objects = 0;
+        bool roots = false;
+        size_t nroots = 0;
+        int type;
+        while ((type = getc(out)) == GC_DUMP_OBJECT) {
+            void* ptr = (void*) (uintptr_t) _read_varint(out);
+            size_t size = (size_t) _read_varint(out);
+            int flags = getc(out);
+            uintptr_t dtor_addr = (uintptr_t) _read_varint(out);
+            void* edges[4];
+            size_t nedges = 0;
+            for (uint64_t e; (e = _read_varint(out)) != 0; ) {
+                mu_assert(nedges < 4, "Only the stored pointers should be edges");
+                edges[nedges++] = (void*) (uintptr_t) e;
+            }
+            if (ptr == root) {
+                mu_assert(size == 2 * sizeof(DumpNode*) && !dtor_addr &&
+                          flags == (GC_DUMP_ROOT | GC_DUMP_SMALL),
+                          "The root should be dumped with its flags");
+                mu_assert(nedges == 2 && edges[0] == root[0] && edges[1] == root[1],
+                          "The references of the root should be dumped");
+            } else if (ptr == root[0]) {
+                mu_assert(size == 512 && flags == 0 && dtor_addr == (uintptr_t) dtor,
+                          "Large objects should be dumped with their destructor");
+                mu_assert(nedges == 1 && edges[0] == root[1], "References should be dumped");
+            } else {
+                mu_assert(ptr == root[1] && flags == GC_DUMP_SMALL && size == sizeof(DumpNode) &&
+                          nedges == 0, "Small objects should be dumped");
+            }
+            objects++;
+        }
+        mu_assert(objects == 3, "Every object should have a record");
+        if (type == GC_DUMP_ROOTS) {
+            /* The stack refers to the root at least */
+            for (uint64_t e; (e = _read_varint(out)) != 0; ) {
+                roots = roots || (void*) (uintptr_t) e == root;
+                nroots++;
+            }
+            type = getc(out);
+        }
+        mu_assert(roots, "The references from the stack should be dumped");
+        mu_assert(nroots >= 2 * GC_DUMP_ROOTS_CAPACITY,
+                  "All references from the stack should be dumped");
+        mu_assert(type == GC_DUMP_END && _read_varint(out) == 3 && getc(out) == EOF,
+                  "The dump should end with the object count");
+        fclose(out);
+        gc_stop(&gc_);
+    }
+    return NULL;
+}
+
+static void _profile_garbage(GarbageCollector* gc, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        gc_malloc(gc, 64);
+    }
+}
+
+static void _profile_keep(GarbageCollector* gc, void** keep, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        keep[i] = gc_malloc(gc, 64);
+    }
+}
+
+static double _folded_total(GarbageCollector* gc, GarbageCollectorProfileFormat format)
+{
+    FILE* out = tmpfile();
+    gc_profile_write(gc, out, format);
+    rewind(out);
+    char line[4096];
+    double total = 0;
+    while (fgets(line, sizeof(line), out)) {
+        char* value = strrchr(line, ' ');
+        total += value ? atof(value + 1) : 0;
+    }
+    fclose(out);
+    return total;
+}
+
+static char* test_gc_profile()
+{
+    GarbageCollector gc_;
+    GarbageCollectorConfig config;
+    gc_config_default(&config);
+    mu_assert(config.sample_interval == 0, "Profiling should be off by default");
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    mu_assert(!gc_profile_write(&gc_, stdout, GC_PROFILE_PPROF),
+              "There should be no profile without sampling");
+    gc_stop(&gc_);
+
+    /* Allocations of 64 bytes are (almost) always sampled at this rate */
+    config.sample_interval = 1;
+    config.size_classes = true;
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    Profiler* p = gc_.profile;
+    mu_assert(p != NULL, "Profiling should be enabled");
+    void** keep = gc_malloc_static(&gc_, 64, NULL);
+    _profile_garbage(&gc_, 10);
+    _profile_keep(&gc_, keep, 5);
+    size_t allocated = 0;
+    for (size_t i = 0; i < p->nsites; ++i) {
+        allocated += p->sites[i].allocated_samples;
+    }
+    mu_assert(allocated == 16 && p->nsamples == 16, "All allocations should be sampled");
+#ifdef GC_HAVE_BACKTRACE
+    mu_assert(p->nsites >= 3, "Every call site should have its own stacks");
+#endif
+
+    scrub_stack();
+    gc_run(&gc_);
+    size_t live = 0, live_size = 0;
+    for (size_t i = 0; i < p->nsites; ++i) {
+        live += p->sites[i].live_samples;
+        live_size += p->sites[i].live_size;
+    }
+    mu_assert(p->nsamples == 6 && live == 6 && live_size == 6 * 64,
+              "Only the surviving samples should stay live");
+    for (size_t i = 0; i < 5; ++i) {
+        mu_assert(gc_profile_find(p, keep[i]) != NULL, "Survivors should be tracked");
+    }
+    gc_free(&gc_, keep[4]);
+    keep[4] = NULL;
+    mu_assert(p->nsamples == 5, "Freed objects should be dropped");
+
+    double total = _folded_total(&gc_, GC_PROFILE_FOLDED_ALLOCATED);
+    mu_assert(total > 16 * 64 - 1 && total < 16 * 64 + 1, "Allocated bytes should be estimated");
+    total = _folded_total(&gc_, GC_PROFILE_FOLDED_LIVE);
+    mu_assert(total > 5 * 64 - 1 && total < 5 * 64 + 1, "Live bytes should be estimated");
+
+    FILE* out = tmpfile();
+    mu_assert(gc_profile_write(&gc_, out, GC_PROFILE_PPROF), "The profile should be written");
+    rewind(out);
+    size_t counts[4];
+    size_t interval;
+    mu_assert(fscanf(out, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu", &counts[0],
+                     &counts[1], &counts[2], &counts[3], &interval) == 5,
+              "The pprof profile should start with a header");
+    mu_assert(counts[0] == 5 && counts[1] == 5 * 64 && counts[2] == 16 && counts[3] == 16 * 64 &&
+              interval == 1, "The header should sum up the samples");
+    fclose(out);
+    gc_stop(&gc_);
+    return NULL;
+}
+
+static void _pacer_garbage(GarbageCollector* gc, size_t n, size_t size)
+{
+    for (size_t i = 0; i < n; ++i) {
+        gc_malloc(gc, size);
+    }
+}
+
+/*
+ * Start a collector with the byte trigger, keep `keep` bytes alive and
+ * return the trigger set by a collection.
+ */
+static size_t _pacer_trigger(size_t growth, size_t limit, size_t keep, size_t* live)
+{
+    GarbageCollector gc_;
+    GarbageCollectorConfig config;
+    gc_config_default(&config);
+    config.heap_growth = growth;
+    config.heap_minimum = 64 * 1024;
+    config.memory_limit = limit;
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    gc_malloc_static(&gc_, keep, NULL);
+    gc_run(&gc_);
+    GarbageCollectorStats stats;
+    gc_stats(&gc_, &stats);
+    *live = stats.live_bytes;
+    gc_stop(&gc_);
+    return stats.next_trigger_bytes;
+}
+
+static char* test_gc_pacer()
+{
+    GarbageCollector gc_;
+    GarbageCollectorConfig config;
+    GarbageCollectorStats stats;
+    gc_config_default(&config);
+    mu_assert(config.heap_growth == 0 && config.memory_limit == 0,
+              "The byte trigger should be off by default");
+
+    /* A few large objects never reach the count trigger ... */
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    _pacer_garbage(&gc_, 200, 16 * 1024);
+    gc_stats(&gc_, &stats);
+    mu_assert(stats.collections == 0 && stats.next_trigger_bytes == 0,
+              "The count trigger should not collect");
+    gc_stop(&gc_);
+
+    /* ... but the byte trigger collects them */
+    config.heap_growth = 100;
+    config.heap_minimum = 64 * 1024;
+    gc_start_config(&gc_, __builtin_frame_address(0), &config);
+    gc_stats(&gc_, &stats);
+    mu_assert(stats.next_trigger_bytes == 64 * 1024, "An empty heap should grow to the minimum");
+    _pacer_garbage(&gc_, 200, 16 * 1024);
+    gc_stats(&gc_, &stats);
+    mu_assert(stats.collections > 0, "The byte trigger should collect");
+    mu_assert(stats.peak_bytes <= 64 * 1024 + 16 * 1024, "The heap should stay below the trigger");
+    /* ... and does not collect many tiny ones */
+    gc_run(&gc_);
+    gc_stats(&gc_, &stats);
+    size_t collections = stats.collections;
+    _pacer_garbage(&gc_, 1000, 16);
+    gc_stats(&gc_, &stats);
+    mu_assert(stats.collections == collections, "The count trigger should be replaced");
+    gc_stop(&gc_);
+
+    /* The heap grows in proportion to the surviving bytes */
+    size_t live;
+    size_t trigger = _pacer_trigger(100, 0, 48 * 1024, &live);
+    mu_assert(live >= 48 * 1024 && trigger == 2 * live, "The heap should double");
+    trigger = _pacer_trigger(50, 0, 32 * 1024, &live);
+    mu_assert(trigger == 64 * 1024, "The heap should not shrink below the minimum");
+    /* A memory limit lowers the trigger, but leaves some headroom */
+    trigger = _pacer_trigger(100, 80 * 1024, 48 * 1024, &live);
+    mu_assert(trigger == 80 * 1024, "The heap should not grow beyond the limit");
+    trigger = _pacer_trigger(100, 32 * 1024, 48 * 1024, &live);
+    mu_assert(trigger == live + live / 8, "The heap should keep growing beyond the limit");
+    trigger = _pacer_trigger(0, 80 * 1024, 48 * 1024, &live);
+    mu_assert(trigger == 80 * 1024, "A limit should work without the growth trigger");
+    return NULL;
+}
+
+static GarbageCollector* FREEING_GC;
+static void** FREEING_KEEP;
+static size_t FREEING_COUNT;
+static void* FREEING_NEW[8];
+
+/* Frees the live objects in FREEING_KEEP and allocates new ones */
+static void dtor_freeing(void* ptr)
+{
+    UNUSED(ptr);
+    for (size_t i = 0; i < FREEING_COUNT; ++i) {
+        gc_free(FREEING_GC, FREEING_KEEP[i]);
+        FREEING_KEEP[i] = NULL;
+    }
+    for (size_t i = 0; i < sizeof(FREEING_NEW) / sizeof(void*); ++i) {
+        FREEING_NEW[i] = gc_malloc(FREEING_GC, 300);
+    }
+    gc_free(FREEING_GC, ptr);
+    DTOR_COUNT++;
+}
+
+static void _freeing_garbage(GarbageCollector* gc)
+{
+    gc_malloc_ext(gc, 64, dtor_freeing);
+}
+
+static char* test_gc_destructor_frees()
+{
+    /* A destructor that frees live objects shrinks the map below its
+     * capacity, and one that allocates grows it, while the sweep runs */
+    for (int paused = 0; paused < 2; ++paused) {
+        GarbageCollector gc_;
+        gc_start(&gc_, __builtin_frame_address(0));
+        FREEING_GC = &gc_;
+        FREEING_COUNT = 3000;
+        FREEING_KEEP = gc_malloc_static(&gc_, FREEING_COUNT * sizeof(void*), NULL);
+        for (size_t i = 0; i < FREEING_COUNT; ++i) {
+            FREEING_KEEP[i] = gc_malloc(&gc_, 300);
+        }
+        _freeing_garbage(&gc_);
+        if (paused) {
+            gc_pause(&gc_);
+        }
+        size_t capacity = gc_.allocs->capacity;
+        DTOR_COUNT = 0;
+        scrub_stack();
+        gc_run(&gc_);
+        mu_assert(DTOR_COUNT == 1, "The destructor should run");
+        mu_assert(gc_.paused == (paused == 1), "The sweep should not change the pause state");
+        mu_assert(gc_.allocs->size == 1 + sizeof(FREEING_NEW) / sizeof(void*),
+                  "Only the static array and the new objects should be left");
+        mu_assert(gc_.allocs->capacity < capacity, "The map should shrink after the sweep");
+        for (size_t i = 0; i < sizeof(FREEING_NEW) / sizeof(void*); ++i) {
+            mu_assert(gc_allocation_map_get(gc_.allocs, FREEING_NEW[i]) != NULL,
+                      "Objects allocated by a destructor should survive the sweep");
+        }
+        gc_stop(&gc_);
+    }
+    return NULL;
+}
+
+static char* test_log_trace()
+{
+    uint64_t cursor = 0;
+    char buf[LOG_TRACE_LENGTH];
+    /* Skip what other tests traced */
+    while (log_trace_next(&cursor, buf, sizeof(buf)));
+    mu_assert(!log_trace_next(&cursor, buf, sizeof(buf)), "The trace should be drained");
+
+    log_trace("[mark] first %d", 1);
+    log_trace("[sweep] second %s", "message");
+    mu_assert(log_trace_next(&cursor, buf, sizeof(buf)) && strcmp(buf, "[mark] first 1") == 0,
+              "Messages should be read in order");
+    mu_assert(log_trace_next(&cursor, buf, sizeof(buf)) && strcmp(buf, "[sweep] second message") == 0,
+              "Messages should be read in order");
+    mu_assert(!log_trace_next(&cursor, buf, sizeof(buf)), "All messages should be read");
+
+    char small[8];
+    log_trace("[map] %s", "truncated");
+    mu_assert(log_trace_next(&cursor, small, sizeof(small)) && strcmp(small, "[map] t") == 0,
+              "Messages should be truncated to the buffer");
+
+    /* The oldest messages are overwritten */
+    for (int i = 0; i < LOG_TRACE_ENTRIES + 10; ++i) {
+        log_trace("[mark] %d", i);
+    }
+    mu_assert(log_trace_next(&cursor, buf, sizeof(buf)) && strcmp(buf, "[mark] 10") == 0,
+              "Overwritten messages should be skipped");
+    size_t count = 1;
+    while (log_trace_next(&cursor, buf, sizeof(buf))) {
+        count++;
+    }
+    char last[LOG_TRACE_LENGTH];
+    snprintf(last, sizeof(last), "[mark] %d", LOG_TRACE_ENTRIES + 9);
+    mu_assert(count == LOG_TRACE_ENTRIES && strcmp(buf, last) == 0,
+              "The ring buffer should hold the most recent messages");
+    return NULL;
+}
+
 /*
  * Test runner
  */
 
 int tests_run = 0;
 
+#define run_test(test) do { scrub_stack(); mu_run_test(test); } while (0)
+
 static char* test_suite()
 {
     printf("---=[ GC tests\n");
-    mu_run_test(test_gc_allocation_new_delete);
-    mu_run_test(test_gc_allocation_map_new_delete);
-    mu_run_test(test_gc_allocation_map_basic_get);
-    mu_run_test(test_gc_allocation_map_put_get_remove);
-    mu_run_test(test_gc_mark_stack);
-    mu_run_test(test_gc_basic_alloc_free);
-    mu_run_test(test_gc_allocation_map_cleanup);
-    mu_run_test(test_gc_static_allocation);
-    mu_run_test(test_primes);
-    mu_run_test(test_gc_realloc);
-    mu_run_test(test_gc_pause_resume);
-    mu_run_test(test_gc_strdup);
+    run_test(test_gc_allocation_map_inline_metadata);
+    run_test(test_gc_allocation_map_new_delete);
+    run_test(test_gc_allocation_map_basic_get);
+    run_test(test_gc_allocation_map_put_get_remove);
+    run_test(test_gc_allocation_map_pow2);
+    run_test(test_gc_allocation_map_compact);
+    run_test(test_gc_allocation_map_mark_bits);
+    run_test(test_gc_allocation_map_filter);
+    run_test(test_gc_mark_stack);
+    run_test(test_gc_mark_deep_list);
+    run_test(test_gc_mark_stack_overflow);
+#ifndef GC_NO_THREADS
+    run_test(test_gc_mark_parallel);
+#endif
+    run_test(test_gc_deferred_finalizers);
+    run_test(test_gc_destructor_frees);
+    run_test(test_gc_lazy_sweep);
+    run_test(test_gc_incremental_marking);
+    run_test(test_gc_generational);
+#ifndef GC_NO_THREADS
+    run_test(test_gc_multi_threaded);
+    run_test(test_gc_thread_caches);
+    run_test(test_gc_concurrent_marking);
+#endif
+    run_test(test_gc_mark_range_alignment);
+    run_test(test_gc_basic_alloc_free);
+    run_test(test_gc_small_objects);
+    run_test(test_gc_interior_pointers);
+    run_test(test_gc_allocation_map_cleanup);
+    run_test(test_gc_static_allocation);
+    run_test(test_primes);
+    run_test(test_gc_realloc);
+    run_test(test_gc_pause_resume);
+    run_test(test_gc_strdup);
+    run_test(test_gc_stats);
+    run_test(test_gc_hooks);
+    run_test(test_gc_record);
+#ifndef GC_NO_THREADS
+    run_test(test_gc_record_threads);
+#endif
+    run_test(test_gc_dump_heap);
+    run_test(test_gc_profile);
+    run_test(test_gc_pacer);
+    run_test(test_log_trace);
     return 0;
 }
 